@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <cstore/unionfs/tmpl-index.hpp>
+
+using namespace cstore::unionfs;
+
+/* This program builds the precompiled template index (see tmpl-index.hpp)
+ * for a template tree. usage:
+ *
+ *   build_tmpl_index [<template_root> [<index_file>]]
+ *
+ * the default template root is the standard one, and the default index
+ * file is the one the library looks for, i.e., "<template_root>.idx".
+ * it is run at install time and whenever packages install templates.
+ */
+static const char *C_DEF_TMPL_ROOT = "/opt/vyatta/share/vyatta-cfg/templates";
+
+int
+main(int argc, char **argv)
+{
+  if (argc > 3) {
+    fprintf(stderr, "Usage: %s [<template_root> [<index_file>]]\n", argv[0]);
+    exit(1);
+  }
+  string root = (argc > 1 ? argv[1] : C_DEF_TMPL_ROOT);
+  string file = (argc > 2 ? argv[2] : TmplIndex::getIndexFile(root));
+  if (!TmplIndex::build(root, file)) {
+    fprintf(stderr, "Failed to build template index [%s]\n", file.c_str());
+    exit(1);
+  }
+  exit(0);
+}
@@ -0,0 +1,584 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+
+#include <cli_cstore.h>
+#include <cstore/cstore.hpp>
+#include <cnode/cnode.hpp>
+#include <cnode/cnode-algorithm.hpp>
+#include <cparse/cparse.hpp>
+#include <commit/commit-algorithm.hpp>
+
+using namespace cstore;
+using namespace cnode;
+using namespace std;
+
+/* This program benchmarks the hot paths of the library on a synthetic
+ * template tree and config. usage (also "make bench BENCH_ARGS=..."):
+ *
+ *   cfg_bench [-r <rules>] [-v <vlans>] [-d <depth>] [-f <fanout>]
+ *             [-i <iterations>] [-o <set_ops>] [-w <dir>] [-k]
+ *
+ * the generated config contains:
+ *   - "firewall name FW<n> rule <n>" with <rules> rules in total.
+ *   - "interfaces ethernet eth<n> vif <n>" with <vlans> vifs in total.
+ *   - "deep level <v> level <v> ..." nested <depth> levels with <fanout>
+ *     values at each level.
+ * all templates have no-op actions, so commit measures the framework only.
+ *
+ * the session benchmarks (load, set, commit, ...) need a session work dir
+ * under the standard location, i.e., write access to /opt/vyatta/config.
+ * note that commit with the unionfs store also requires union mounts, so
+ * VYATTA_CSTORE_BACKEND=snapshot is needed when not running as root.
+ *
+ * for each benchmark, the latency percentiles of each sample and the
+ * throughput (in the units of the benchmark) are reported.
+ */
+struct BenchOpts {
+  BenchOpts() : rules(10000), vlans(4000), depth(6), fanout(3), iters(5),
+                set_ops(2000), keep(false) {};
+  int rules;
+  int vlans;
+  int depth;
+  int fanout;
+  int iters;
+  int set_ops;
+  bool keep;
+  string dir;
+};
+
+static BenchOpts opts;
+
+////// timing/report
+static double
+_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0);
+}
+
+class BenchResult {
+public:
+  BenchResult(const char *name, const char *unit)
+    : _name(name), _unit(unit), _units(0), _total(0), _start(0),
+      _failed(false) {};
+
+  void begin() { _start = _now_ms(); };
+  void end(size_t units) {
+    double t = _now_ms() - _start;
+    _samples.push_back(t);
+    _total += t;
+    _units += units;
+  };
+  void fail() { _failed = true; };
+  void report() {
+    if (_failed || _samples.size() == 0) {
+      printf("%-12s %s\n", _name, (_failed ? "FAILED" : "skipped"));
+      return;
+    }
+    sort(_samples.begin(), _samples.end());
+    printf("%-12s %7zu %12.0f %-8s %9.3f %9.3f %9.3f %9.3f\n", _name,
+           _samples.size(), (_total > 0 ? (_units * 1000.0 / _total) : 0),
+           _unit, pct(50), pct(90), pct(99), _samples.back());
+  };
+
+private:
+  const char *_name;
+  const char *_unit;
+  vector<double> _samples;
+  double _units;
+  double _total;
+  double _start;
+  bool _failed;
+
+  double pct(int p) {
+    size_t idx = (_samples.size() * p + 99) / 100;
+    return _samples[(idx > 0 ? idx - 1 : 0)];
+  };
+};
+
+static void
+_report_header()
+{
+  printf("%-12s %7s %12s %-8s %9s %9s %9s %9s\n", "benchmark", "samples",
+         "throughput", "(/sec)", "p50(ms)", "p90(ms)", "p99(ms)", "max(ms)");
+}
+
+////// generation
+static bool
+_write_file(const string& file, const string& data)
+{
+  FILE *f = fopen(file.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "Failed to create [%s]\n", file.c_str());
+    return false;
+  }
+  fwrite(data.c_str(), data.length(), 1, f);
+  fclose(f);
+  return true;
+}
+
+static bool
+_add_tmpl(const string& root, const string& path, const string& def)
+{
+  string dir = root + "/" + path;
+  try {
+    boost::filesystem::create_directories(dir);
+  } catch (...) {
+    fprintf(stderr, "Failed to create [%s]\n", dir.c_str());
+    return false;
+  }
+  return _write_file(dir + "/node.def", def);
+}
+
+static bool
+_gen_tmpls(const string& root)
+{
+  string fw = "firewall";
+  string fwr = fw + "/name/node.tag/rule/node.tag";
+  string eth = "interfaces/ethernet";
+  string vif = eth + "/node.tag/vif/node.tag";
+  if (!_add_tmpl(root, fw, "priority: 400\nend: true\n")
+      || !_add_tmpl(root, fw + "/name", "tag:\ntype: txt\n")
+      || !_add_tmpl(root, fw + "/name/node.tag/rule", "tag:\ntype: u32\n")
+      || !_add_tmpl(root, fwr + "/action",
+                    "type: txt\nsyntax:expression: $VAR(@) in "
+                    "\"accept\", \"drop\", \"reject\"\n")
+      || !_add_tmpl(root, fwr + "/description", "type: txt\n")
+      || !_add_tmpl(root, fwr + "/source/address", "type: txt\n")
+      || !_add_tmpl(root, fwr + "/destination/port", "type: txt\n")
+      || !_add_tmpl(root, "interfaces", "")
+      || !_add_tmpl(root, eth, "tag:\ntype: txt\npriority: 300\nend: true\n")
+      || !_add_tmpl(root, eth + "/node.tag/description", "type: txt\n")
+      || !_add_tmpl(root, eth + "/node.tag/vif",
+                    "tag:\ntype: u32\npriority: 310\n")
+      || !_add_tmpl(root, vif + "/address", "multi:\ntype: txt\n")
+      || !_add_tmpl(root, vif + "/description", "type: txt\n")
+      || !_add_tmpl(root, vif + "/disable", "")) {
+    return false;
+  }
+  string d = "deep";
+  if (!_add_tmpl(root, d, "priority: 500\n")) {
+    return false;
+  }
+  for (int i = 0; i < opts.depth; i++) {
+    d += "/level";
+    if (!_add_tmpl(root, d, "tag:\ntype: txt\n")) {
+      return false;
+    }
+    d += "/node.tag";
+  }
+  return _add_tmpl(root, d + "/value", "type: txt\n");
+}
+
+static void
+_gen_deep(string& cfg, int level, const string& indent)
+{
+  if (level == opts.depth) {
+    cfg += indent + "value x\n";
+    return;
+  }
+  char buf[64];
+  for (int i = 0; i < opts.fanout; i++) {
+    snprintf(buf, sizeof(buf), "level l%d-%d {\n", level, i);
+    cfg += indent + buf;
+    _gen_deep(cfg, level + 1, indent + "    ");
+    cfg += indent + "}\n";
+  }
+}
+
+// returns number of config nodes
+static size_t
+_gen_cfg(string& cfg)
+{
+  static const char *acts[] = { "accept", "drop", "reject" };
+  const int rules_per_name = 100;
+  const int vifs_per_eth = 1000;
+  char buf[256];
+  size_t nodes = 0;
+
+  cfg = "firewall {\n";
+  for (int r = 0; r < opts.rules; r++) {
+    if (r % rules_per_name == 0) {
+      if (r > 0) {
+        cfg += "    }\n";
+      }
+      snprintf(buf, sizeof(buf), "    name FW%d {\n", r / rules_per_name);
+      cfg += buf;
+    }
+    snprintf(buf, sizeof(buf),
+             "        rule %d {\n"
+             "            action %s\n"
+             "            description \"rule %d\"\n"
+             "            destination {\n"
+             "                port %d\n"
+             "            }\n"
+             "            source {\n"
+             "                address 10.%d.%d.0/24\n"
+             "            }\n"
+             "        }\n",
+             r % rules_per_name + 1, acts[r % 3], r, 1024 + r,
+             (r >> 8) & 0xff, r & 0xff);
+    cfg += buf;
+    nodes += 5;
+  }
+  cfg += (opts.rules > 0 ? "    }\n}\n" : "}\n");
+
+  cfg += "interfaces {\n";
+  for (int v = 0; v < opts.vlans; v++) {
+    if (v % vifs_per_eth == 0) {
+      if (v > 0) {
+        cfg += "    }\n";
+      }
+      snprintf(buf, sizeof(buf), "    ethernet eth%d {\n"
+               "        description \"eth%d\"\n",
+               v / vifs_per_eth, v / vifs_per_eth);
+      cfg += buf;
+    }
+    snprintf(buf, sizeof(buf),
+             "        vif %d {\n"
+             "            address 172.%d.%d.1/24\n"
+             "            address 2001:db8:%x::1/64\n"
+             "            description \"vlan %d\"\n"
+             "        }\n",
+             v % vifs_per_eth + 1, 16 + ((v >> 8) & 0xf), v & 0xff, v, v);
+    cfg += buf;
+    nodes += 3;
+  }
+  cfg += (opts.vlans > 0 ? "    }\n}\n" : "}\n");
+
+  cfg += "deep {\n";
+  _gen_deep(cfg, 0, "    ");
+  cfg += "}\n";
+  size_t leaves = 1;
+  for (int i = 0; i < opts.depth; i++) {
+    leaves *= opts.fanout;
+  }
+  nodes += leaves;
+  return nodes;
+}
+
+////// benchmarks
+// run f with stdout going to /dev/null
+template<class F> static void
+_run_quiet(F& f)
+{
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  if (saved < 0 || devnull < 0) {
+    f();
+  } else {
+    dup2(devnull, STDOUT_FILENO);
+    f();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+  }
+  if (saved >= 0) {
+    close(saved);
+  }
+  if (devnull >= 0) {
+    close(devnull);
+  }
+}
+
+struct ShowDiff {
+  ShowDiff(const CfgNode& a, const CfgNode& w) : aroot(a), wroot(w) {};
+  void operator()() {
+    Cpath p;
+    show_cfg_diff(aroot, wroot, p);
+  };
+  const CfgNode& aroot;
+  const CfgNode& wroot;
+};
+
+struct Commit {
+  Commit(Cstore& c) : cs(c), ret(false) {};
+  void operator()() {
+    Cpath p;
+    CfgArena arena;
+    tr1::shared_ptr<CfgNode> aroot, wroot;
+    CfgNode::buildChangedActiveWorking(cs, p, aroot, wroot, &arena);
+    ret = commit::doCommit(cs, *aroot, *wroot);
+  };
+  Cstore& cs;
+  bool ret;
+};
+
+static void
+_bench_parse(Cstore& cs, const string& file, size_t nodes)
+{
+  BenchResult r("parse", "nodes");
+  BenchResult f("tree_free", "nodes");
+  for (int i = 0; i < opts.iters; i++) {
+    CfgArena *arena = new CfgArena();
+    r.begin();
+    CfgNode *root = cparse::parse_file(file.c_str(), cs, arena);
+    r.end(nodes);
+    if (!root) {
+      delete arena;
+      r.fail();
+      break;
+    }
+    f.begin();
+    delete root;
+    delete arena;
+    f.end(nodes);
+  }
+  r.report();
+  f.report();
+}
+
+static void
+_bench_session(Cstore& cs, const string& file, const string& empty,
+               size_t nodes)
+{
+  BenchResult load("load", "nodes");
+  BenchResult set("set", "ops");
+  BenchResult build("tree_build", "nodes");
+  BenchResult cdiff("cmds_diff", "nodes");
+  BenchResult sdiff("show_diff", "nodes");
+  BenchResult cadd("commit_add", "nodes");
+  BenchResult cdel("commit_del", "nodes");
+
+  // set commands for the "set" benchmark
+  vector<Cpath> set_list, com_list;
+  CfgNode *froot = cparse::parse_file(file.c_str(), cs);
+  if (froot) {
+    get_cmds(*froot, set_list, com_list);
+    delete froot;
+  }
+  size_t step = (opts.set_ops > 0 && set_list.size() > (size_t) opts.set_ops
+                 ? set_list.size() / opts.set_ops : 1);
+
+  for (int i = 0; i < opts.iters; i++) {
+    // load the whole config into the empty working config
+    load.begin();
+    bool ok = cs.loadFile(file.c_str());
+    load.end(nodes);
+    if (!ok) {
+      load.fail();
+      break;
+    }
+
+    Cpath p;
+    build.begin();
+    CfgArena arena;
+    tr1::shared_ptr<CfgNode> ap, wp;
+    CfgNode::buildActiveWorking(cs, p, ap, wp, &arena);
+    CfgNode& aroot = *ap;
+    CfgNode& wroot = *wp;
+    build.end(nodes);
+
+    vector<Cpath> dl, sl, cl;
+    cdiff.begin();
+    get_cmds_diff(aroot, wroot, dl, sl, cl);
+    cdiff.end(nodes);
+
+    ShowDiff sd(aroot, wroot);
+    sdiff.begin();
+    _run_quiet(sd);
+    sdiff.end(nodes);
+
+    if (!cs.discardChanges()) {
+      set.fail();
+      break;
+    }
+    for (size_t j = 0; j < set_list.size(); j += step) {
+      set.begin();
+      ok = (cs.validateSetPath(set_list[j]) && cs.setCfgPath(set_list[j]));
+      set.end(1);
+      if (!ok) {
+        set.fail();
+        break;
+      }
+    }
+    cs.discardChanges();
+  }
+
+  // commit: alternate between adding and deleting the whole config
+  for (int i = 0; i < opts.iters; i++) {
+    Commit c(cs);
+    if (!cs.loadFile(file.c_str())) {
+      cadd.fail();
+      break;
+    }
+    cadd.begin();
+    _run_quiet(c);
+    cadd.end(nodes);
+    if (!c.ret) {
+      cadd.fail();
+      break;
+    }
+    if (!cs.loadFile(empty.c_str())) {
+      cdel.fail();
+      break;
+    }
+    cdel.begin();
+    _run_quiet(c);
+    cdel.end(nodes);
+    if (!c.ret) {
+      cdel.fail();
+      break;
+    }
+  }
+
+  load.report();
+  set.report();
+  build.report();
+  cdiff.report();
+  sdiff.report();
+  cadd.report();
+  cdel.report();
+}
+
+////// main
+static void
+_usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-r <rules>] [-v <vlans>] [-d <depth>] "
+          "[-f <fanout>]\n          [-i <iterations>] [-o <set_ops>] "
+          "[-w <dir>] [-k]\n", prog);
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  int c;
+  while ((c = getopt(argc, argv, "r:v:d:f:i:o:w:k")) != -1) {
+    switch (c) {
+    case 'r':
+      opts.rules = atoi(optarg);
+      break;
+    case 'v':
+      opts.vlans = atoi(optarg);
+      break;
+    case 'd':
+      opts.depth = atoi(optarg);
+      break;
+    case 'f':
+      opts.fanout = atoi(optarg);
+      break;
+    case 'i':
+      opts.iters = atoi(optarg);
+      break;
+    case 'o':
+      opts.set_ops = atoi(optarg);
+      break;
+    case 'w':
+      opts.dir = optarg;
+      break;
+    case 'k':
+      opts.keep = true;
+      break;
+    default:
+      _usage(argv[0]);
+    }
+  }
+  if (opts.iters < 1 || opts.depth < 0 || opts.fanout < 1) {
+    _usage(argv[0]);
+  }
+
+  if (opts.dir.empty()) {
+    char tmp[] = "/tmp/cfg_bench.XXXXXX";
+    if (!mkdtemp(tmp)) {
+      fprintf(stderr, "Failed to create work dir\n");
+      exit(1);
+    }
+    opts.dir = tmp;
+  }
+  string tmpl = opts.dir + "/templates";
+  string active = opts.dir + "/active";
+  string file = opts.dir + "/config.boot";
+  string empty = opts.dir + "/empty.boot";
+  string cfg;
+  size_t nodes = _gen_cfg(cfg);
+  if (!_gen_tmpls(tmpl) || !_write_file(file, cfg)
+      || !_write_file(empty, "")) {
+    exit(1);
+  }
+  mkdir(active.c_str(), 0755);
+  printf("config: %d rules, %d vifs, depth %d x %d (%zu nodes, %zu bytes)\n",
+         opts.rules, opts.vlans, opts.depth, opts.fanout, nodes,
+         cfg.length());
+
+  // session dirs (see top)
+  char sfx[32];
+  snprintf(sfx, sizeof(sfx), "bench%d", (int) getpid());
+  string cfg_root = "/opt/vyatta/config/tmp/";
+  string work = cfg_root + "new_config_" + sfx;
+  string change = cfg_root + "changes_only_" + sfx;
+  string tmp = cfg_root + "tmp_" + sfx;
+  setenv("VYATTA_CONFIG_TEMPLATE", tmpl.c_str(), 1);
+  setenv("VYATTA_ACTIVE_CONFIGURATION_DIR", active.c_str(), 1);
+  setenv("VYATTA_TEMP_CONFIG_DIR", work.c_str(), 1);
+  setenv("VYATTA_CHANGES_ONLY_DIR", change.c_str(), 1);
+  setenv("VYATTA_CONFIG_TMP", tmp.c_str(), 1);
+
+  Cstore *cs = Cstore::createCstore(false);
+  _report_header();
+  _bench_parse(*cs, file, nodes);
+
+  bool session = false;
+  try {
+    boost::filesystem::create_directories(work);
+    boost::filesystem::create_directories(change);
+    boost::filesystem::create_directories(tmp);
+    session = true;
+  } catch (...) {
+  }
+  delete cs;
+  cs = Cstore::createCstore(false);
+  if (session && (cs->inSession() || cs->setupSession())
+      && cs->inSession()) {
+    _bench_session(*cs, file, empty, nodes);
+  } else {
+    printf("session benchmarks skipped (cannot create session in [%s])\n",
+           cfg_root.c_str());
+  }
+  delete cs;
+
+  if (session) {
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(work + ".snap", ec);
+    boost::filesystem::remove_all(work, ec);
+    boost::filesystem::remove_all(change, ec);
+    boost::filesystem::remove_all(tmp, ec);
+  }
+  if (!opts.keep) {
+    boost::system::error_code ec;
+    boost::filesystem::remove_all(opts.dir, ec);
+  } else {
+    printf("work dir: %s\n", opts.dir.c_str());
+  }
+  exit(0);
+}
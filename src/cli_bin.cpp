@@ -19,12 +19,14 @@
 #include <cstring>
 #include <vector>
 #include <string>
+#include <iostream>
 #include <libgen.h>
 
 #include <cli_cstore.h>
 #include <cstore/cstore.hpp>
 #include <cnode/cnode.hpp>
 #include <commit/commit-algorithm.hpp>
+#include <commit/commit-profile.hpp>
 
 using namespace cstore;
 
@@ -40,6 +42,7 @@ static const char *op_bin_name[] = {
   "my_discard",
   "my_move",
   "my_commit",
+  "my_batch",
   NULL
 };
 static const char *op_Str[] = {
@@ -53,6 +56,7 @@ static const char *op_Str[] = {
   "Discard",
   "Move",
   "Commit",
+  "Batch",
   NULL
 };
 static const char *op_str[] = {
@@ -66,6 +70,7 @@ static const char *op_str[] = {
   "discard",
   "move",
   "commit",
+  "batch",
   NULL
 };
 static const bool op_need_cfg_node_args[] = {
@@ -79,6 +84,7 @@ static const bool op_need_cfg_node_args[] = {
   false,
   true,
   false,
+  false,
   false // dummy
 };
 static const bool op_use_edit_level[] = {
@@ -92,6 +98,7 @@ static const bool op_use_edit_level[] = {
   true,
   true,
   false,
+  false,
   false // dummy
 };
 #define OP_Str op_Str[op_idx]
@@ -197,9 +204,118 @@ static void
 doCommit(Cstore& cstore, const Cpath& path_comps)
 {
   Cpath dummy;
-  cnode::CfgNode aroot(cstore, dummy, true, true);
-  cnode::CfgNode wroot(cstore, dummy, false, true);
-  if (!commit::doCommit(cstore, aroot, wroot)) {
+  commit::CommitProfile::start();
+  commit::CommitProfile::Event ev("phase", "tree_build");
+  cnode::CfgArena arena;
+  tr1::shared_ptr<cnode::CfgNode> aroot, wroot;
+  cnode::CfgNode::buildChangedActiveWorking(cstore, dummy, aroot, wroot,
+                                            &arena);
+  ev.end();
+  bool ret = commit::doCommit(cstore, *aroot, *wroot);
+  commit::CommitProfile::finish();
+  if (!ret) {
+    exit(1);
+  }
+}
+
+/* split a command line into words. words are separated by whitespace.
+ * single quotes preserve everything up to the next single quote. double
+ * quotes and backslashes work as in the shell.
+ * return true if successful. otherwise (unterminated quote) return false.
+ */
+static bool
+split_cmd_line(const string& line, vector<string>& words)
+{
+  string word;
+  bool in_word = false;
+  char quote = 0;
+  for (size_t i = 0; i < line.length(); i++) {
+    char c = line[i];
+    if (quote == '\'') {
+      if (c == '\'') {
+        quote = 0;
+      } else {
+        word += c;
+      }
+    } else if (c == '\\' && (i + 1) < line.length()
+               && (!quote || line[i + 1] == '"' || line[i + 1] == '\\')) {
+      word += line[++i];
+      in_word = true;
+    } else if (quote == '"') {
+      if (c == '"') {
+        quote = 0;
+      } else {
+        word += c;
+      }
+    } else if (c == '\'' || c == '"') {
+      quote = c;
+      in_word = true;
+    } else if (c == ' ' || c == '\t' || c == '\r') {
+      if (in_word) {
+        words.push_back(word);
+        word.clear();
+        in_word = false;
+      }
+    } else {
+      word += c;
+      in_word = true;
+    }
+  }
+  if (quote) {
+    return false;
+  }
+  if (in_word) {
+    words.push_back(word);
+  }
+  return true;
+}
+
+/* read "set", "delete", and "comment" commands (one per line) from stdin
+ * and apply them in that order as one batch (see Cstore::applyCommands()).
+ * empty lines and lines starting with "#" are ignored.
+ */
+static void
+doBatch(Cstore& cstore, const Cpath& args)
+{
+  if (args.size() > 0) {
+    OUTPUT_USER("Invalid batch command\n");
+    bye("invalid batch command\n");
+  }
+  vector<Cstore::BatchCmdT> cmds;
+  string line;
+  unsigned int lnum = 0;
+  while (getline(cin, line)) {
+    ++lnum;
+    vector<string> words;
+    if (!split_cmd_line(line, words)) {
+      OUTPUT_USER("Unterminated quote at line %u\n", lnum);
+      bye("invalid batch input\n");
+    }
+    if (words.size() == 0 || words[0][0] == '#') {
+      continue;
+    }
+    Cpath path_comps;
+    for (size_t i = 1; i < words.size(); i++) {
+      path_comps.push(words[i]);
+    }
+    unsigned int op = 0;
+    bool valid = (path_comps.size() > 0);
+    if (words[0] == "set") {
+      op = Cstore::CMD_SET;
+    } else if (words[0] == "delete") {
+      op = Cstore::CMD_DELETE;
+    } else if (words[0] == "comment") {
+      op = Cstore::CMD_COMMENT;
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      OUTPUT_USER("Invalid command at line %u\n", lnum);
+      bye("invalid batch input\n");
+    }
+    cmds.push_back(Cstore::BatchCmdT(op, path_comps));
+  }
+  if (!cstore.applyCommands(cmds)) {
     exit(1);
   }
 }
@@ -217,6 +333,7 @@ OpFuncT OpFunc[] = {
   &doDiscard,
   &doMove,
   &doCommit,
+  &doBatch,
   NULL
 };
 
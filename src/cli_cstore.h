@@ -109,12 +109,15 @@ typedef struct {
   boolean    tag;
   boolean    multi;
   vtw_list   actions[top_act];
+  char      *def_depends;
 } vtw_def;
 
 /* extern variables */
 extern void *var_ref_handle;
 extern FILE *out_stream;
 extern FILE *err_stream;
+extern int last_action_status;
+extern unsigned long long action_output_bytes;
 
 /* note that some functions may be used outside the actual CLI operations,
  * so output may not have been initialized. nop in such cases.
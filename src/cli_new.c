@@ -18,7 +18,11 @@
 #endif
 
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
 #include <dirent.h>
+#include <poll.h>
+#include <spawn.h>
 #include <limits.h>
 #include <stdarg.h>
 #include "cli_val.h"
@@ -2062,6 +2066,12 @@ FILE *err_stream = NULL;
 int new_out_fd = -1;
 int new_err_fd = -1;
 
+/* result of the last executed action and total bytes of action output
+ * (for commit profiling).
+ */
+int last_action_status = 0;
+unsigned long long action_output_bytes = 0;
+
 int
 initialize_output(const char *op)
 {
@@ -2136,16 +2146,60 @@ restore_output(void)
   return 0;
 }
 
+/* action executor.
+ *
+ * actions are started with posix_spawn() (i.e., vfork-style, without
+ * duplicating the address space of this potentially large process), and
+ * their output (stdout and stderr) is captured through a pipe using poll().
+ * if pidfd is available, the exit of the action is also detected through
+ * poll(), so there is no timeout tick. otherwise, fall back to checking
+ * the child every 100 ms as before.
+ *
+ * note that we do not wait for EOF on the pipe once the action process
+ * has exited since its descendants may keep the pipe open (see bug 6771
+ * comment below). any output already in the pipe is still read.
+ *
+ * if the VYOS_DEBUG environment variable is set, the wall time of each
+ * action is reported.
+ */
+#define ACTION_BUF_SIZE 65536
+#define ACTION_POLL_TICK_MS 100
+
+typedef struct {
+  char *cmd;
+  const char *prepend_msg;
+  boolean eloc;
+  pid_t pid;
+  int fd;
+  int pidfd;
+  int exited;
+  int status;
+  int prepend;
+  struct timespec start;
+} exec_action;
+
+static void
+init_exec_action(exec_action *a, char *cmd, const char *prepend_msg,
+                 boolean eloc)
+{
+  memset(a, 0, sizeof(*a));
+  a->cmd = cmd;
+  a->prepend_msg = prepend_msg;
+  a->eloc = eloc;
+  a->pid = -1;
+  a->fd = -1;
+  a->pidfd = -1;
+  a->prepend = 1;
+}
+
 static int
-system_out(char *cmd, const char *prepend_msg, boolean eloc)
+spawn_action(exec_action *a)
 {
+  extern char **environ;
   int pfd[2];
+  posix_spawn_file_actions_t fa;
+  char *eargs[] = { "sh", "-c", a->cmd, NULL };
   int ret;
-  pid_t cpid;
-
-  if (!cmd || (ret = pipe(pfd)) != 0) {
-    return -1;
-  }
 
   /* note that the process management mechanism here is a new implementation.
    * this fixes bug 6771, which was broken by the change introduced in
@@ -2165,191 +2219,737 @@ system_out(char *cmd, const char *prepend_msg, boolean eloc)
    *
    * the new process management mechanism below does not have this problem.
    */
-  if ((cpid = fork())) {
-    int status;
-    int waited = 0;
-    int prepend = 1;
-
+  if (!a->cmd || pipe(pfd) != 0) {
+    return -1;
+  }
+  /* don't leak the pipe into other processes started by this one (e.g.,
+   * the action worker). dup2() in the child clears the flag on
+   * stdout/stderr.
+   */
+  fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+  if (posix_spawn_file_actions_init(&fa) != 0) {
+    close(pfd[0]);
     close(pfd[1]);
+    return -1;
+  }
+  posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, pfd[1], STDERR_FILENO);
+  clock_gettime(CLOCK_MONOTONIC, &(a->start));
+  ret = posix_spawn(&(a->pid), "/bin/sh", &fa, NULL, eargs, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  close(pfd[1]);
+  if (ret != 0) {
+    close(pfd[0]);
+    a->pid = -1;
+    fprintf(stderr, "spawn failed\n");
+    return -1;
+  }
+  a->fd = pfd[0];
+#ifdef SYS_pidfd_open
+  a->pidfd = syscall(SYS_pidfd_open, a->pid, 0);
+#endif
+  return 0;
+}
 
-    if (cpid == -1) {
-      close(pfd[0]);
-      fprintf(stderr, "fork failed\n");
-      return -1;
-    }
+/* output the specified chunk of action output. returns -1 if failed. */
+static int
+output_action(exec_action *a, char *buf, ssize_t count)
+{
+  char *out = buf;
 
-    while (1) {
-      int sret;
-      fd_set readfds;
-      struct timeval timeout;
-      FD_ZERO(&readfds);
-      FD_SET(pfd[0], &readfds);
-      timeout.tv_sec = 0;
-      timeout.tv_usec = 100000;
-      sret = select(pfd[0] + 1, &readfds, NULL, NULL, &timeout);
-      if (sret == 1) {
-        /* ready for read */
-        char buf[128];
-        char *out = buf;
-        ssize_t count = read(pfd[0], buf, 128);
-        if (count <= 0) {
-          /* eof or error */
-          break;
-        }
+  /* XXX XXX XXX BEGIN emulating original "error" location handling */
 
-        /* XXX XXX XXX BEGIN emulating original "error" location handling */
-
-        /* the following code segment is the "logic" for handling "error"
-         * location in the original impl. (note that this code is preserved
-         * here for demonstration purpose. this is not "commented-out"
-         * code.)
-         */
-        /***
-        if (first == TRUE) {
-          if (strncmp(buf,errloc_buf,errloc_len) == 0) {
-            if (format == FALSE) {
-              fprintf(out_stream,"%s",buf+errloc_len);
-            }
-            else {
-              fprintf(out_stream,"%s",buf);
-            }
-          } else {
-            //currently set to format option for GUI client.
-            if (prepend_msg != NULL) {
-              if (format == FALSE) {
-                fprintf(out_stream,"[%s]\n%s",prepend_msg,buf);
-              } else {
-                fprintf(out_stream,"%s[%s]\n%s",errloc_buf,prepend_msg,buf);
-              }
-            }
-          }
+  /* the following code segment is the "logic" for handling "error"
+   * location in the original impl. (note that this code is preserved
+   * here for demonstration purpose. this is not "commented-out"
+   * code.)
+   */
+  /***
+  if (first == TRUE) {
+    if (strncmp(buf,errloc_buf,errloc_len) == 0) {
+      if (format == FALSE) {
+        fprintf(out_stream,"%s",buf+errloc_len);
+      }
+      else {
+        fprintf(out_stream,"%s",buf);
+      }
+    } else {
+      //currently set to format option for GUI client.
+      if (prepend_msg != NULL) {
+        if (format == FALSE) {
+          fprintf(out_stream,"[%s]\n%s",prepend_msg,buf);
         } else {
-          if (strncmp(buf,errloc_buf,errloc_len) == 0 && format == FALSE) {
-            fprintf(out_stream,"%s",buf+errloc_len);
-          } else {
-            fprintf(out_stream,"%s",buf);
-          }
+          fprintf(out_stream,"%s[%s]\n%s",errloc_buf,prepend_msg,buf);
         }
-        ***/
-        /* XXX analysis of above:
-         * the main issue is that this seems to indicate that the "error"
-         * location can actually be prepended in two different layers (the
-         * layer here and the actual command output). the "logic" above
-         * seems to be:
-         *   (1) for first buffer read
-         *     (A) if the lower layer has already prepended "errloc" string
-         *       (a) if we DON'T want errloc string, then strip it from
-         *           the lower-layer output.
-         *       (b) if we DO want the string, let it pass through
-         *     (B) if the lower layer did not prepend
-         *       (a) if we DON'T want errloc, don't prepend it here
-         *       (b) if we DO want the string, prepend it here
-         *   (2) for any subsequent buffer reads
-         *     (A) if lower layer prepended errloc AND we DON'T want errloc,
-         *         strip it from output
-         *     (B) otherwise (lower layer did not prepend OR
-         *         we DO want errloc), let it pass through
-         *
-         * note that the handling of subsequent buffer reads makes no sense.
-         * the reads can start at any offsets, so if we actually need to
-         * strip out any errloc string at the start of any subsequent reads
-         * from the command output, then something is very broken here.
-         *
-         * secondly, assuming (2) is in fact not needed, the main issue
-         * in (1) is the fact that the errloc string can be prepended in two
-         * different layers, resulting in the "logic" seen above. if the
-         * eventual appearance (i.e., errloc or not) is completely determined
-         * in this layer here, then such a "design" choice is weird.
-         *
-         * given the resource availability, at the moment, the only feasible
-         * approach here is to emulate the original impl's behavior in terms
-         * of "errloc".
-         *
-         * another (unrelated) issue is that the original impl assumes the
-         * buffer reads do not contain any '\0' bytes since it uses
-         * fprintf() to output the buffer. A '\0' byte will cause the rest
-         * of the buffer to be truncated. the new impl does not have this
-         * problem.
-         *
-         * the logic below emulates the case (1) in the original impl and
-         * ignores case (2). if somehow case (2) is indeed necessary, we
-         * should really take a good look at the reason and fix the
-         * underlying problem. (heck, even (1) is fugly as hell, but
-         * right now it's simply not feasible to look into it.)
-         */
-        if (prepend && out_stream != NULL) {
-          prepend = 0;
-
-          /* XXX follow original behavior */
+      }
+    }
+  } else {
+    if (strncmp(buf,errloc_buf,errloc_len) == 0 && format == FALSE) {
+      fprintf(out_stream,"%s",buf+errloc_len);
+    } else {
+      fprintf(out_stream,"%s",buf);
+    }
+  }
+  ***/
+  /* XXX analysis of above:
+   * the main issue is that this seems to indicate that the "error"
+   * location can actually be prepended in two different layers (the
+   * layer here and the actual command output). the "logic" above
+   * seems to be:
+   *   (1) for first buffer read
+   *     (A) if the lower layer has already prepended "errloc" string
+   *       (a) if we DON'T want errloc string, then strip it from
+   *           the lower-layer output.
+   *       (b) if we DO want the string, let it pass through
+   *     (B) if the lower layer did not prepend
+   *       (a) if we DON'T want errloc, don't prepend it here
+   *       (b) if we DO want the string, prepend it here
+   *   (2) for any subsequent buffer reads
+   *     (A) if lower layer prepended errloc AND we DON'T want errloc,
+   *         strip it from output
+   *     (B) otherwise (lower layer did not prepend OR
+   *         we DO want errloc), let it pass through
+   *
+   * note that the handling of subsequent buffer reads makes no sense.
+   * the reads can start at any offsets, so if we actually need to
+   * strip out any errloc string at the start of any subsequent reads
+   * from the command output, then something is very broken here.
+   *
+   * secondly, assuming (2) is in fact not needed, the main issue
+   * in (1) is the fact that the errloc string can be prepended in two
+   * different layers, resulting in the "logic" seen above. if the
+   * eventual appearance (i.e., errloc or not) is completely determined
+   * in this layer here, then such a "design" choice is weird.
+   *
+   * given the resource availability, at the moment, the only feasible
+   * approach here is to emulate the original impl's behavior in terms
+   * of "errloc".
+   *
+   * another (unrelated) issue is that the original impl assumes the
+   * buffer reads do not contain any '\0' bytes since it uses
+   * fprintf() to output the buffer. A '\0' byte will cause the rest
+   * of the buffer to be truncated. the new impl does not have this
+   * problem.
+   *
+   * the logic below emulates the case (1) in the original impl and
+   * ignores case (2). if somehow case (2) is indeed necessary, we
+   * should really take a good look at the reason and fix the
+   * underlying problem. (heck, even (1) is fugly as hell, but
+   * right now it's simply not feasible to look into it.)
+   */
+  if (a->prepend && out_stream != NULL) {
+    a->prepend = 0;
+
+    /* XXX follow original behavior */
 #define errloc_str "_errloc_:"
 #define errloc_len 9
-          if (count > errloc_len
-              && memcmp(buf, errloc_str, errloc_len) == 0) {
-            /* XXX lower-layer already prepended errloc, so strip it out if
-             * we don't want errloc. AND in such cases we don't want the
-             * prepend_msg either. (!?)
-             *  It looks like the lower layer will print _errloc_:[prepend_msg]
-             * see Vyatta::Config::outputError in perl. 
-             * This is why when stripping errloc we don't want prepend_msg. 
-             */
-            out = (eloc ? buf : (buf + errloc_len));
-            count = (eloc ? count : (count - errloc_len));
-          } else {
-            /* XXX lower-layer did not prepend errloc */
-            if (eloc) {
-              /* XXX prepend errloc since we want it */
-              fprintf(out_stream, "%s", errloc_str);
-            }
-            /* XXX and in such cases we DO want prepend_msg */
-            if (prepend_msg) {
-              fprintf(out_stream, "[%s]\n", prepend_msg);
-            }
-          }
+    if (count > errloc_len
+        && memcmp(buf, errloc_str, errloc_len) == 0) {
+      /* XXX lower-layer already prepended errloc, so strip it out if
+       * we don't want errloc. AND in such cases we don't want the
+       * prepend_msg either. (!?)
+       *  It looks like the lower layer will print _errloc_:[prepend_msg]
+       * see Vyatta::Config::outputError in perl. 
+       * This is why when stripping errloc we don't want prepend_msg. 
+       */
+      out = (a->eloc ? buf : (buf + errloc_len));
+      count = (a->eloc ? count : (count - errloc_len));
+    } else {
+      /* XXX lower-layer did not prepend errloc */
+      if (a->eloc) {
+        /* XXX prepend errloc since we want it */
+        fprintf(out_stream, "%s", errloc_str);
+      }
+      /* XXX and in such cases we DO want prepend_msg */
+      if (a->prepend_msg) {
+        fprintf(out_stream, "[%s]\n", a->prepend_msg);
+      }
+    }
 #undef errloc_str
 #undef errloc_len
-        }
+  }
 
-        /* XXX XXX XXX END emulating original "error" location handling */
-        if (out_stream != NULL) {
-          if (fwrite(out, count, 1, out_stream) != 1) {
-	    close(pfd[0]);
-            return -1;
-          }
-          fflush(out_stream);
+  /* XXX XXX XXX END emulating original "error" location handling */
+
+  action_output_bytes += count;
+  if (out_stream != NULL) {
+    if (fwrite(out, count, 1, out_stream) != 1) {
+      return -1;
+    }
+    fflush(out_stream);
+  }
+  return 0;
+}
+
+/* read and output the available output of the action. returns 0 if more
+ * output may come, 1 at EOF, and -1 if failed.
+ */
+static int
+read_action(exec_action *a, char *buf)
+{
+  ssize_t count = read(a->fd, buf, ACTION_BUF_SIZE);
+  if (count < 0 && errno == EINTR) {
+    return 0;
+  }
+  if (count <= 0) {
+    /* eof or error (or nothing left to drain) */
+    return 1;
+  }
+  return output_action(a, buf, count);
+}
+
+static void
+report_action_time(exec_action *a)
+{
+  if (getenv("VYOS_DEBUG") && out_stream != NULL) {
+    struct timespec now;
+    long ms;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - a->start.tv_sec) * 1000
+         + (now.tv_nsec - a->start.tv_nsec) / 1000000;
+    fprintf(out_stream, "Elapsed %ld.%03ld sec: [%s]\n",
+            ms / 1000, ms % 1000, a->cmd);
+  }
+}
+
+static void
+finish_action(exec_action *a, int status)
+{
+  a->exited = 1;
+  a->status = status;
+  if (a->pidfd >= 0) {
+    close(a->pidfd);
+    a->pidfd = -1;
+  }
+  if (a->fd >= 0) {
+    /* drain whatever is already in the pipe without waiting for EOF */
+    fcntl(a->fd, F_SETFL, fcntl(a->fd, F_GETFL) | O_NONBLOCK);
+  }
+  report_action_time(a);
+}
+
+static void
+check_action_exit(exec_action *a)
+{
+  int status;
+  if (!a->exited && a->pid > 0
+      && waitpid(a->pid, &status, WNOHANG) == a->pid) {
+    finish_action(a, status);
+  }
+}
+
+/* run the action and wait for it to exit. returns -1 if an error
+ * occurred. exit status of the action is in the status field.
+ */
+static int
+run_action(exec_action *a)
+{
+  struct pollfd pfds[2];
+  char *buf = NULL;
+  int ret = 0;
+  int i;
+
+  buf = malloc(ACTION_BUF_SIZE);
+  if (!buf || spawn_action(a) != 0) {
+    ret = -1;
+    goto out;
+  }
+
+  while (1) {
+    int npfds = 0, timeout = -1;
+
+    if (a->fd >= 0) {
+      pfds[npfds].fd = a->fd;
+      pfds[npfds++].events = POLLIN;
+    }
+    if (!a->exited) {
+      if (a->pidfd >= 0) {
+        pfds[npfds].fd = a->pidfd;
+        pfds[npfds++].events = POLLIN;
+      } else {
+        timeout = ACTION_POLL_TICK_MS;
+      }
+    }
+    if (npfds == 0 && timeout < 0) {
+      /* exited and all output read */
+      break;
+    }
+
+    if (poll(pfds, npfds, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ret = -1;
+      break;
+    }
+    for (i = 0; i < npfds; i++) {
+      if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+        continue;
+      }
+      if (pfds[i].fd == a->fd) {
+        int r = read_action(a, buf);
+        if (r < 0) {
+          ret = -1;
         }
-      } else if (sret == 0) {
-        /* timeout */
-        if (waitpid(cpid, &status, WNOHANG) == cpid) {
-          /* child done */
-          waited = 1;
-          break;
+        if (r != 0) {
+          close(a->fd);
+          a->fd = -1;
         }
       } else {
-        /* error (-1) */
-        break;
+        check_action_exit(a);
       }
     }
-    if (!prepend && out_stream != NULL) {
-      fprintf(out_stream, "\n");
+    if (a->pidfd < 0) {
+      check_action_exit(a);
     }
-    close(pfd[0]);
-    if (!waited) {
-      if (waitpid(cpid, &status, 0) != cpid) {
-        return -1;
+    if (a->exited && a->fd >= 0) {
+      int r;
+      while ((r = read_action(a, buf)) == 0);
+      if (r < 0) {
+        ret = -1;
       }
+      close(a->fd);
+      a->fd = -1;
     }
-    return (WIFEXITED(status) ? WEXITSTATUS(status) : 1);
-  } else {
-    /* child process */
-    close(pfd[0]);
-    if ((ret = dup2(pfd[1], STDOUT_FILENO) < 0)
-        || (ret = dup2(pfd[1], STDERR_FILENO)) < 0) {
-      exit(1);
+  }
+
+out:
+  if (a->fd >= 0) {
+    close(a->fd);
+    a->fd = -1;
+  }
+  if (a->pid > 0 && !a->exited) {
+    int status;
+    if (waitpid(a->pid, &status, 0) == a->pid) {
+      finish_action(a, status);
     }
+  }
+  if (a->pidfd >= 0) {
+    close(a->pidfd);
+    a->pidfd = -1;
+  }
+  free(buf);
+  return ret;
+}
+
+static int
+action_result(exec_action *a)
+{
+  if (!a->exited) {
+    return -1;
+  }
+  return (WIFEXITED(a->status) ? WEXITSTATUS(a->status) : 1);
+}
+
+/* warm action interpreter.
+ *
+ * this is opt-in: only if the VYOS_ACTION_POOL environment variable is set
+ * (to non-zero), the actions are passed to a long-lived "/bin/sh" worker
+ * instead of starting a new shell for each action. otherwise, the actions
+ * are executed exactly as before.
+ *
+ * the worker runs each action in a subshell (i.e., a fork of the warm
+ * interpreter) with the current environment and cwd of this process, and
+ * returns the exit status. the output of the action goes through a pipe
+ * shared by all actions and is output as it comes like the output of the
+ * spawned actions. as with the spawned actions, output of descendants that
+ * outlive the action is discarded (here, before the next action).
+ *
+ * each process has its own worker (e.g., the workers of a parallel commit
+ * each start one), so the workers effectively form a pool.
+ *
+ * an action is not reusable (i.e., it is still executed by a new shell)
+ * if it contains the "#no-reuse" marker or refers to "$$".
+ */
+#define ACTION_POOL_ENV "VYOS_ACTION_POOL"
+#define ACTION_NO_REUSE_MARKER "#no-reuse"
+
+/* note: the action is written to a temp file (see write_action_script()),
+ * and only the name of the file is sent to the worker, so the worker only
+ * needs the plain POSIX "read".
+ */
+static const char *action_worker_script =
+  "while IFS= read -r _vy_f <&3; do\n"
+  "  ( . \"$_vy_f\" ) 3>&-\n"
+  "  printf '%d\\n' $? >&3\n"
+  "done\n";
+
+static struct {
+  pid_t pid;
+  pid_t owner;
+  int fd;  /* requests and exit status */
+  int ofd; /* output of the actions */
+  char **env; /* environment of the worker */
+  int env_num;
+} action_worker = { -1, -1, -1, -1, NULL, 0 };
+
+static void
+set_action_worker_env(void)
+{
+  extern char **environ;
+  int i;
+  for (i = 0; i < action_worker.env_num; i++) {
+    free(action_worker.env[i]);
+  }
+  free(action_worker.env);
+  action_worker.env = NULL;
+  action_worker.env_num = 0;
+  for (i = 0; environ[i]; i++);
+  if (!(action_worker.env = malloc(sizeof(char *) * (i + 1)))) {
+    return;
+  }
+  for (i = 0; environ[i]; i++) {
+    action_worker.env[i] = strdup(environ[i]);
+  }
+  action_worker.env_num = i;
+}
+
+static void
+reset_action_worker(void)
+{
+  action_worker.pid = -1;
+  action_worker.owner = -1;
+  action_worker.fd = -1;
+  action_worker.ofd = -1;
+}
+
+static void
+stop_action_worker(void)
+{
+  int status;
+  if (action_worker.fd >= 0) {
+    /* worker exits at EOF */
+    close(action_worker.fd);
+  }
+  if (action_worker.ofd >= 0) {
+    close(action_worker.ofd);
+  }
+  if (action_worker.pid > 0 && action_worker.owner == getpid()) {
+    waitpid(action_worker.pid, &status, 0);
+  }
+  reset_action_worker();
+}
+
+static int
+start_action_worker(void)
+{
+  extern char **environ;
+  static int registered = 0;
+  int sv[2], pfd[2], cfd, ret;
+  posix_spawn_file_actions_t fa;
+  char *eargs[] = { "sh", "-c", (char *) action_worker_script, NULL };
+
+  if (action_worker.owner != getpid()) {
+    /* inherited from parent process => not ours */
+    if (action_worker.fd >= 0) {
+      close(action_worker.fd);
+    }
+    if (action_worker.ofd >= 0) {
+      close(action_worker.ofd);
+    }
+    reset_action_worker();
+  }
+  if (action_worker.fd >= 0) {
+    return 0;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    return -1;
+  }
+  if (pipe(pfd) != 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+  fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+  /* worker uses fd 3, so make sure the source is not 3 itself */
+  cfd = fcntl(sv[1], F_DUPFD_CLOEXEC, 10);
+  close(sv[1]);
+  if (cfd < 0 || posix_spawn_file_actions_init(&fa) != 0) {
+    close(sv[0]);
+    close(pfd[0]);
     close(pfd[1]);
-    char *eargs[] = { "sh", "-c", cmd, NULL };
-    execv("/bin/sh", eargs);
-    return -1; /* should not get here */
+    if (cfd >= 0) {
+      close(cfd);
+    }
+    return -1;
   }
+  posix_spawn_file_actions_adddup2(&fa, pfd[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, pfd[1], STDERR_FILENO);
+  posix_spawn_file_actions_adddup2(&fa, cfd, 3);
+  ret = posix_spawn(&(action_worker.pid), "/bin/sh", &fa, NULL, eargs,
+                    environ);
+  posix_spawn_file_actions_destroy(&fa);
+  close(cfd);
+  close(pfd[1]);
+  if (ret != 0) {
+    close(sv[0]);
+    close(pfd[0]);
+    action_worker.pid = -1;
+    return -1;
+  }
+  action_worker.fd = sv[0];
+  action_worker.ofd = pfd[0];
+  action_worker.owner = getpid();
+  set_action_worker_env();
+  if (!registered) {
+    registered = 1;
+    atexit(stop_action_worker);
+  }
+  return 0;
+}
+
+static int
+send_action_path(const char *path)
+{
+  char line[PATH_MAX + 1];
+  size_t len = snprintf(line, sizeof(line), "%s\n", path);
+  const char *str = line;
+  while (len > 0) {
+    ssize_t n = send(action_worker.fd, str, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    str += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int
+env_name_len(const char *e)
+{
+  const char *c = strchr(e, '=');
+  return (c ? (c - e) : strlen(e));
+}
+
+/* whether the current environment has the name of the entry */
+static int
+env_has_name(const char *e)
+{
+  extern char **environ;
+  int len = env_name_len(e), i;
+  for (i = 0; environ[i]; i++) {
+    if (env_name_len(environ[i]) == len && strncmp(environ[i], e, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* whether the name of the entry can be used in the shell */
+static int
+env_name_valid(const char *e)
+{
+  int len = env_name_len(e), i;
+  for (i = 0; i < len; i++) {
+    if (!(isalpha((unsigned char) e[i]) || e[i] == '_'
+          || (i > 0 && isdigit((unsigned char) e[i])))) {
+      return 0;
+    }
+  }
+  return (len > 0);
 }
 
+static void
+write_quoted(FILE *f, const char *str, size_t len)
+{
+  size_t i;
+  fputc('\'', f);
+  for (i = 0; i < len; i++) {
+    if (str[i] == '\'') {
+      fputs("'\\''", f);
+    } else {
+      fputc(str[i], f);
+    }
+  }
+  fputc('\'', f);
+}
+
+/* write the script of the action to the file. the environment is set up
+ * from the changes since the worker was started (i.e., the entries that
+ * were added/changed and the names that were removed), followed by the
+ * cwd and the action itself. entries whose names cannot be used in the
+ * shell are skipped.
+ */
+static int
+write_action_script(int fd, const char *cmd)
+{
+  extern char **environ;
+  char *cwd = getcwd(NULL, 0);
+  char **wenv = action_worker.env;
+  int wnum = action_worker.env_num;
+  FILE *f = NULL;
+  int i, j, ret = -1;
+
+  if (!cwd || !wenv || !(f = fdopen(fd, "w"))) {
+    goto out;
+  }
+  fputs("unset _vy_f\n", f);
+  for (j = 0; j < wnum; j++) {
+    if (env_name_valid(wenv[j]) && !env_has_name(wenv[j])) {
+      fprintf(f, "unset %.*s\n", env_name_len(wenv[j]), wenv[j]);
+    }
+  }
+  for (i = 0; environ[i]; i++) {
+    int len = env_name_len(environ[i]);
+    for (j = 0; j < wnum && strcmp(environ[i], wenv[j]) != 0; j++);
+    if (j < wnum || !env_name_valid(environ[i])) {
+      continue;
+    }
+    fprintf(f, "export %.*s=", len, environ[i]);
+    if (environ[i][len] == '=') {
+      write_quoted(f, environ[i] + len + 1, strlen(environ[i] + len + 1));
+    }
+    fputc('\n', f);
+  }
+  fputs("cd ", f);
+  write_quoted(f, cwd, strlen(cwd));
+  fprintf(f, " || exit 1\n%s\n", cmd);
+  ret = 0;
+out:
+  if (f) {
+    if (fclose(f) != 0) {
+      ret = -1;
+    }
+  } else {
+    close(fd);
+  }
+  free(cwd);
+  return ret;
+}
+
+/* output (or discard) whatever output of the worker is available */
+static void
+drain_action_worker(exec_action *a, char *buf, int discard)
+{
+  a->fd = action_worker.ofd;
+  if (discard) {
+    ssize_t count;
+    while ((count = read(a->fd, buf, ACTION_BUF_SIZE)) > 0
+           || (count < 0 && errno == EINTR));
+  } else {
+    while (read_action(a, buf) == 0);
+  }
+  a->fd = -1;
+}
+
+/* execute the action with the worker. returns -1 if the worker cannot be
+ * used, in which case the action has not been executed.
+ */
+static int
+run_pooled_action(exec_action *a, int *result)
+{
+  char script[] = "/tmp/vyatta-action.XXXXXX";
+  char *buf = NULL;
+  char sbuf[16];
+  size_t slen = 0;
+  ssize_t count;
+  int sfd = -1, done = 0, ret = -1;
+
+  if (start_action_worker() != 0) {
+    return -1;
+  }
+  if (!(buf = malloc(ACTION_BUF_SIZE))) {
+    return -1;
+  }
+  /* output of leftover descendants of previous actions is discarded */
+  drain_action_worker(a, buf, 1);
+
+  if ((sfd = mkstemp(script)) < 0) {
+    goto out;
+  }
+  if (write_action_script(sfd, a->cmd) != 0) {
+    goto out;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &(a->start));
+  if (send_action_path(script) != 0) {
+    stop_action_worker();
+    goto out;
+  }
+  ret = 0;
+
+  /* output as it comes until the exit status is received */
+  *result = 1;
+  while (!done) {
+    struct pollfd pfds[2];
+    pfds[0].fd = action_worker.fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = action_worker.ofd;
+    pfds[1].events = POLLIN;
+    if (poll(pfds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      stop_action_worker();
+      break;
+    }
+    if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      drain_action_worker(a, buf, 0);
+    }
+    if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+      continue;
+    }
+    count = read(action_worker.fd, sbuf + slen, 1);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0 || slen >= sizeof(sbuf) - 1) {
+      /* worker died */
+      drain_action_worker(a, buf, 0);
+      stop_action_worker();
+      break;
+    }
+    if (sbuf[slen] == '\n') {
+      sbuf[slen] = 0;
+      *result = atoi(sbuf);
+      done = 1;
+      /* output written by the action before it exited */
+      drain_action_worker(a, buf, 0);
+    }
+    ++slen;
+  }
+  report_action_time(a);
+
+out:
+  if (sfd >= 0) {
+    unlink(script);
+  }
+  free(buf);
+  return ret;
+}
+
+static int
+system_out(char *cmd, const char *prepend_msg, boolean eloc)
+{
+  exec_action a;
+  const char *pool = getenv(ACTION_POOL_ENV);
+  int ret;
+
+  if (!cmd) {
+    return -1;
+  }
+  init_exec_action(&a, cmd, prepend_msg, eloc);
+  if (pool && atoi(pool) > 0 && !strstr(cmd, ACTION_NO_REUSE_MARKER)
+      && !strstr(cmd, "$$") && run_pooled_action(&a, &ret) == 0) {
+    if (!a.prepend && out_stream != NULL) {
+      fprintf(out_stream, "\n");
+    }
+    last_action_status = ret;
+    return ret;
+  }
+  init_exec_action(&a, cmd, prepend_msg, eloc);
+  ret = run_action(&a);
+  if (!a.prepend && out_stream != NULL) {
+    fprintf(out_stream, "\n");
+  }
+  last_action_status = (ret < 0 ? -1 : action_result(&a));
+  return last_action_status;
+}
@@ -37,6 +37,7 @@ static  void cli_deferror(const char *);
 %token CHELP
 %token ALLOWED
 %token VHELP
+%token DEPENDS
 %token PATTERN
 %token EXEC
 %token SYNTAX
@@ -156,6 +157,7 @@ cause:		help_cause
                 | chelp_stmt
                 | allowed_stmt
                 | vhelp_stmt
+                | depends_stmt
 		| syntax_cause
                 | ACTION action { append(parse_defp->actions + $1, $2, 0);}
                 | dummy_stmt
@@ -236,6 +238,30 @@ vhelp_stmt: VHELP STRING
               /* result is a '\n'-delimited string for val_help */
             }
 
+depends_stmt: DEPENDS STRING
+              {
+                /* each "depends:" line is a config path (space-separated)
+                 * that this node must be committed after. multiple paths
+                 * are stored as a '\n'-delimited string.
+                 */
+                if (!(parse_defp->def_depends)) {
+                  parse_defp->def_depends = $2;
+                } else {
+                  char *optr = parse_defp->def_depends;
+                  int olen = strlen(optr);
+                  char *nptr = $2;
+                  int nlen = strlen(nptr);
+                  char *mptr = (char *) malloc(olen + 1 + nlen + 1);
+                  memcpy(mptr, optr, olen);
+                  mptr[olen] = '\n';
+                  memcpy(&(mptr[olen + 1]), nptr, nlen);
+                  mptr[olen + 1 + nlen] = 0;
+                  parse_defp->def_depends = mptr;
+                  free(optr);
+                  free(nptr);
+                }
+              }
+
 syntax_cause:   SYNTAX exp {append(parse_defp->actions + syntax_act, $2, 0);}
 		;
 
@@ -15,15 +15,29 @@
  */
 
 #include <cstdio>
+#include <stdio_ext.h>
 #include <cstdlib>
 #include <cstring>
 #include <vector>
 #include <string>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
 #include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include <cli_cstore.h>
+#include <cli_shell_api.h>
 #include <cstore/cstore.hpp>
 #include <cstore/util.hpp>
+#include <cstore/unionfs/tmpl-index.hpp>
 #include <cnode/cnode.hpp>
 #include <cnode/cnode-algorithm.hpp>
 #include <commit/commit-algorithm.hpp>
@@ -67,6 +81,8 @@ int op_show_commands = 0;
 int op_show_ignore_edit = 0;
 char *op_show_cfg1 = NULL;
 char *op_show_cfg2 = NULL;
+// batch options
+int op_batch_nul = 0;
 
 typedef void (*OpFuncT)(Cstore& cstore, const Cpath& args);
 
@@ -80,6 +96,29 @@ typedef struct {
   OpFuncT op_func;
 } OpT;
 
+/* whether ops are being "served" in-process, i.e., in daemon mode or batch
+ * mode (see the corresponding sections below). when serving, an op must not
+ * actually exit. instead, op_exit() throws and the exit status is returned
+ * in the response.
+ */
+static bool op_serving = false;
+// whether ops are being served by the daemon worker
+static bool op_daemon_serving = false;
+
+struct OpExitT {
+  OpExitT(int c) : code(c) {}
+  int code;
+};
+
+static void
+op_exit(int code)
+{
+  if (op_serving) {
+    throw OpExitT(code);
+  }
+  exit(code);
+}
+
 /* outputs an environment string to be "eval"ed */
 static void
 getSessionEnv(Cstore& cstore, const Cpath& args)
@@ -97,7 +136,7 @@ getEditEnv(Cstore& cstore, const Cpath& args)
 {
   string env;
   if (!cstore.getEditEnv(args, env)) {
-    exit(1);
+    op_exit(1);
   }
   printf("%s", env.c_str());
 }
@@ -108,7 +147,7 @@ getEditUpEnv(Cstore& cstore, const Cpath& args)
 {
   string env;
   if (!cstore.getEditUpEnv(env)) {
-    exit(1);
+    op_exit(1);
   }
   printf("%s", env.c_str());
 }
@@ -119,7 +158,7 @@ getEditResetEnv(Cstore& cstore, const Cpath& args)
 {
   string env;
   if (!cstore.getEditResetEnv(env)) {
-    exit(1);
+    op_exit(1);
   }
   printf("%s", env.c_str());
 }
@@ -127,7 +166,7 @@ getEditResetEnv(Cstore& cstore, const Cpath& args)
 static void
 editLevelAtRoot(Cstore& cstore, const Cpath& args)
 {
-  exit(cstore.editLevelAtRoot() ? 0 : 1);
+  op_exit(cstore.editLevelAtRoot() ? 0 : 1);
 }
 
 /* outputs an environment string to be "eval"ed */
@@ -136,7 +175,7 @@ getCompletionEnv(Cstore& cstore, const Cpath& args)
 {
   string env;
   if (!cstore.getCompletionEnv(args, env)) {
-    exit(1);
+    op_exit(1);
   }
   printf("%s", env.c_str());
 }
@@ -158,7 +197,7 @@ static void
 markSessionUnsaved(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.markSessionUnsaved()) {
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -166,7 +205,7 @@ static void
 unmarkSessionUnsaved(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.unmarkSessionUnsaved()) {
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -174,7 +213,7 @@ static void
 sessionUnsaved(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.sessionUnsaved()) {
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -182,7 +221,7 @@ static void
 sessionChanged(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.sessionChanged()) {
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -190,7 +229,7 @@ static void
 teardownSession(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.teardownSession()) {
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -198,7 +237,7 @@ static void
 setupSession(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.setupSession()) {
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -206,7 +245,7 @@ static void
 inSession(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.inSession()) {
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -214,21 +253,21 @@ inSession(Cstore& cstore, const Cpath& args)
 static void
 exists(Cstore& cstore, const Cpath& args)
 {
-  exit(cstore.cfgPathExists(args, false) ? 0 : 1);
+  op_exit(cstore.cfgPathExists(args, false) ? 0 : 1);
 }
 
 /* same as existsOrig() in Perl API */
 static void
 existsActive(Cstore& cstore, const Cpath& args)
 {
-  exit(cstore.cfgPathExists(args, true) ? 0 : 1);
+  op_exit(cstore.cfgPathExists(args, true) ? 0 : 1);
 }
 
 /* same as isEffective() in Perl API */
 static void
 existsEffective(Cstore& cstore, const Cpath& args)
 {
-  exit(cstore.cfgPathEffective(args) ? 0 : 1);
+  op_exit(cstore.cfgPathEffective(args) ? 0 : 1);
 }
 
 /* isMulti */
@@ -238,7 +277,7 @@ isMulti(Cstore& cstore, const Cpath& args)
   MapT<string, string> tmap;
   cstore.getParsedTmpl(args, tmap, 0);
   string multi = tmap["multi"];
-  exit((multi == "1") ? 0 : 1);
+  op_exit((multi == "1") ? 0 : 1);
 }
 
 /* isTag */
@@ -248,7 +287,7 @@ isTag(Cstore& cstore, const Cpath& args)
   MapT<string, string> tmap;
   cstore.getParsedTmpl(args, tmap, 0);
   string tag = tmap["tag"];
-  exit((tag == "1") ? 0 : 1);
+  op_exit((tag == "1") ? 0 : 1);
 }
 
 /* isValue */
@@ -258,7 +297,7 @@ isValue(Cstore& cstore, const Cpath& args)
   MapT<string, string> tmap;
   cstore.getParsedTmpl(args, tmap, 0);
   string is_value = tmap["is_value"];
-  exit((is_value == "1") ? 0 : 1);
+  op_exit((is_value == "1") ? 0 : 1);
 }
 
 /* isLeaf */
@@ -278,7 +317,7 @@ isLeaf(Cstore& cstore, const Cpath& args)
     // typeless leaf node
     is_leaf_typeless = true;
   }
-  exit(((is_value != "1") && (tag != "1") && (type != "" || is_leaf_typeless)) ? 0 : 1);
+  op_exit(((is_value != "1") && (tag != "1") && (type != "" || is_leaf_typeless)) ? 0 : 1);
 }
 
 static void getNodeType(Cstore& cstore, const Cpath& args) {
@@ -305,7 +344,7 @@ static void getNodeType(Cstore& cstore, const Cpath& args) {
   } else {
     printf("leaf");
   }
-  exit(0);
+  op_exit(0);
   
 }
 
@@ -361,7 +400,7 @@ returnValue(Cstore& cstore, const Cpath& args)
 {
   string val;
   if (!cstore.cfgPathGetValue(args, val, false)) {
-    exit(1);
+    op_exit(1);
   }
   printf("%s", val.c_str());
 }
@@ -372,7 +411,7 @@ returnActiveValue(Cstore& cstore, const Cpath& args)
 {
   string val;
   if (!cstore.cfgPathGetValue(args, val, true)) {
-    exit(1);
+    op_exit(1);
   }
   printf("%s", val.c_str());
 }
@@ -383,7 +422,7 @@ returnEffectiveValue(Cstore& cstore, const Cpath& args)
 {
   string val;
   if (!cstore.cfgPathGetEffectiveValue(args, val)) {
-    exit(1);
+    op_exit(1);
   }
   printf("%s", val.c_str());
 }
@@ -413,7 +452,7 @@ returnValues(Cstore& cstore, const Cpath& args)
 {
   vector<string> vvec;
   if (!cstore.cfgPathGetValues(args, vvec, false)) {
-    exit(1);
+    op_exit(1);
   }
   print_vec(vvec, " ", "'");
 }
@@ -428,7 +467,7 @@ returnActiveValues(Cstore& cstore, const Cpath& args)
 {
   vector<string> vvec;
   if (!cstore.cfgPathGetValues(args, vvec, true)) {
-    exit(1);
+    op_exit(1);
   }
   print_vec(vvec, " ", "'");
 }
@@ -443,7 +482,7 @@ returnEffectiveValues(Cstore& cstore, const Cpath& args)
 {
   vector<string> vvec;
   if (!cstore.cfgPathGetEffectiveValues(args, vvec)) {
-    exit(1);
+    op_exit(1);
   }
   print_vec(vvec, " ", "'");
 }
@@ -454,7 +493,7 @@ returnEffectiveValues(Cstore& cstore, const Cpath& args)
 static void
 validateTmplPath(Cstore& cstore, const Cpath& args)
 {
-  exit(cstore.validateTmplPath(args, false) ? 0 : 1);
+  op_exit(cstore.validateTmplPath(args, false) ? 0 : 1);
 }
 
 /* checks if specified path is a valid "template path", *including* the
@@ -463,7 +502,7 @@ validateTmplPath(Cstore& cstore, const Cpath& args)
 static void
 validateTmplValPath(Cstore& cstore, const Cpath& args)
 {
-  exit(cstore.validateTmplPath(args, true) ? 0 : 1);
+  op_exit(cstore.validateTmplPath(args, true) ? 0 : 1);
 }
 
 static void
@@ -472,22 +511,23 @@ showCfg(Cstore& cstore, const Cpath& args)
   Cpath nargs(args);
   bool active_only = (!cstore.inSession() || op_show_active_only);
   bool working_only = (cstore.inSession() && op_show_working_only);
-  cnode::CfgNode aroot(cstore, nargs, true, true);
 
+  // output is produced while walking the config(s)
   if (active_only) {
     // just show the active config (no diff)
+    cnode::CfgStoreWalker aroot(cstore, nargs, true);
     cnode::show_cfg(aroot, op_show_show_defaults, op_show_hide_secrets);
+  } else if (working_only) {
+    // just show the working config (no diff)
+    cnode::CfgStoreWalker wroot(cstore, nargs, false);
+    cnode::show_cfg(wroot, op_show_show_defaults, op_show_hide_secrets);
   } else {
-    cnode::CfgNode wroot(cstore, nargs, false, true);
-    if (working_only) {
-      // just show the working config (no diff)
-      cnode::show_cfg(wroot, op_show_show_defaults, op_show_hide_secrets);
-    } else {
-      Cpath cur_path;
-      cstore.getEditLevel(cur_path);
-      cnode::show_cfg_diff(aroot, wroot, cur_path, op_show_show_defaults,
-                           op_show_hide_secrets, op_show_context_diff);
-    }
+    cnode::CfgStoreWalker aroot(cstore, nargs, true);
+    cnode::CfgStoreWalker wroot(cstore, nargs, false);
+    Cpath cur_path;
+    cstore.getEditLevel(cur_path);
+    cnode::show_cfg_diff(aroot, wroot, cur_path, op_show_show_defaults,
+                         op_show_hide_secrets, op_show_context_diff);
   }
 }
 
@@ -550,7 +590,7 @@ loadFile(Cstore& cstore, const Cpath& args)
 {
   if (!cstore.loadFile(args[0])) {
     // loadFile failed
-    exit(1);
+    op_exit(1);
   }
 }
 
@@ -563,7 +603,7 @@ _cf_process_args(Cstore& cstore, const Cpath& args, Cpath& path)
   cnode::CfgNode *root = cparse::parse_file(args[0], cstore);
   if (!root) {
     // failed to parse config file
-    exit(1);
+    op_exit(1);
   }
   return root;
 }
@@ -602,18 +642,18 @@ static void
 cfExists(Cstore& cstore, const Cpath& args)
 {
   Cpath path;
-  cnode::CfgNode *root = _cf_process_args(cstore, args, path);
-  exit(cnode::findCfgNode(root, path) ? 0 : 1);
+  tr1::shared_ptr<cnode::CfgNode> root(_cf_process_args(cstore, args, path));
+  op_exit(cnode::findCfgNode(root.get(), path) ? 0 : 1);
 }
 
 static void
 cfReturnValue(Cstore& cstore, const Cpath& args)
 {
   Cpath path;
-  cnode::CfgNode *root = _cf_process_args(cstore, args, path);
+  tr1::shared_ptr<cnode::CfgNode> root(_cf_process_args(cstore, args, path));
   string value;
-  if (!cnode::getCfgNodeValue(root, path, value)) {
-    exit(1);
+  if (!cnode::getCfgNodeValue(root.get(), path, value)) {
+    op_exit(1);
   }
   printf("%s", value.c_str());
 }
@@ -622,14 +662,91 @@ static void
 cfReturnValues(Cstore& cstore, const Cpath& args)
 {
   Cpath path;
-  cnode::CfgNode *root = _cf_process_args(cstore, args, path);
+  tr1::shared_ptr<cnode::CfgNode> root(_cf_process_args(cstore, args, path));
   vector<string> values;
-  if (!cnode::getCfgNodeValues(root, path, values)) {
-    exit(1);
+  if (!cnode::getCfgNodeValues(root.get(), path, values)) {
+    op_exit(1);
   }
   print_vec(values, " ", "'");
 }
 
+static int run_op(int argc, char **argv);
+static bool serve_init(int rfd, bool with_err);
+static bool capture_begin();
+static void send_resp(int status);
+static bool split_op_line(const char *line, vector<string>& toks);
+
+/* process multiple ops in one invocation. each op is read from stdin as a
+ * "line" delimited by newline (or NUL if "--batch-nul" is specified) and
+ * split into words like a shell command line (quoting with '' and "" and
+ * escaping with backslash are supported). for example:
+ *
+ *   printf 'exists system\nreturnValue system host-name\n' \
+ *     | cli-shell-api batch
+ *
+ * all ops are processed on the same Cstore, so the template caches stay
+ * warm across the whole batch. for each non-empty line, a response is
+ * written to stdout:
+ *
+ *   "<exit_status> <output_length>\n" <output>
+ *
+ * stderr output of the ops is not captured.
+ */
+static void
+batch(Cstore& cstore, const Cpath& args)
+{
+  if (op_daemon_serving) {
+    /* the daemon cannot read the client's input stream. not served, so the
+     * client runs the batch itself.
+     */
+    op_exit(SHAPI_STATUS_NOT_SERVED);
+  }
+  if (op_serving) {
+    // no nesting
+    fprintf(stderr, "Invalid operation\n");
+    op_exit(1);
+  }
+  int delim = (op_batch_nul ? 0 : '\n');
+  int rfd = dup(STDOUT_FILENO);
+  if (rfd < 0 || !serve_init(rfd, false)) {
+    op_exit(1);
+  }
+
+  char *line = NULL;
+  size_t lsize = 0;
+  ssize_t len = 0;
+  while ((len = getdelim(&line, &lsize, delim, stdin)) >= 0) {
+    if (len > 0 && line[len - 1] == delim) {
+      line[len - 1] = 0;
+    }
+    vector<string> toks;
+    bool valid = split_op_line(line, toks);
+    if (valid && toks.size() == 0) {
+      // empty line
+      continue;
+    }
+    if (!capture_begin()) {
+      exit(1);
+    }
+    if (!valid) {
+      fprintf(stderr, "Invalid op line\n");
+      send_resp(1);
+      continue;
+    }
+
+    vector<char *> argv;
+    string argv0 = "cli-shell-api";
+    argv.push_back(const_cast<char *>(argv0.c_str()));
+    for (size_t i = 0; i < toks.size(); i++) {
+      argv.push_back(const_cast<char *>(toks[i].c_str()));
+    }
+    argv.push_back(NULL);
+    send_resp(run_op(argv.size() - 1, &(argv[0])));
+  }
+  free(line);
+  exit_code = 0;
+}
+
 #define OP(name, exact, exact_err, min, min_err, use_edit) \
   { #name, exact, exact_err, min, min_err, use_edit, &name }
 
@@ -689,6 +806,8 @@ static OpT ops[] = {
   OP(cfReturnValue, -1, NULL, 2, "Must specify config file and path", NULL),
   OP(cfReturnValues, -1, NULL, 2, "Must specify config file and path", NULL),
 
+  OP(batch, 0, "No argument expected", -1, NULL, NULL),
+
   {NULL, -1, NULL, -1, NULL, NULL, NULL}
 };
 #define OP_exact_args  ops[op_idx].op_exact_args
@@ -703,6 +822,8 @@ enum {
   SHOW_CFG2
 };
 
+int op_daemon = 0;
+
 struct option options[] = {
   {"show-active-only", no_argument, &op_show_active_only, 1},
   {"show-show-defaults", no_argument, &op_show_show_defaults, 1},
@@ -713,12 +834,75 @@ struct option options[] = {
   {"show-ignore-edit", no_argument, &op_show_ignore_edit, 1},
   {"show-cfg1", required_argument, NULL, SHOW_CFG1},
   {"show-cfg2", required_argument, NULL, SHOW_CFG2},
+  {"daemon", no_argument, &op_daemon, 1},
+  {"batch-nul", no_argument, &op_batch_nul, 1},
   {NULL, 0, NULL, 0}
 };
 
-int
-main(int argc, char **argv)
+static int daemon_main();
+
+/* reset all option state. this is needed since the daemon and batch modes
+ * process multiple command lines in the same process.
+ */
+static void
+reset_options()
 {
+  op_show_active_only = 0;
+  op_show_show_defaults = 0;
+  op_show_hide_secrets = 0;
+  op_show_working_only = 0;
+  op_show_context_diff = 0;
+  op_show_commands = 0;
+  op_show_ignore_edit = 0;
+  if (op_show_cfg1) {
+    free(op_show_cfg1);
+    op_show_cfg1 = NULL;
+  }
+  if (op_show_cfg2) {
+    free(op_show_cfg2);
+    op_show_cfg2 = NULL;
+  }
+  op_daemon = 0;
+  op_batch_nul = 0;
+  op_idx = -1;
+  exit_code = 0;
+  // reinitialize getopt (GNU)
+  optind = 0;
+}
+
+static Cstore *get_cached_cstore(bool use_edit);
+
+/* ops that can run template actions (e.g., "syntax:expression: exec" when
+ * validating values). the action scripts may in turn call this program,
+ * which (with the client shim) would connect back to the daemon worker
+ * that is busy serving the op itself. so these are never served by the
+ * daemon, i.e., the client runs them locally.
+ */
+static const char *daemon_local_ops[] = {
+  "validateTmplValPath",
+  "loadFile",
+  NULL
+};
+
+static bool
+is_daemon_local_op(const char *name)
+{
+  for (size_t i = 0; daemon_local_ops[i]; i++) {
+    if (strcmp(name, daemon_local_ops[i]) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* process the command line and call the op function.
+ * return the exit status of the op.
+ */
+static int
+run_op(int argc, char **argv)
+{
+  reset_options();
+
   // handle options first
   int c = 0;
   while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
@@ -733,6 +917,16 @@ main(int argc, char **argv)
         break;
     }
   }
+  if (op_daemon) {
+    if (op_daemon_serving) {
+      return SHAPI_STATUS_NOT_SERVED;
+    }
+    if (op_serving) {
+      fprintf(stderr, "Invalid operation\n");
+      return 1;
+    }
+    return daemon_main();
+  }
   int nargs = argc - optind - 1;
   char *oname = argv[optind];
   char **nargv = &(argv[optind + 1]);
@@ -740,7 +934,7 @@ main(int argc, char **argv)
   int i = 0;
   if (nargs < 0) {
     fprintf(stderr, "Must specify operation\n");
-    exit(1);
+    return 1;
   }
   while (ops[i].op_name) {
     if (strcmp(oname, ops[i].op_name) == 0) {
@@ -751,24 +945,669 @@ main(int argc, char **argv)
   }
   if (op_idx == -1) {
     fprintf(stderr, "Invalid operation\n");
-    exit(1);
+    return 1;
+  }
+  if (op_daemon_serving && is_daemon_local_op(oname)) {
+    return SHAPI_STATUS_NOT_SERVED;
   }
   if (OP_exact_args >= 0 && nargs != OP_exact_args) {
     fprintf(stderr, "%s\n", OP_exact_error);
-    exit(1);
+    return 1;
   }
   if (OP_min_args >= 0 && nargs < OP_min_args) {
     fprintf(stderr, "%s\n", OP_min_error);
-    exit(1);
+    return 1;
   }
 
   Cpath args(const_cast<const char **>(nargv), nargs);
 
   // call the op function
-  Cstore *cstore = Cstore::createCstore(OP_use_edit);
-  OP_func(*cstore, args);
-  delete cstore;
-  exit(exit_code);
+  if (!op_serving) {
+    Cstore *cstore = Cstore::createCstore(OP_use_edit);
+    OP_func(*cstore, args);
+    delete cstore;
+    return exit_code;
+  }
+
+  // serving: cstore is cached, and op_exit() throws
+  try {
+    OP_func(*get_cached_cstore(OP_use_edit), args);
+  } catch (const OpExitT& e) {
+    return e.code;
+  }
+  return exit_code;
 }
 
+//// serving ops in-process
+/* common functionality for the daemon and batch modes: ops are processed
+ * in the same process on cached Cstore instances, and the stdout (and
+ * optionally stderr) output of each op is captured and sent back in a
+ * response together with the exit status.
+ *
+ * if an op exits in the library (e.g., exit_internal()), the response is
+ * still sent (see serve_on_exit()).
+ */
+static const size_t SERVE_IO_BUF_SIZE = 65536;
+
+/* the cstores used for the ops (with and without edit level). they are
+ * kept for a whole batch but only for a single request in the daemon
+ * since a Cstore caches session state. the template caches in the
+ * library are not per Cstore, so they stay warm either way.
+ */
+static Cstore *_cached_cstores[2] = { NULL, NULL };
+static int resp_fd = -1;
+static bool resp_with_err = false;
+static bool resp_pending = false;
+static int cap_out_fd = -1;
+static int cap_err_fd = -1;
+static int saved_out_fd = -1;
+static int saved_err_fd = -1;
+
+static void
+clear_cached_cstores()
+{
+  for (size_t i = 0; i < 2; i++) {
+    delete _cached_cstores[i];
+    _cached_cstores[i] = NULL;
+  }
+}
 
+// return the cached cstore, creating it if necessary
+static Cstore *
+get_cached_cstore(bool use_edit)
+{
+  Cstore *& cs = _cached_cstores[use_edit ? 1 : 0];
+  if (!cs) {
+    cs = Cstore::createCstore(use_edit);
+  }
+  return cs;
+}
+
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+// copy the captured output in "fd" to the response
+static bool
+send_captured(int fd, size_t len)
+{
+  char buf[SERVE_IO_BUF_SIZE];
+  if (lseek(fd, 0, SEEK_SET) != 0) {
+    return false;
+  }
+  while (len > 0) {
+    ssize_t n = read(fd, buf, (len < sizeof(buf) ? len : sizeof(buf)));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (!write_all(resp_fd, buf, n)) {
+      return false;
+    }
+    len -= n;
+  }
+  return true;
+}
+
+/* send the response for the current op (if any): the exit status followed
+ * by the captured output of the op. stdout/stderr are restored afterwards.
+ */
+static void
+send_resp(int status)
+{
+  if (!resp_pending) {
+    return;
+  }
+  resp_pending = false;
+  fflush(stdout);
+  dup2(saved_out_fd, STDOUT_FILENO);
+  off_t olen = lseek(cap_out_fd, 0, SEEK_END);
+  off_t elen = 0;
+  if (resp_with_err) {
+    fflush(stderr);
+    dup2(saved_err_fd, STDERR_FILENO);
+    elen = lseek(cap_err_fd, 0, SEEK_END);
+  }
+  if (olen < 0 || elen < 0) {
+    return;
+  }
+
+  char hdr[64];
+  int hlen = 0;
+  if (resp_with_err) {
+    hlen = snprintf(hdr, sizeof(hdr), "%d %lu %lu\n", status,
+                    (unsigned long) olen, (unsigned long) elen);
+  } else {
+    hlen = snprintf(hdr, sizeof(hdr), "%d %lu\n", status,
+                    (unsigned long) olen);
+  }
+  if (write_all(resp_fd, hdr, hlen) && send_captured(cap_out_fd, olen)) {
+    if (resp_with_err) {
+      send_captured(cap_err_fd, elen);
+    }
+  }
+}
+
+/* an op exited in the library. send the response before the process goes
+ * away.
+ */
+static void
+serve_on_exit(int status, void *arg)
+{
+  send_resp(status);
+}
+
+/* set up for serving ops.
+ *   rfd: fd to send the responses to. -1 if it is set per op (daemon).
+ *   with_err: whether to capture stderr as well.
+ */
+static bool
+serve_init(int rfd, bool with_err)
+{
+  FILE *ofile = tmpfile();
+  FILE *efile = (with_err ? tmpfile() : NULL);
+  if (!ofile || (with_err && !efile)) {
+    fprintf(stderr, "Failed to set up output capture\n");
+    return false;
+  }
+  op_serving = true;
+  resp_fd = rfd;
+  resp_with_err = with_err;
+  cap_out_fd = fileno(ofile);
+  cap_err_fd = (efile ? fileno(efile) : -1);
+  saved_out_fd = dup(STDOUT_FILENO);
+  saved_err_fd = dup(STDERR_FILENO);
+  on_exit(serve_on_exit, NULL);
+  return true;
+}
+
+// start capturing output for an op
+static bool
+capture_begin()
+{
+  if (ftruncate(cap_out_fd, 0) != 0 || lseek(cap_out_fd, 0, SEEK_SET) != 0) {
+    return false;
+  }
+  if (resp_with_err && (ftruncate(cap_err_fd, 0) != 0
+                        || lseek(cap_err_fd, 0, SEEK_SET) != 0)) {
+    return false;
+  }
+  fflush(stdout);
+  dup2(cap_out_fd, STDOUT_FILENO);
+  if (resp_with_err) {
+    fflush(stderr);
+    dup2(cap_err_fd, STDERR_FILENO);
+  }
+  resp_pending = true;
+  return true;
+}
+
+//// batch mode
+/* split an op line into words. return false if the line is invalid
+ * (unterminated quote/escape).
+ */
+static bool
+split_op_line(const char *line, vector<string>& toks)
+{
+  const char *p = line;
+  while (true) {
+    while (*p && isspace(*p)) {
+      ++p;
+    }
+    if (!*p) {
+      return true;
+    }
+    string tok;
+    while (*p && !isspace(*p)) {
+      if (*p == '\'') {
+        const char *q = strchr(p + 1, '\'');
+        if (!q) {
+          return false;
+        }
+        tok.append(p + 1, q - p - 1);
+        p = q + 1;
+      } else if (*p == '"') {
+        ++p;
+        while (*p && *p != '"') {
+          if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) {
+            ++p;
+          }
+          tok += *p++;
+        }
+        if (!*p) {
+          return false;
+        }
+        ++p;
+      } else if (*p == '\\') {
+        if (!p[1]) {
+          return false;
+        }
+        tok += p[1];
+        p += 2;
+      } else {
+        tok += *p++;
+      }
+    }
+    toks.push_back(tok);
+  }
+}
+
+//// daemon mode
+/* with the "--daemon" option, this program becomes a long-lived process
+ * that serves the ops above over a Unix-domain socket (see cli_shell_api.h
+ * for the protocol). the client shim "cli-shell-api-client" is
+ * argv-compatible with this program, so callers can use it transparently.
+ * when the daemon is not available, the client simply runs this program.
+ *
+ * the daemon keeps all the template caches in the library warm across
+ * requests. a new Cstore is used for each request since a Cstore caches
+ * session state (e.g., commit data). only clients with the same uid as the
+ * daemon are served so that file ownership/permissions are the same as
+ * running the op locally. the client's cwd and whole environment are
+ * installed for the request, and the client's stdin is passed along with
+ * the request and used as the op's stdin.
+ *
+ * the template caches are only valid as long as the templates don't
+ * change. the template index is rebuilt whenever templates are installed,
+ * so before each request the worker checks whether the template root or
+ * its index has changed since it started. if so, the request is not
+ * served and the worker exits, i.e., a fresh worker serves the following
+ * requests. (changes to the templates without rebuilding the index are
+ * not detected, so the daemon must be restarted in that case.) requests
+ * for a different template root are not served either. neither are ops
+ * that can run template actions (see daemon_local_ops above) since the
+ * worker serves one request at a time.
+ *
+ * the requests are processed by a worker process forked from the daemon.
+ * if an op exits in the library, the response is still sent and the worker
+ * is simply restarted by the daemon.
+ */
+static const unsigned int DAEMON_MAX_QUICK_EXITS = 3;
+// same as in the unionfs cstore
+static const char *DAEMON_ENV_TMPL_ROOT = "VYATTA_CONFIG_TEMPLATE";
+static const char *DAEMON_DEF_TMPL_ROOT
+  = "/opt/vyatta/share/vyatta-cfg/templates";
+
+static volatile sig_atomic_t daemon_stop = 0;
+static int daemon_saved_in_fd = -1;
+// the worker's own environment (see set_req_env())
+static vector<string> daemon_env;
+
+// identity of the template root and its index when the worker started
+struct TmplStampT {
+  TmplStampT() : root(), root_st(), idx_st(), idx_exists(false) {}
+  string root;
+  struct stat root_st;
+  struct stat idx_st;
+  bool idx_exists;
+};
+static TmplStampT *daemon_tmpl_stamp = NULL;
+
+static bool
+same_file_ver(const struct stat& s1, const struct stat& s2)
+{
+  return (s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino
+          && s1.st_size == s2.st_size
+          && s1.st_mtim.tv_sec == s2.st_mtim.tv_sec
+          && s1.st_mtim.tv_nsec == s2.st_mtim.tv_nsec
+          && s1.st_ctim.tv_sec == s2.st_ctim.tv_sec
+          && s1.st_ctim.tv_nsec == s2.st_ctim.tv_nsec);
+}
+
+/* check the template root of the current request (see above). return
+ * false if the worker's template caches cannot be used for it.
+ */
+static bool
+daemon_check_tmpl()
+{
+  TmplStampT cur;
+  const char *val = getenv(DAEMON_ENV_TMPL_ROOT);
+  cur.root = (val ? val : DAEMON_DEF_TMPL_ROOT);
+  if (stat(cur.root.c_str(), &cur.root_st) != 0) {
+    return false;
+  }
+  cur.idx_exists
+    = (stat(unionfs::TmplIndex::getIndexFile(cur.root).c_str(),
+            &cur.idx_st) == 0);
+  if (!daemon_tmpl_stamp) {
+    daemon_tmpl_stamp = new TmplStampT(cur);
+    return true;
+  }
+  const TmplStampT& st = *daemon_tmpl_stamp;
+  return (cur.root == st.root && same_file_ver(cur.root_st, st.root_st)
+          && cur.idx_exists == st.idx_exists
+          && (!cur.idx_exists || same_file_ver(cur.idx_st, st.idx_st)));
+}
+
+/* parse the request in "req" into cwd, env, and argv (see protocol in
+ * cli_shell_api.h). return false if the request is invalid.
+ */
+static bool
+parse_req(vector<char>& req, char *& cwd, vector<char *>& env,
+          vector<char *>& argv)
+{
+  if (req.size() == 0 || req[req.size() - 1] != 0) {
+    return false;
+  }
+  char *p = &(req[0]);
+  char *end = p + req.size();
+  cwd = p;
+  p += strlen(p) + 1;
+  for (size_t i = 0; i < 2; i++) {
+    vector<char *>& vec = (i == 0 ? env : argv);
+    if (p >= end) {
+      return false;
+    }
+    char *e = NULL;
+    unsigned long n = strtoul(p, &e, 10);
+    if (*e != 0 || n > req.size()) {
+      return false;
+    }
+    p += strlen(p) + 1;
+    for (unsigned long j = 0; j < n; j++) {
+      if (p >= end) {
+        return false;
+      }
+      vec.push_back(p);
+      p += strlen(p) + 1;
+    }
+  }
+  return (p == end);
+}
+
+/* install the client's environment for the request. the worker's own
+ * environment is restored in daemon_done().
+ */
+static void
+set_req_env(const vector<char *>& env)
+{
+  clearenv();
+  for (size_t i = 0; i < env.size(); i++) {
+    char *eq = strchr(env[i], '=');
+    if (!eq || eq == env[i]) {
+      continue;
+    }
+    *eq = 0;
+    setenv(env[i], eq + 1, 1);
+    *eq = '=';
+  }
+}
+
+static void
+restore_daemon_env()
+{
+  clearenv();
+  for (size_t i = 0; i < daemon_env.size(); i++) {
+    size_t eq = daemon_env[i].find('=');
+    if (eq == string::npos || eq == 0) {
+      continue;
+    }
+    setenv(daemon_env[i].substr(0, eq).c_str(),
+           daemon_env[i].c_str() + eq + 1, 1);
+  }
+}
+
+/* read the request from "cfd" into "req" until EOF. the client's stdin
+ * (if passed) is returned in "in_fd" (-1 if not passed).
+ */
+static void
+daemon_read_req(int cfd, vector<char>& req, int& in_fd)
+{
+  char buf[SERVE_IO_BUF_SIZE];
+  char cbuf[CMSG_SPACE(sizeof(int) * 4)];
+  while (true) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    ssize_t n = recvmsg(cfd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      break;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    for (; cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      int *fds = reinterpret_cast<int *>(CMSG_DATA(cm));
+      size_t nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < nfds; i++) {
+        // only one fd is expected
+        if (in_fd < 0) {
+          in_fd = fds[i];
+        } else {
+          close(fds[i]);
+        }
+      }
+    }
+    if (n == 0) {
+      break;
+    }
+    req.insert(req.end(), buf, buf + n);
+    if (req.size() > SHAPI_MAX_REQ_SIZE) {
+      break;
+    }
+  }
+}
+
+// respond to the current client with "status" and done with it
+static void
+daemon_done(int status)
+{
+  send_resp(status);
+  close(resp_fd);
+  resp_fd = -1;
+  /* ops must not see state cached by previous requests, and paths/values
+   * (which may be secrets) must not be kept across requests.
+   */
+  clear_cached_cstores();
+  Cstore::clearCaches();
+  // restore the worker's own environment and stdin
+  restore_daemon_env();
+  __fpurge(stdin);
+  clearerr(stdin);
+  dup2(daemon_saved_in_fd, STDIN_FILENO);
+}
+
+static void
+daemon_handle_req(int cfd)
+{
+  resp_fd = cfd;
+  if (!capture_begin()) {
+    daemon_done(SHAPI_STATUS_NOT_SERVED);
+    return;
+  }
+
+  struct ucred cred;
+  socklen_t clen = sizeof(cred);
+  if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &clen) != 0
+      || cred.uid != geteuid()) {
+    // not served. client will run the op itself.
+    daemon_done(SHAPI_STATUS_NOT_SERVED);
+    return;
+  }
+
+  vector<char> req;
+  int in_fd = -1;
+  daemon_read_req(cfd, req, in_fd);
+  char *cwd = NULL;
+  vector<char *> env;
+  vector<char *> argv;
+  if (req.size() > SHAPI_MAX_REQ_SIZE || !parse_req(req, cwd, env, argv)
+      || chdir(cwd) != 0) {
+    if (in_fd >= 0) {
+      close(in_fd);
+    }
+    daemon_done(SHAPI_STATUS_NOT_SERVED);
+    return;
+  }
+  set_req_env(env);
+  if (!daemon_check_tmpl()) {
+    // templates changed. let a fresh worker serve the following requests.
+    if (in_fd >= 0) {
+      close(in_fd);
+    }
+    daemon_done(SHAPI_STATUS_NOT_SERVED);
+    exit(0);
+  }
+  if (in_fd >= 0) {
+    dup2(in_fd, STDIN_FILENO);
+    close(in_fd);
+  } else {
+    int nfd = open("/dev/null", O_RDONLY);
+    if (nfd >= 0) {
+      dup2(nfd, STDIN_FILENO);
+      close(nfd);
+    }
+  }
+
+  string argv0 = "cli-shell-api";
+  argv.insert(argv.begin(), const_cast<char *>(argv0.c_str()));
+  argv.push_back(NULL);
+  daemon_done(run_op(argv.size() - 1, &(argv[0])));
+}
+
+// worker process: serve requests until something goes wrong
+static void
+daemon_worker(int lfd)
+{
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  daemon_saved_in_fd = dup(STDIN_FILENO);
+  for (char **e = environ; *e; e++) {
+    daemon_env.push_back(*e);
+  }
+  if (daemon_saved_in_fd < 0 || !serve_init(-1, true)) {
+    exit(1);
+  }
+  op_daemon_serving = true;
+
+  while (true) {
+    int cfd = accept(lfd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      exit(1);
+    }
+    daemon_handle_req(cfd);
+  }
+}
+
+static void
+daemon_sig_handler(int sig)
+{
+  daemon_stop = 1;
+}
+
+static int
+daemon_main()
+{
+  string sock_path;
+  const char *val = getenv(SHAPI_ENV_SOCKET);
+  if (val) {
+    sock_path = val;
+  } else {
+    char buf[256];
+    snprintf(buf, sizeof(buf), SHAPI_DEF_SOCKET_FMT,
+             (unsigned int) geteuid());
+    sock_path = buf;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (sock_path.length() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long\n");
+    return 1;
+  }
+  strcpy(addr.sun_path, sock_path.c_str());
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (lfd < 0) {
+    perror("socket");
+    return 1;
+  }
+  unlink(sock_path.c_str());
+  mode_t omask = umask(077);
+  int ret = bind(lfd, (struct sockaddr *) &addr, sizeof(addr));
+  umask(omask);
+  if (ret != 0 || listen(lfd, SOMAXCONN) != 0) {
+    perror("bind/listen");
+    close(lfd);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = daemon_sig_handler;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  pid_t pid = -1;
+  time_t start = 0;
+  unsigned int quick_exits = 0;
+  while (!daemon_stop) {
+    if (pid < 0) {
+      start = time(NULL);
+      pid = fork();
+      if (pid == 0) {
+        daemon_worker(lfd);
+        exit(0);
+      } else if (pid < 0) {
+        perror("fork");
+        break;
+      }
+    }
+    int st = 0;
+    if (waitpid(pid, &st, 0) == pid) {
+      /* worker exited. restart it right away since clients may be waiting,
+       * but don't spin if it keeps failing.
+       */
+      pid = -1;
+      if (time(NULL) - start > 1) {
+        quick_exits = 0;
+      } else if (++quick_exits >= DAEMON_MAX_QUICK_EXITS) {
+        quick_exits = 0;
+        sleep(1);
+      }
+    }
+  }
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+  close(lfd);
+  unlink(sock_path.c_str());
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  exit(run_op(argc, argv));
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CLI_SHELL_API_H_
+#define _CLI_SHELL_API_H_
+
+/* this header file contains the definitions shared by the shell API
+ * "daemon mode" (cli_shell_api.cpp) and the client shim
+ * (cli_shell_api_client.c).
+ *
+ * request (client => daemon), all fields NUL-terminated:
+ *   <cwd> <num_env> <env_1> ... <env_n> <num_args> <arg_1> ... <arg_m>
+ * where env entries are "NAME=VALUE" (the client's whole environment) and
+ * args are the command-line arguments (excluding argv[0]). the client's stdin (if open) is passed
+ * with the first byte of the request (SCM_RIGHTS) and becomes the stdin of
+ * the op. the client shuts down its write side after sending the request.
+ *
+ * response (daemon => client):
+ *   "<exit_status> <stdout_len> <stderr_len>\n" <stdout> <stderr>
+ */
+
+// environment var specifying the daemon socket path
+#define SHAPI_ENV_SOCKET "VYATTA_SHELL_API_SOCKET"
+
+// default socket path (per uid since only same-uid clients are served)
+#define SHAPI_DEF_SOCKET_FMT "/opt/vyatta/config/tmp/cli-shell-api.%u"
+
+/* exit status in response indicating the request was not served, in
+ * which case the client should run the operation locally. this is the
+ * only case where the client may do so after sending the request.
+ */
+#define SHAPI_STATUS_NOT_SERVED -1
+
+// max request size accepted by the daemon
+#define SHAPI_MAX_REQ_SIZE (256 * 1024)
+
+#endif /* _CLI_SHELL_API_H_ */
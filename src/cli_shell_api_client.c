@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <cli_shell_api.h>
+
+/* This is the client shim for the shell API "daemon mode" (see
+ * cli_shell_api.cpp). It is argv-compatible with the shell API program and
+ * forwards the command line (plus cwd, stdin, and the whole environment)
+ * to the daemon. If the daemon is not available or does not serve the
+ * request, the shell API program is run instead, so the result is always
+ * the same as running the shell API program directly.
+ *
+ * Once the request has been sent, the daemon may have started the op, so
+ * the op is never run again locally if no response is received (e.g., the
+ * worker crashed). It fails instead.
+ *
+ * Note that this program must stay small (no library dependencies) since
+ * the whole point is to avoid the startup cost of the shell API program.
+ */
+
+#ifndef SHAPI_LOCAL_BIN
+#define SHAPI_LOCAL_BIN "/opt/vyatta/sbin/my_cli_shell_api"
+#endif
+
+extern char **environ;
+
+static void
+run_local(char **argv)
+{
+  execv(SHAPI_LOCAL_BIN, argv);
+  perror("execv");
+  exit(1);
+}
+
+static int
+write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int
+write_str(int fd, const char *str)
+{
+  return write_all(fd, str, strlen(str) + 1);
+}
+
+/* copy "len" bytes from the daemon to "ofd". return 0 if failed. */
+static int
+copy_out(int fd, int ofd, unsigned long len)
+{
+  char buf[65536];
+  while (len > 0) {
+    ssize_t n = read(fd, buf, (len < sizeof(buf) ? len : sizeof(buf)));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 0;
+    }
+    if (!write_all(ofd, buf, n)) {
+      return 0;
+    }
+    len -= n;
+  }
+  return 1;
+}
+
+/* send "str" (NUL-terminated) with "in_fd" (if not -1) attached. return 0
+ * if failed.
+ */
+static int
+write_str_with_fd(int fd, const char *str, int in_fd)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cm;
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (void *) str;
+  iov.iov_len = strlen(str) + 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (in_fd != -1) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &in_fd, sizeof(int));
+  }
+  do {
+    n = sendmsg(fd, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return 0;
+  }
+  // the fd went with the first byte. the rest (if any) is plain data.
+  return write_all(fd, str + n, iov.iov_len - n);
+}
+
+static int
+send_req(int fd, int in_fd, int argc, char **argv)
+{
+  char cwd[4096];
+  char num[32];
+  char **e;
+  int i, n = 0;
+  if (!getcwd(cwd, sizeof(cwd)) || !write_str_with_fd(fd, cwd, in_fd)) {
+    return 0;
+  }
+  for (e = environ; *e; e++) {
+    n++;
+  }
+  snprintf(num, sizeof(num), "%d", n);
+  if (!write_str(fd, num)) {
+    return 0;
+  }
+  for (e = environ; *e; e++) {
+    if (!write_str(fd, *e)) {
+      return 0;
+    }
+  }
+  snprintf(num, sizeof(num), "%d", argc - 1);
+  if (!write_str(fd, num)) {
+    return 0;
+  }
+  for (i = 1; i < argc; i++) {
+    if (!write_str(fd, argv[i])) {
+      return 0;
+    }
+  }
+  return (shutdown(fd, SHUT_WR) == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+  int i, fd, status;
+  int in_fd = STDIN_FILENO;
+  unsigned long olen, elen;
+  size_t hlen = 0;
+  char hdr[64];
+  struct sockaddr_un addr;
+  const char *path = getenv(SHAPI_ENV_SOCKET);
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--daemon") == 0) {
+      run_local(argv);
+    }
+  }
+
+  if (fcntl(in_fd, F_GETFD) == -1) {
+    // stdin not open (note: must check before the socket may take fd 0)
+    in_fd = -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path) {
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      run_local(argv);
+    }
+    strcpy(addr.sun_path, path);
+  } else {
+    snprintf(addr.sun_path, sizeof(addr.sun_path), SHAPI_DEF_SOCKET_FMT,
+             (unsigned int) geteuid());
+  }
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0
+      || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    // daemon not available
+    run_local(argv);
+  }
+  if (!send_req(fd, in_fd, argc, argv)) {
+    /* the daemon only processes a request after receiving all of it, so
+     * the op has not been started.
+     */
+    close(fd);
+    run_local(argv);
+  }
+
+  /* read response header. it is always short, so anything longer (or a
+   * header cut off by EOF) is invalid.
+   */
+  while (1) {
+    ssize_t n;
+    if (hlen >= sizeof(hdr) - 1) {
+      fprintf(stderr, "Invalid response from cli-shell-api daemon\n");
+      exit(1);
+    }
+    n = read(fd, &(hdr[hlen]), 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (hlen == 0) {
+        /* daemon went away without responding (the daemon responds even
+         * if the op exits in the library). the op may have been
+         * (partially) done, so it cannot be run again.
+         */
+        fprintf(stderr, "No response from cli-shell-api daemon\n");
+      } else {
+        fprintf(stderr, "Invalid response from cli-shell-api daemon\n");
+      }
+      exit(1);
+    }
+    if (hdr[hlen] == '\n') {
+      break;
+    }
+    hlen++;
+  }
+  hdr[hlen] = 0;
+  if (sscanf(hdr, "%d %lu %lu", &status, &olen, &elen) != 3) {
+    fprintf(stderr, "Invalid response from cli-shell-api daemon\n");
+    exit(1);
+  }
+  if (status == SHAPI_STATUS_NOT_SERVED) {
+    close(fd);
+    run_local(argv);
+  }
+  if (!copy_out(fd, STDOUT_FILENO, olen)
+      || !copy_out(fd, STDERR_FILENO, elen)) {
+    fprintf(stderr, "Incomplete response from cli-shell-api daemon\n");
+    exit(1);
+  }
+  exit(status);
+}
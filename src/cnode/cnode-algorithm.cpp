@@ -17,6 +17,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
 #include <tr1/memory>
 
 #include <cstore/cstore.hpp>
@@ -115,63 +116,99 @@ cnode::cmp_multi_values(const CfgNode *cfg1, const CfgNode *cfg2,
   return changed;
 }
 
-void
-cnode::cmp_non_leaf_nodes(const CfgNode *cfg1, const CfgNode *cfg2,
-                          vector<CfgNode *>& rcnodes1,
-                          vector<CfgNode *>& rcnodes2, bool& not_tag_node,
-                          bool& is_value, bool& is_leaf_typeless,
-                          string& name, string& value)
+// get the attributes of a non-leaf node (see cmp_non_leaf_nodes())
+static void
+_get_non_leaf_attrs(const CfgNode *cfg1, const CfgNode *cfg2,
+                    bool& not_tag_node, bool& is_value,
+                    bool& is_leaf_typeless, string& name, string& value)
 {
   const CfgNode *cfg = (cfg1 ? cfg1 : cfg2);
   is_value = cfg->isValue();
   not_tag_node = (!cfg->isTag() || is_value);
   is_leaf_typeless = cfg->isLeafTypeless();
-  bool is_tag_node = !not_tag_node;
   name = cfg->getName();
   if (is_value) {
     value = cfg->getValue();
   }
+}
 
-  // handle child nodes
-  vector<CfgNode *> cnodes1, cnodes2;
-  if (cfg1) {
-    cnodes1 = cfg1->getChildNodes();
-  }
-  if (cfg2) {
-    cnodes2 = cfg2->getChildNodes();
+/* order of child node keys: sortNodes() order, with equivalent keys
+ * (e.g., "1" and "01" with SORT_DEB_VERSION) ordered by string so that
+ * the order is total.
+ */
+static bool
+_cmp_keys(const string& a, const string& b)
+{
+  if (Cstore::cmpNodes(a, b)) {
+    return true;
   }
+  return (!Cstore::cmpNodes(b, a) && a < b);
+}
 
-  MapT<string, bool> map;
-  MapT<string, CfgNode *> nmap1, nmap2;
-  for (size_t i = 0; i < cnodes1.size(); i++) {
-    string key = (is_tag_node
-                  ? cnodes1[i]->getValue() : cnodes1[i]->getName());
-    map[key] = true;
-    nmap1[key] = cnodes1[i];
-  }
-  for (size_t i = 0; i < cnodes2.size(); i++) {
-    string key = (is_tag_node
-                  ? cnodes2[i]->getValue() : cnodes2[i]->getName());
-    map[key] = true;
-    nmap2[key] = cnodes2[i];
-  }
+// order of child nodes by their keys (see CfgNode::getInternedKey())
+static bool
+_cmp_child_nodes(const CfgNode *a, const CfgNode *b)
+{
+  const string *ka = a->getInternedKey();
+  const string *kb = b->getInternedKey();
+  return (ka != kb && _cmp_keys(*ka, *kb));
+}
 
-  vector<string> cnodes;
-  MapT<string, bool>::iterator it = map.begin();
-  for (; it != map.end(); ++it) {
-    cnodes.push_back((*it).first);
+/* return the child nodes of "cfg" in _cmp_child_nodes() order. they are
+ * normally in that order already (see CfgNode), in which case "sorted" is
+ * not used.
+ */
+static const vector<CfgNode *>&
+_get_sorted_child_nodes(const CfgNode *cfg, vector<CfgNode *>& sorted)
+{
+  static const vector<CfgNode *> empty;
+  if (!cfg) {
+    return empty;
+  }
+  const vector<CfgNode *>& cnodes = cfg->getChildNodes();
+  for (size_t i = 1; i < cnodes.size(); i++) {
+    if (_cmp_child_nodes(cnodes[i], cnodes[i - 1])) {
+      // out of order
+      sorted = cnodes;
+      sort(sorted.begin(), sorted.end(), _cmp_child_nodes);
+      return sorted;
+    }
   }
-  Cstore::sortNodes(cnodes);
+  return cnodes;
+}
 
-  for (size_t i = 0; i < cnodes.size(); i++) {
-    MapT<string, CfgNode *>::iterator p1 = nmap1.find(cnodes[i]);
-    MapT<string, CfgNode *>::iterator p2 = nmap2.find(cnodes[i]);
-    bool in1 = (p1 != nmap1.end());
-    bool in2 = (p2 != nmap2.end());
-    CfgNode *c1 = (in1 ? p1->second : NULL);
-    CfgNode *c2 = (in2 ? p2->second : NULL);
+void
+cnode::cmp_non_leaf_nodes(const CfgNode *cfg1, const CfgNode *cfg2,
+                          vector<CfgNode *>& rcnodes1,
+                          vector<CfgNode *>& rcnodes2, bool& not_tag_node,
+                          bool& is_value, bool& is_leaf_typeless,
+                          string& name, string& value)
+{
+  _get_non_leaf_attrs(cfg1, cfg2, not_tag_node, is_value, is_leaf_typeless,
+                      name, value);
+
+  // handle child nodes: merge the two sorted lists
+  vector<CfgNode *> sorted1, sorted2;
+  const vector<CfgNode *>& cnodes1 = _get_sorted_child_nodes(cfg1, sorted1);
+  const vector<CfgNode *>& cnodes2 = _get_sorted_child_nodes(cfg2, sorted2);
+  rcnodes1.reserve(rcnodes1.size() + cnodes1.size() + cnodes2.size());
+  rcnodes2.reserve(rcnodes2.size() + cnodes1.size() + cnodes2.size());
+  size_t i = 0, j = 0;
+  while (i < cnodes1.size() || j < cnodes2.size()) {
+    CfgNode *c1 = (i < cnodes1.size() ? cnodes1[i] : NULL);
+    CfgNode *c2 = (j < cnodes2.size() ? cnodes2[j] : NULL);
+    if (c1 && c2 && c1->getInternedKey() != c2->getInternedKey()) {
+      // only the one that goes first
+      if (_cmp_child_nodes(c1, c2)) {
+        c2 = NULL;
+      } else {
+        c1 = NULL;
+      }
+    }
     rcnodes1.push_back(c1);
     rcnodes2.push_back(c2);
+    i += (c1 ? 1 : 0);
+    j += (c2 ? 1 : 0);
   }
 }
 
@@ -443,10 +480,27 @@ _diff_check_and_show_leaf(const CfgNode *cfg1, const CfgNode *cfg2, int level,
   return true;
 }
 
-static void 
-_diff_show_other(const CfgNode *cfg1, const CfgNode *cfg2, int level,
-                 Cpath& cur_path, Cpath& last_ctx, bool show_def,
-                 bool hide_secret, bool context_diff)
+/* state of a non-leaf node between showing its beginning and its end (see
+ * _diff_show_other()).
+ */
+struct DiffOtherState {
+  bool orig_cdiff;
+  const char *pfx_diff;
+  bool print_this;
+  bool is_value;
+  bool is_leaf_typeless;
+  // for the child nodes
+  int next_level;
+  bool context_diff;
+};
+
+/* show the beginning of a non-leaf node, i.e., everything before its child
+ * nodes. "st" is set for the child nodes and _diff_show_other_end().
+ */
+static void
+_diff_show_other_begin(const CfgNode *cfg1, const CfgNode *cfg2, int level,
+                       Cpath& cur_path, Cpath& last_ctx, bool context_diff,
+                       DiffOtherState& st)
 {
   bool orig_cdiff = context_diff;
   const char *pfx_diff = PFX_DIFF_NONE.c_str();
@@ -462,9 +516,8 @@ _diff_show_other(const CfgNode *cfg1, const CfgNode *cfg2, int level,
 
   string name, value;
   bool not_tag_node, is_value, is_leaf_typeless;
-  vector<CfgNode *> rcnodes1, rcnodes2;
-  cmp_non_leaf_nodes(cfg1, cfg2, rcnodes1, rcnodes2, not_tag_node, is_value,
-                      is_leaf_typeless, name, value);
+  _get_non_leaf_attrs(cfg1, cfg2, not_tag_node, is_value, is_leaf_typeless,
+                      name, value);
 
   /* only print "this" node if it
    *   (1) is a tag value or an intermediate node,
@@ -556,24 +609,32 @@ _diff_show_other(const CfgNode *cfg1, const CfgNode *cfg2, int level,
     next_level = (level >= 0 ? level : 0);
   }
 
-  for (size_t i = 0; i < rcnodes1.size(); i++) {
-    _show_diff(rcnodes1[i], rcnodes2[i], next_level, cur_path, last_ctx,
-               show_def, hide_secret, context_diff);
-  }
+  st.orig_cdiff = orig_cdiff;
+  st.pfx_diff = pfx_diff;
+  st.print_this = print_this;
+  st.is_value = is_value;
+  st.is_leaf_typeless = is_leaf_typeless;
+  st.next_level = next_level;
+  st.context_diff = context_diff;
+}
 
-  // finish printing "this" node if necessary
-  if (print_this) {
+// finish showing a non-leaf node if necessary (see _diff_show_other_begin())
+static void
+_diff_show_other_end(const CfgNode *cfg1, const CfgNode *cfg2, int level,
+                     Cpath& cur_path, const DiffOtherState& st)
+{
+  if (st.print_this) {
     cur_path.pop();
-    if (is_value) {
+    if (st.is_value) {
       cur_path.pop();
     }
-    if (!orig_cdiff || pfx_diff != PFX_DIFF_NONE.c_str()) {
+    if (!st.orig_cdiff || st.pfx_diff != PFX_DIFF_NONE.c_str()) {
       /* not context diff OR there is a difference => print closing '}'
        * if necessary. also note the exception above where is_leaf_typeless
        * is set to true to prevent this.
        */
-      if (!is_leaf_typeless) {
-        _diff_print_indent(cfg1, cfg2, level, pfx_diff);
+      if (!st.is_leaf_typeless) {
+        _diff_print_indent(cfg1, cfg2, level, st.pfx_diff);
         printf("}\n");
       }
     }
@@ -581,9 +642,33 @@ _diff_show_other(const CfgNode *cfg1, const CfgNode *cfg2, int level,
 }
 
 static void
-_show_diff(const CfgNode *cfg1, const CfgNode *cfg2, int level,
-           Cpath& cur_path, Cpath& last_ctx, bool show_def,
-           bool hide_secret, bool context_diff)
+_diff_show_other(const CfgNode *cfg1, const CfgNode *cfg2, int level,
+                 Cpath& cur_path, Cpath& last_ctx, bool show_def,
+                 bool hide_secret, bool context_diff)
+{
+  DiffOtherState st;
+  _diff_show_other_begin(cfg1, cfg2, level, cur_path, last_ctx, context_diff,
+                         st);
+
+  string name, value;
+  bool not_tag_node, is_value, is_leaf_typeless;
+  vector<CfgNode *> rcnodes1, rcnodes2;
+  cmp_non_leaf_nodes(cfg1, cfg2, rcnodes1, rcnodes2, not_tag_node, is_value,
+                     is_leaf_typeless, name, value);
+  for (size_t i = 0; i < rcnodes1.size(); i++) {
+    _show_diff(rcnodes1[i], rcnodes2[i], st.next_level, cur_path, last_ctx,
+               show_def, hide_secret, st.context_diff);
+  }
+
+  _diff_show_other_end(cfg1, cfg2, level, cur_path, st);
+}
+
+/* check the two nodes before showing the diff (see _show_diff()). return
+ * false if there is nothing to show.
+ */
+static bool
+_diff_check_nodes(const CfgNode *& cfg1, const CfgNode *& cfg2, int& level,
+                  bool context_diff)
 {
   // if doesn't exist, treat as NULL
   if (cfg1 && !cfg1->exists()) {
@@ -617,13 +702,24 @@ _show_diff(const CfgNode *cfg1, const CfgNode *cfg2, int level,
        * means that during the recursion cfg1 and cfg2 must be different
        * if doing context diff.
        */
-      return;
+      return false;
     }
     /* when doing context diff, the display indentation level always starts
      * at 0.
      */
     level = 0;
   }
+  return true;
+}
+
+static void
+_show_diff(const CfgNode *cfg1, const CfgNode *cfg2, int level,
+           Cpath& cur_path, Cpath& last_ctx, bool show_def,
+           bool hide_secret, bool context_diff)
+{
+  if (!_diff_check_nodes(cfg1, cfg2, level, context_diff)) {
+    return;
+  }
 
   if (_diff_check_and_show_leaf(cfg1, cfg2, (level >= 0 ? level : 0),
                                 cur_path, last_ctx, show_def, hide_secret,
@@ -637,6 +733,74 @@ _show_diff(const CfgNode *cfg1, const CfgNode *cfg2, int level,
   }
 }
 
+/* same as _show_diff() but walk the two configs one node at a time. the
+ * child nodes of the two sides are merged as they are walked, so only the
+ * nodes on the current path are in memory. "w1" and "w2" are the same
+ * walker when showing a single config.
+ */
+static void
+_stream_diff(CfgWalker *w1, CfgWalker *w2, int level, Cpath& cur_path,
+             Cpath& last_ctx, bool show_def, bool hide_secret,
+             bool context_diff)
+{
+  const CfgNode *cfg1 = (w1 ? w1->getNode() : NULL);
+  const CfgNode *cfg2 = (w2 ? w2->getNode() : NULL);
+  if (!_diff_check_nodes(cfg1, cfg2, level, context_diff)) {
+    return;
+  }
+
+  if (_diff_check_and_show_leaf(cfg1, cfg2, (level >= 0 ? level : 0),
+                                cur_path, last_ctx, show_def, hide_secret,
+                                context_diff)) {
+    // leaf node has been shown. done.
+    return;
+  }
+
+  // intermediate node, tag node, or tag value
+  DiffOtherState st;
+  _diff_show_other_begin(cfg1, cfg2, level, cur_path, last_ctx, context_diff,
+                         st);
+
+  // a side that doesn't exist has no child nodes
+  static const vector<string> empty;
+  const vector<string>& keys1 = (cfg1 ? w1->getChildKeys() : empty);
+  const vector<string>& keys2 = (cfg2 ? w2->getChildKeys() : empty);
+  bool same = (cfg1 == cfg2);
+  size_t i = 0, j = 0;
+  while (i < keys1.size() || (!same && j < keys2.size())) {
+    bool in1 = false, in2 = false;
+    const string *key = NULL;
+    if (same) {
+      in1 = in2 = true;
+      key = &(keys1[i]);
+    } else if (j == keys2.size()
+               || (i < keys1.size() && _cmp_keys(keys1[i], keys2[j]))) {
+      // keys1[i] goes first
+      in1 = true;
+      key = &(keys1[i]);
+    } else if (i == keys1.size() || keys1[i] != keys2[j]) {
+      in2 = true;
+      key = &(keys2[j]);
+    } else {
+      in1 = in2 = true;
+      key = &(keys1[i]);
+    }
+
+    CfgWalker *c1 = (in1 ? w1->getChild(*key) : NULL);
+    CfgWalker *c2 = (same ? c1 : (in2 ? w2->getChild(*key) : NULL));
+    _stream_diff(c1, c2, st.next_level, cur_path, last_ctx, show_def,
+                 hide_secret, st.context_diff);
+    if (c2 != c1) {
+      delete c2;
+    }
+    delete c1;
+    i += (in1 ? 1 : 0);
+    j += (in2 ? 1 : 0);
+  }
+
+  _diff_show_other_end(cfg1, cfg2, level, cur_path, st);
+}
+
 static void
 _get_comment_diff_cmd(const CfgNode *cfg1, const CfgNode *cfg2,
                       Cpath& cur_path, vector<Cpath>& com_list,
@@ -852,6 +1016,24 @@ _print_cmds_list(const char *op, vector<Cpath>& list)
   }
 }
 
+/* return a walker for the specified config (see showConfig()). a config
+ * file is parsed into "froot". return NULL if the file cannot be parsed.
+ */
+static CfgWalker *
+_get_walker(const string& cfg, Cstore& cstore, const Cpath& path,
+            tr1::shared_ptr<CfgNode>& froot)
+{
+  if (cfg == ACTIVE_CFG || cfg == WORKING_CFG) {
+    // note: if there is no config session, working config will abort
+    return (new CfgStoreWalker(cstore, path, (cfg == ACTIVE_CFG)));
+  }
+  froot.reset(cparse::parse_file(cfg.c_str(), cstore));
+  if (!froot.get()) {
+    return NULL;
+  }
+  return (new CfgTreeWalker(*froot));
+}
+
 ////// algorithms
 int
 cnode::show_cfg_diff(const CfgNode& cfg1, const CfgNode& cfg2,
@@ -882,6 +1064,38 @@ cnode::show_cfg(const CfgNode& cfg, bool show_def, bool hide_secret)
   return res;
 }
 
+// streaming versions of the above
+int
+cnode::show_cfg_diff(CfgWalker& cfg1, CfgWalker& cfg2, Cpath& cur_path,
+                     bool show_def, bool hide_secret, bool context_diff)
+{
+  const CfgNode *n1 = cfg1.getNode();
+  const CfgNode *n2 = cfg2.getNode();
+  if (n1->isInvalid() || n2->isInvalid()) {
+    printf("Specified configuration path is not valid\n");
+    return VYOS_INVALID_PATH;
+  }
+  bool empty1 = (!n1->isLeaf() && cfg1.getChildKeys().size() == 0);
+  bool empty2 = (!n2->isLeaf() && cfg2.getChildKeys().size() == 0);
+  if ((empty1 && empty2) || (!n1->exists() && !n2->exists())) {
+    printf("Configuration under specified path is empty\n");
+    return VYOS_EMPTY_CONFIG;
+  }
+  // use an invalid value for initial last_ctx
+  Cpath last_ctx;
+  _stream_diff(&cfg1, &cfg2, -1, cur_path, last_ctx, show_def, hide_secret,
+               context_diff);
+  return VYOS_SUCCESS;
+}
+
+int
+cnode::show_cfg(CfgWalker& cfg, bool show_def, bool hide_secret)
+{
+  Cpath cur_path;
+  int res = show_cfg_diff(cfg, cfg, cur_path, show_def, hide_secret);
+  return res;
+}
+
 void
 cnode::show_cmds_diff(const CfgNode& cfg1, const CfgNode& cfg2)
 {
@@ -925,7 +1139,6 @@ cnode::showConfig(const string& cfg1, const string& cfg2,
                   const Cpath& path, bool show_def, bool hide_secret,
                   bool context_diff, bool show_cmds, bool ignore_edit)
 {
-  tr1::shared_ptr<CfgNode> aroot, wroot, croot1, croot2;
   tr1::shared_ptr<Cstore> cstore;
   Cpath rpath(path);
   Cpath cur_path;
@@ -940,12 +1153,41 @@ cnode::showConfig(const string& cfg1, const string& cfg2,
     cstore.reset(Cstore::createCstore(false));
     rpath.clear();
   }
-  if (cfg1 == ACTIVE_CFG || cfg2 == ACTIVE_CFG) {
-    aroot.reset(new CfgNode(*cstore, rpath, true, true));
+
+  if (!show_cmds) {
+    /* walk the active/working config(s) instead of constructing the trees
+     * so that the output is produced while reading the configs.
+     */
+    tr1::shared_ptr<CfgNode> froot1, froot2;
+    tr1::shared_ptr<CfgWalker> w1(_get_walker(cfg1, *cstore, rpath, froot1));
+    tr1::shared_ptr<CfgWalker> w2;
+    if (cfg2 == cfg1 && (cfg2 == ACTIVE_CFG || cfg2 == WORKING_CFG)) {
+      // same config => just a "show"
+      w2 = w1;
+    } else {
+      w2.reset(_get_walker(cfg2, *cstore, rpath, froot2));
+    }
+    if (!w1.get() || !w2.get()) {
+      printf("Cannot parse specified config file(s)\n");
+      return VYOS_CONFIG_PARSE_ERROR;
+    }
+    return show_cfg_diff(*w1, *w2, cur_path, show_def, hide_secret,
+                         context_diff);
   }
-  if (cfg1 == WORKING_CFG || cfg2 == WORKING_CFG) {
+
+  // all trees are released together at the end
+  CfgArena arena;
+  tr1::shared_ptr<CfgNode> aroot, wroot, croot1, croot2;
+  bool need_active = (cfg1 == ACTIVE_CFG || cfg2 == ACTIVE_CFG);
+  bool need_working = (cfg1 == WORKING_CFG || cfg2 == WORKING_CFG);
+  if (need_active && need_working) {
+    // note: if there is no config session, this will abort
+    CfgNode::buildActiveWorking(*cstore, rpath, aroot, wroot, &arena);
+  } else if (need_active) {
+    aroot.reset(new CfgNode(*cstore, rpath, true, true, &arena));
+  } else if (need_working) {
     // note: if there is no config session, this will abort
-    wroot.reset(new CfgNode(*cstore, rpath, false, true));
+    wroot.reset(new CfgNode(*cstore, rpath, false, true, &arena));
   }
 
   if (cfg1 == ACTIVE_CFG) {
@@ -953,28 +1195,22 @@ cnode::showConfig(const string& cfg1, const string& cfg2,
   } else if (cfg1 == WORKING_CFG) {
     croot1 = wroot;
   } else {
-    croot1.reset(cparse::parse_file(cfg1.c_str(), *cstore));
+    croot1.reset(cparse::parse_file(cfg1.c_str(), *cstore, &arena));
   }
   if (cfg2 == ACTIVE_CFG) {
     croot2 = aroot;
   } else if (cfg2 == WORKING_CFG) {
     croot2 = wroot;
   } else {
-    croot2.reset(cparse::parse_file(cfg2.c_str(), *cstore));
+    croot2.reset(cparse::parse_file(cfg2.c_str(), *cstore, &arena));
   }
   if (!croot1.get() || !croot2.get()) {
     printf("Cannot parse specified config file(s)\n");
     return VYOS_CONFIG_PARSE_ERROR;
   }
 
-  if (show_cmds) {
-    show_cmds_diff(*croot1, *croot2);
-    return 0;
-  } else {
-    int res = show_cfg_diff(*croot1, *croot2, cur_path, show_def, hide_secret,
-                            context_diff);
-    return res;
-  }
+  show_cmds_diff(*croot1, *croot2);
+  return 0;
 }
 
 /* find and return pointer to the CfgNode corresponding to specified path in
@@ -1022,22 +1258,9 @@ cnode::findCfgNode(CfgNode *root, const Cpath& path, bool& is_value)
       }
     }
 
-    const vector<CfgNode *>& cnodes = node->getChildNodes();
-    bool found = false;
-    for (size_t j = 0; j < cnodes.size(); j++) {
-      if (cnodes[j]->isValue()) {
-        // tag value
-        found = (cnodes[j]->getValue() == path[i]);
-      } else {
-        // others
-        found = (cnodes[j]->getName() == path[i]);
-      }
-      if (found) {
-        node = cnodes[j];
-        break;
-      }
-    }
-    if (!found) {
+    // value for tag value and name for others
+    node = node->findChildNode(path.interned(i));
+    if (!node) {
       return NULL;
     }
   }
@@ -1092,3 +1315,77 @@ cnode::getCfgNodeValues(CfgNode *root, const Cpath& path,
   return true;
 }
 
+
+////// class CfgTreeWalker
+const vector<string>&
+CfgTreeWalker::getChildKeys()
+{
+  if (_init) {
+    return _keys;
+  }
+  _init = true;
+  // same keys as cmp_non_leaf_nodes()
+  bool is_tag_node = _node.isTagNode();
+  const vector<CfgNode *>& cnodes = _node.getChildNodes();
+  for (size_t i = 0; i < cnodes.size(); i++) {
+    _keys.push_back(is_tag_node
+                    ? cnodes[i]->getValue() : cnodes[i]->getName());
+  }
+  sort(_keys.begin(), _keys.end(), _cmp_keys);
+  return _keys;
+}
+
+CfgWalker *
+CfgTreeWalker::getChild(const string& key)
+{
+  CfgNode *cn = _node.findChildNode(Intern::get(key));
+  return (cn ? new CfgTreeWalker(*cn) : NULL);
+}
+
+
+////// class CfgStoreWalker
+// the root of the walk can be any path, so use the per-node observers
+CfgStoreWalker::CfgStoreWalker(Cstore& cstore, const Cpath& path,
+                               bool active)
+  : _cstore(cstore), _path(path), _active(active)
+{
+  read_node();
+}
+
+// child node: read the node (only) in a single pass
+CfgStoreWalker::CfgStoreWalker(Cstore& cstore, const Cpath& path,
+                               bool active, const string& key)
+  : _cstore(cstore), _path(path), _active(active)
+{
+  _path.push(key);
+  CfgRawNode raw;
+  if (!_cstore.cfgPathGetNodeDA(_path, raw, _active)) {
+    // fall back to the per-node observers
+    read_node();
+    return;
+  }
+  _node.reset(new CfgNode(_cstore, _path, raw));
+  if (_node->exists() && !_node->isInvalid() && !_node->isLeaf()) {
+    for (size_t i = 0; i < raw.children.size(); i++) {
+      _keys.push_back(raw.children[i].name);
+    }
+    sort(_keys.begin(), _keys.end(), _cmp_keys);
+  }
+}
+
+CfgWalker *
+CfgStoreWalker::getChild(const string& key)
+{
+  return (new CfgStoreWalker(_cstore, _path, _active, key));
+}
+
+// read the node with the per-node observers
+void
+CfgStoreWalker::read_node()
+{
+  _node.reset(new CfgNode(_cstore, _path, _active, false));
+  if (_node->exists() && !_node->isInvalid() && !_node->isLeaf()) {
+    _cstore.cfgPathGetChildNodesDA(_path, _keys, _active, true);
+    sort(_keys.begin(), _keys.end(), _cmp_keys);
+  }
+}
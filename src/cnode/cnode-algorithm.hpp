@@ -19,6 +19,7 @@
 
 #include <vector>
 #include <string>
+#include <tr1/memory>
 
 #include <cstore/cpath.hpp>
 #include <cnode/cnode.hpp>
@@ -49,6 +50,68 @@ int show_cfg_diff(const CfgNode& cfg1, const CfgNode& cfg2,
 int show_cfg(const CfgNode& cfg, bool show_def = false,
               bool hide_secret = false);
 
+/* walk a config one node at a time for the "streaming" show functions
+ * below, which produce the output while walking the configs instead of
+ * constructing the whole trees first.
+ */
+class CfgWalker {
+public:
+  virtual ~CfgWalker() {};
+
+  // current node. note that it may not have its child nodes.
+  virtual const CfgNode *getNode() = 0;
+  /* keys of the child nodes (values if tag node) in sortNodes() order,
+   * with equivalent keys ordered by string.
+   */
+  virtual const std::vector<std::string>& getChildKeys() = 0;
+  // walker for the specified child node (caller owns it)
+  virtual CfgWalker *getChild(const std::string& key) = 0;
+};
+
+// walk a CfgNode tree, e.g., from a config file
+class CfgTreeWalker : public CfgWalker {
+public:
+  CfgTreeWalker(const CfgNode& node) : _node(node), _init(false) {};
+
+  const CfgNode *getNode() { return &_node; };
+  const std::vector<std::string>& getChildKeys();
+  CfgWalker *getChild(const std::string& key);
+
+private:
+  const CfgNode& _node;
+  bool _init;
+  std::vector<std::string> _keys;
+};
+
+/* walk the active/working config. each node is read when it is reached
+ * (see cstore::Cstore::cfgPathGetNodeDA()).
+ */
+class CfgStoreWalker : public CfgWalker {
+public:
+  CfgStoreWalker(cstore::Cstore& cstore, const cstore::Cpath& path,
+                 bool active);
+
+  const CfgNode *getNode() { return _node.get(); };
+  const std::vector<std::string>& getChildKeys() { return _keys; };
+  CfgWalker *getChild(const std::string& key);
+
+private:
+  cstore::Cstore& _cstore;
+  cstore::Cpath _path;
+  bool _active;
+  std::tr1::shared_ptr<CfgNode> _node;
+  std::vector<std::string> _keys;
+
+  CfgStoreWalker(cstore::Cstore& cstore, const cstore::Cpath& path,
+                 bool active, const std::string& key);
+  void read_node();
+};
+
+int show_cfg_diff(CfgWalker& cfg1, CfgWalker& cfg2, cstore::Cpath& cur_path,
+                  bool show_def = false, bool hide_secret = false,
+                  bool context_diff = false);
+int show_cfg(CfgWalker& cfg, bool show_def = false, bool hide_secret = false);
+
 void show_cmds_diff(const CfgNode& cfg1, const CfgNode& cfg2);
 void show_cmds(const CfgNode& cfg);
 
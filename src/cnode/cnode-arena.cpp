@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <vector>
+#include <algorithm>
+
+#include <cstore/work-pool.hpp>
+#include <cnode/cnode.hpp>
+#include <cnode/cnode-arena.hpp>
+
+using namespace cnode;
+using namespace cstore;
+using namespace std;
+
+
+////// constructors/destructors
+CfgArena::CfgArena()
+{
+  WorkPool *pool = WorkPool::get();
+  size_t n = (pool ? pool->numThreads() : 1);
+  for (size_t i = 0; i < n; i++) {
+    _lanes.push_back(new Lane());
+  }
+}
+
+CfgArena::~CfgArena()
+{
+  for (size_t i = 0; i < _lanes.size(); i++) {
+    Lane *l = _lanes[i];
+    for (size_t b = 0; b < l->blocks.size(); b++) {
+      size_t n = ((b + 1) == l->blocks.size() ? l->used : C_BLOCK_NODES);
+      for (size_t j = 0; j < n; j++) {
+        void *p = l->blocks[b] + (j * sizeof(CfgNode));
+        if (l->released.size() > 0
+            && find(l->released.begin(), l->released.end(), p)
+               != l->released.end()) {
+          continue;
+        }
+        static_cast<CfgNode *>(p)->~CfgNode();
+      }
+      ::operator delete(l->blocks[b]);
+    }
+    delete l;
+  }
+}
+
+
+////// public functions
+void *
+CfgArena::allocNode()
+{
+  Lane& l = get_lane();
+  if (l.used == C_BLOCK_NODES) {
+    l.blocks.push_back(static_cast<char *>(
+                         ::operator new(C_BLOCK_NODES * sizeof(CfgNode))));
+    l.used = 0;
+  }
+  return (l.blocks.back() + (l.used++ * sizeof(CfgNode)));
+}
+
+void
+CfgArena::releaseNode(void *p)
+{
+  // the space is not reused since later slots may be in use already
+  get_lane().released.push_back(p);
+}
+
+
+////// private functions
+CfgArena::Lane&
+CfgArena::get_lane()
+{
+  size_t idx = WorkPool::threadIndex();
+  return *(_lanes[(idx < _lanes.size() ? idx : 0)]);
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CNODE_ARENA_HPP_
+#define _CNODE_ARENA_HPP_
+#include <vector>
+
+namespace cnode {
+
+class CfgNode;
+
+/* arena for CfgNode trees.
+ *
+ * the nodes of a tree constructed with an arena (see the CfgNode
+ * constructors) are allocated in large blocks instead of one by one. so
+ * constructing a tree needs far fewer allocations, and the nodes of a
+ * subtree are mostly next to each other in memory.
+ *
+ * the arena owns all such nodes except the root (which is allocated
+ * normally so that callers can delete it as usual), and the nodes do not
+ * own their child nodes. when the arena is destroyed, the nodes are
+ * destroyed block by block in allocation order (no recursion and no
+ * individual free) and then the blocks are freed.
+ *
+ * each WorkPool thread allocates from its own "lane", so a tree can be
+ * built in parallel (see CfgNode::add_raw_child_nodes()) without locking.
+ * all non-WorkPool threads share lane 0, so only one of them can use an
+ * arena at a time.
+ *
+ * note: the arena must outlive the trees (and copies of their nodes) that
+ * use it, and nodes allocated in it must not be deleted individually.
+ */
+class CfgArena {
+public:
+  CfgArena();
+  ~CfgArena();
+
+  // return space for one CfgNode (see CfgNode::operator new)
+  void *allocNode();
+  // construction of the node at "p" failed, so it must not be destroyed
+  void releaseNode(void *p);
+
+private:
+  static const size_t C_BLOCK_NODES = 256;
+
+  struct Lane {
+    Lane() : used(C_BLOCK_NODES) {};
+    std::vector<char *> blocks;
+    size_t used; // number of slots used in the last block
+    std::vector<void *> released;
+  };
+
+  std::vector<Lane *> _lanes; // indexed by WorkPool::threadIndex()
+
+  Lane& get_lane();
+};
+
+} // namespace cnode
+
+#endif /* _CNODE_ARENA_HPP_ */
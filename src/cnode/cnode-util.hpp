@@ -26,7 +26,7 @@ public:
   typedef std::vector<N *> nodes_vec_type;
   typedef typename nodes_vec_type::iterator nodes_iter_type;
 
-  TreeNode() : _parent(0) {}
+  TreeNode() : _parent(0), _child_gen(0) {}
   virtual ~TreeNode() { 
     for ( nodes_iter_type it = _child_nodes.begin(); it != _child_nodes.end(); ++it ) 
       delete * it;
@@ -39,11 +39,17 @@ public:
   }
   node_type *getParent() const { return _parent; }
   node_type *childAt(size_t idx) { return _child_nodes[idx]; }
+  // changes whenever the child nodes change (e.g., for indexing them)
+  size_t childNodesGen() const { return _child_gen; }
   void setParent(node_type *p) { _parent = p; }
-  void clearChildNodes() { _child_nodes.clear(); }
+  void clearChildNodes() {
+    _child_nodes.clear();
+    ++_child_gen;
+  }
   void addChildNode(node_type *cnode) {
     _child_nodes.push_back(cnode);
     cnode->_parent = static_cast<node_type *>(this);
+    ++_child_gen;
   }
 
   bool removeChildNode(node_type *cnode) {
@@ -51,6 +57,7 @@ public:
     while (it != _child_nodes.end()) {
       if (*it == cnode) {
         _child_nodes.erase(it);
+        ++_child_gen;
         return true;
       }
       ++it;
@@ -75,11 +82,13 @@ public:
       _child_nodes[i]->_parent = 0;
     }
     _child_nodes.clear();
+    ++_child_gen;
   }
 
 private:
   node_type *_parent;
   nodes_vec_type _child_nodes;
+  size_t _child_gen;
 };
 
 } // namespace cnode
@@ -22,20 +22,99 @@
 #include <memory>
 
 #include <cli_cstore.h>
+#include <cstore/work-pool.hpp>
 #include <cnode/cnode.hpp>
 
 using namespace cnode;
 using namespace cstore;
 
 
+////// helper classes
+/* a template reader (see Cstore::createTmplReader()) for each thread in the
+ * WorkPool so that the threads can build subtrees at the same time. the
+ * thread that creates this uses the specified cstore.
+ */
+class CfgNode::TmplReaders {
+public:
+  TmplReaders(Cstore& cstore, WorkPool *pool)
+    : _readers(pool->numThreads(), NULL),
+      _owner(WorkPool::threadIndex()) {
+    for (size_t i = 0; i < _readers.size(); i++) {
+      _readers[i] = ((i == _owner) ? &cstore : cstore.createTmplReader());
+    }
+  };
+  ~TmplReaders() {
+    for (size_t i = 0; i < _readers.size(); i++) {
+      if (i != _owner) {
+        delete _readers[i];
+      }
+    }
+  };
+  Cstore& get() { return *(_readers[WorkPool::threadIndex()]); };
+
+private:
+  vector<Cstore *> _readers;
+  size_t _owner;
+};
+
+// build the child nodes [begin, end) of a node
+class CfgNode::BuildTask : public WorkPool::Task {
+public:
+  BuildTask(const Cpath& path_comps, const vector<const CfgRawNode *>& craw,
+            vector<CfgNode *>& cnodes, size_t begin, size_t end,
+            TmplReaders *readers, CfgArena *arena)
+    : _path_comps(path_comps), _craw(craw), _cnodes(cnodes),
+      _begin(begin), _end(end), _readers(readers), _arena(arena) {};
+  void run() {
+    Cstore& cstore = _readers->get();
+    Cpath path_comps(_path_comps);
+    for (size_t i = _begin; i < _end; i++) {
+      path_comps.push(_craw[i]->name);
+      _cnodes[i] = new (_arena) CfgNode(cstore, path_comps, *(_craw[i]),
+                                        _readers, _arena);
+      path_comps.pop();
+    }
+  };
+
+private:
+  const Cpath& _path_comps;
+  const vector<const CfgRawNode *>& _craw;
+  vector<CfgNode *>& _cnodes;
+  size_t _begin;
+  size_t _end;
+  TmplReaders *_readers;
+  CfgArena *_arena;
+};
+
+// build the whole subtree of a node (see buildActiveWorking())
+class CfgNode::BuildRootTask : public WorkPool::Task {
+public:
+  BuildRootTask(CfgNode *root, Cstore& cstore, const Cpath& path_comps,
+                const CfgRawNode& raw)
+    : _root(root), _cstore(cstore), _path_comps(path_comps), _raw(raw) {};
+  void run() {
+    _root->add_raw_child_nodes(_cstore, _path_comps, _raw, NULL);
+  };
+
+private:
+  CfgNode *_root;
+  Cstore& _cstore;
+  // own copy since the caller keeps using its path
+  Cpath _path_comps;
+  const CfgRawNode& _raw;
+};
+
+
 ////// constructors/destructors
 // for parser
 CfgNode::CfgNode(Cpath& path_comps, char *name, char *val, char *comment,
-                 int deact, Cstore *cstore, bool tag_if_invalid)
+                 int deact, Cstore *cstore, bool tag_if_invalid,
+                 CfgArena *arena)
   : TreeNode<CfgNode>(),
     _is_tag(false), _is_leaf(false), _is_multi(false), _is_value(false),
     _is_default(false), _is_deactivated(false), _is_leaf_typeless(false),
-    _is_invalid(false), _exists(true)
+    _is_invalid(false), _exists(true), _name(Intern::empty()),
+    _value(Intern::empty()), _arena(arena), _child_index_gen(0)
 {
   if (name && name[0]) {
     // name must be non-empty
@@ -117,23 +196,48 @@ CfgNode::CfgNode(Cpath& path_comps, char *name, char *val, char *comment,
     if (_is_multi) {
       _values.push_back(val);
     } else {
-      _value = val;
+      _value = Intern::get(val);
     }
     path_comps.pop();
   }
   if (name && name[0]) {
-    _name = name;
+    _name = Intern::get(name);
     path_comps.pop();
   }
 }
 
 // for active/working config
 CfgNode::CfgNode(Cstore& cstore, Cpath& path_comps, bool active,
-                 bool recursive)
+                 bool recursive, CfgArena *arena)
+  : TreeNode<CfgNode>(),
+    _is_tag(false), _is_leaf(false), _is_multi(false), _is_value(false),
+    _is_default(false), _is_deactivated(false), _is_leaf_typeless(false),
+    _is_invalid(false), _exists(true), _name(Intern::empty()),
+    _value(Intern::empty()), _arena(arena), _child_index_gen(0)
+{
+  CfgRawNode raw;
+  if (init_node(cstore, path_comps, active, recursive, raw)) {
+    add_raw_child_nodes(cstore, path_comps, raw, NULL);
+  }
+}
+
+// for buildActiveWorking()
+CfgNode::CfgNode(CfgArena *arena)
   : TreeNode<CfgNode>(),
     _is_tag(false), _is_leaf(false), _is_multi(false), _is_value(false),
     _is_default(false), _is_deactivated(false), _is_leaf_typeless(false),
-    _is_invalid(false), _exists(true)
+    _is_invalid(false), _exists(true), _name(Intern::empty()),
+    _value(Intern::empty()), _arena(arena), _child_index_gen(0)
+{
+}
+
+/* set up this node from active/working config. return true if the subtree
+ * has been read into "raw", in which case the caller needs to add the child
+ * nodes from it.
+ */
+bool
+CfgNode::init_node(Cstore& cstore, Cpath& path_comps, bool active,
+                   bool recursive, CfgRawNode& raw)
 {
   /* first get the def (only if path is not empty). if path is empty, i.e.,
    * "root", treat it as an intermediate node.
@@ -145,7 +249,7 @@ CfgNode::CfgNode(Cstore& cstore, Cpath& path_comps, bool active,
       if (!cstore.cfgPathExists(path_comps, active)) {
         // path doesn't exist
         _exists = false;
-        return;
+        return false;
       }
 
       _is_value = getTmpl()->isValue();
@@ -154,45 +258,58 @@ CfgNode::CfgNode(Cstore& cstore, Cpath& path_comps, bool active,
       _is_multi = getTmpl()->isMulti();
       _is_default = cstore.cfgPathDefault(path_comps, active);
       _is_deactivated = cstore.cfgPathDeactivated(path_comps, active);
-      cstore.cfgPathGetComment(path_comps, _comment, active);
-      // ignore return
+      string comment;
+      if (cstore.cfgPathGetComment(path_comps, comment, active)) {
+        _comment = comment;
+      }
 
       if (_is_leaf && _is_value) {
         /* "leaf value" so recursion should never reach here. if path is
          * specified by user, nothing further to do.
          */
-        return;
+        return false;
       }
     } else {
       // not a valid node
       _is_invalid = true;
-      return;
+      return false;
     }
   }
 
   // handle leaf node (note path_comps must be non-empty if this is leaf)
   if (_is_leaf) {
-    _name = path_comps[path_comps.size() - 1];
+    _name = path_comps.interned(path_comps.size() - 1);
     if (_is_multi) {
       // multi-value node
       cstore.cfgPathGetValuesDA(path_comps, _values, active, true);
       // ignore return value
     } else {
       // single-value node
-      cstore.cfgPathGetValueDA(path_comps, _value, active, true);
+      string value;
+      cstore.cfgPathGetValueDA(path_comps, value, active, true);
       // ignore return value
+      _value = Intern::get(value);
     }
-    return;
+    return false;
   }
 
   // handle intermediate (typeless) or tag
   if (_is_value) {
     // tag value
-    _name = path_comps[path_comps.size() - 2];
-    _value = path_comps[path_comps.size() - 1];
-  } else {
+    _name = path_comps.interned(path_comps.size() - 2);
+    _value = path_comps.interned(path_comps.size() - 1);
+  } else if (path_comps.size() > 0) {
     // tag node or typeless node
-    _name = (path_comps.size() > 0 ? path_comps[path_comps.size() - 1] : "");
+    _name = path_comps.interned(path_comps.size() - 1);
+  }
+
+  if (recursive) {
+    /* read the whole subtree in a single pass if the backend supports it.
+     * otherwise fall back to the per-node observers below.
+     */
+    if (cstore.cfgPathGetSubtreeDA(path_comps, raw, active)) {
+      return true;
+    }
   }
 
   // check child nodes
@@ -206,20 +323,363 @@ CfgNode::CfgNode(Cstore& cstore, Cpath& path_comps, bool active,
       // typeless leaf node
       _is_leaf_typeless = true;
     }
-    return;
+    return false;
   }
 
   if (!recursive) {
     // nothing further to do
-    return;
+    return false;
   }
 
   // recurse
   for (size_t i = 0; i < cnodes.size(); i++) {
     path_comps.push(cnodes[i]);
-    CfgNode *cn = new CfgNode(cstore, path_comps, active, recursive);
+    CfgNode *cn = new (_arena) CfgNode(cstore, path_comps, active, recursive,
+                                       _arena);
     addChildNode(cn);
     path_comps.pop();
   }
+  return false;
 }
 
+// for subtree read by cfgPathGetSubtreeDA() (same as above)
+CfgNode::CfgNode(Cstore& cstore, Cpath& path_comps, const CfgRawNode& raw,
+                 TmplReaders *readers, CfgArena *arena)
+  : TreeNode<CfgNode>(),
+    _is_tag(false), _is_leaf(false), _is_multi(false), _is_value(false),
+    _is_default(false), _is_deactivated(false), _is_leaf_typeless(false),
+    _is_invalid(false), _exists(true), _name(Intern::empty()),
+    _value(Intern::empty()), _arena(arena), _child_index_gen(0)
+{
+  if (init_raw_node(cstore, path_comps, raw)) {
+    add_raw_child_nodes(cstore, path_comps, raw, readers);
+  }
+}
+
+// for a single node read by cfgPathGetNodeDA() (no child nodes)
+CfgNode::CfgNode(Cstore& cstore, Cpath& path_comps, const CfgRawNode& raw)
+  : TreeNode<CfgNode>(),
+    _is_tag(false), _is_leaf(false), _is_multi(false), _is_value(false),
+    _is_default(false), _is_deactivated(false), _is_leaf_typeless(false),
+    _is_invalid(false), _exists(true), _name(Intern::empty()),
+    _value(Intern::empty()), _arena(NULL), _child_index_gen(0)
+{
+  if (init_raw_node(cstore, path_comps, raw) && raw.children.size() == 0) {
+    // same as add_raw_child_nodes()
+    vector<string> tcnodes;
+    cstore.tmplGetChildNodes(path_comps, tcnodes);
+    if (tcnodes.size() == 0) {
+      // typeless leaf node
+      _is_leaf_typeless = true;
+    }
+  }
+}
+
+/* set up this node from "raw". return true if this is a non-leaf node, in
+ * which case the caller needs to handle the child nodes.
+ */
+bool
+CfgNode::init_raw_node(Cstore& cstore, Cpath& path_comps,
+                       const CfgRawNode& raw)
+{
+  setTmpl(cstore.parseTmpl(path_comps, false));
+  if (!getTmpl().get()) {
+    // not a valid node
+    _is_invalid = true;
+    return false;
+  }
+  if (raw.deactivated) {
+    /* cfgPathExists() doesn't include deactivated nodes. note that an
+     * ancestor cannot be deactivated since then we wouldn't get here.
+     */
+    _exists = false;
+    return false;
+  }
+
+  _is_value = getTmpl()->isValue();
+  _is_tag = getTmpl()->isTag();
+  _is_leaf = (!_is_tag && !getTmpl()->isTypeless());
+  _is_multi = getTmpl()->isMulti();
+  _is_default = raw.is_default;
+  if (raw.has_comment) {
+    _comment = raw.comment;
+  }
+
+  if (_is_leaf && _is_value) {
+    // "leaf value" so recursion should never reach here
+    return false;
+  }
+
+  if (_is_leaf) {
+    _name = path_comps.interned(path_comps.size() - 1);
+    if (raw.has_value) {
+      if (_is_multi) {
+        _values = raw.values;
+      } else if (raw.values.size() >= 1) {
+        _value = Intern::get(raw.values[0]);
+      }
+    }
+    return false;
+  }
+
+  if (_is_value) {
+    // tag value
+    _name = path_comps.interned(path_comps.size() - 2);
+    _value = path_comps.interned(path_comps.size() - 1);
+  } else {
+    // tag node or typeless node
+    _name = path_comps.interned(path_comps.size() - 1);
+  }
+  return true;
+}
+
+/* construct the active and working config trees (see the constructor
+ * above). the configs are read one after the other, and then the two
+ * trees are built at the same time.
+ */
+void
+CfgNode::buildActiveWorking(Cstore& cstore, Cpath& path_comps,
+                            tr1::shared_ptr<CfgNode>& aroot,
+                            tr1::shared_ptr<CfgNode>& wroot,
+                            CfgArena *arena)
+{
+  aroot.reset(new CfgNode(arena));
+  wroot.reset(new CfgNode(arena));
+  CfgRawNode araw, wraw;
+  bool abuild = aroot->init_node(cstore, path_comps, true, true, araw);
+  bool wbuild = wroot->init_node(cstore, path_comps, false, true, wraw);
+  WorkPool *pool = WorkPool::get();
+  if (!pool || !abuild || !wbuild) {
+    if (abuild) {
+      aroot->add_raw_child_nodes(cstore, path_comps, araw, NULL);
+    }
+    if (wbuild) {
+      wroot->add_raw_child_nodes(cstore, path_comps, wraw, NULL);
+    }
+    return;
+  }
+
+  // build the working tree in the pool with its own template reader
+  #if __GNUC__ < 6
+  auto_ptr<Cstore> wcs(cstore.createTmplReader());
+  #else
+  unique_ptr<Cstore> wcs(cstore.createTmplReader());
+  #endif
+  BuildRootTask wtask(wroot.get(), *wcs, path_comps, wraw);
+  WorkPool::Group g(pool);
+  g.add(&wtask);
+  aroot->add_raw_child_nodes(cstore, path_comps, araw, NULL);
+  g.wait();
+}
+
+/* construct the parts of the active and working config trees that may
+ * differ (see the header). every operation that modifies the working config
+ * marks the modified node and its ancestors "changed", and a deleted node
+ * is covered by the marker of its parent. so a subtree that is in both
+ * configs and not marked is the same in both and can be skipped. if the
+ * session has no marker at all, build the whole trees as above.
+ */
+void
+CfgNode::buildChangedActiveWorking(Cstore& cstore, Cpath& path_comps,
+                                   tr1::shared_ptr<CfgNode>& aroot,
+                                   tr1::shared_ptr<CfgNode>& wroot,
+                                   CfgArena *arena)
+{
+  if (!cstore.sessionChanged()) {
+    buildActiveWorking(cstore, path_comps, aroot, wroot, arena);
+    return;
+  }
+
+  aroot.reset(new CfgNode(arena));
+  wroot.reset(new CfgNode(arena));
+  CfgRawNode raw;
+  aroot->init_node(cstore, path_comps, true, false, raw);
+  wroot->init_node(cstore, path_comps, false, false, raw);
+  if (aroot->exists() && wroot->exists() && !aroot->isLeaf()
+      && !aroot->isInvalid()) {
+    add_changed_child_nodes(cstore, path_comps, aroot.get(), wroot.get());
+  }
+}
+
+void *
+CfgNode::operator new(size_t size, CfgArena *arena)
+{
+  return (arena ? arena->allocNode() : ::operator new(size));
+}
+
+// only used if the constructor fails
+void
+CfgNode::operator delete(void *p, CfgArena *arena)
+{
+  if (arena) {
+    arena->releaseNode(p);
+  } else {
+    ::operator delete(p);
+  }
+}
+
+CfgNode *
+CfgNode::findChildNode(const string *key) const
+{
+  const vector<CfgNode *>& cnodes = getChildNodes();
+  if (cnodes.size() < C_CHILD_INDEX_MIN) {
+    for (size_t i = 0; i < cnodes.size(); i++) {
+      if (cnodes[i]->getInternedKey() == key) {
+        return cnodes[i];
+      }
+    }
+    return NULL;
+  }
+
+  if (!_child_index.get() || _child_index_gen != childNodesGen()) {
+    _child_index.reset(new ChildIndexT());
+    _child_index->rehash(cnodes.size());
+    // first one wins as in the linear search above
+    for (size_t i = cnodes.size(); i > 0; i--) {
+      (*_child_index)[cnodes[i - 1]->getInternedKey()] = cnodes[i - 1];
+    }
+    _child_index_gen = childNodesGen();
+  }
+  ChildIndexT::const_iterator it = _child_index->find(key);
+  return (it != _child_index->end() ? it->second : NULL);
+}
+
+////// private functions
+/* add the child nodes in "raw". the children of a large node (e.g., a tag
+ * node with many values) are built by the WorkPool threads, each using its
+ * own template reader from "readers" (created here if necessary).
+ */
+void
+CfgNode::add_raw_child_nodes(Cstore& cstore, Cpath& path_comps,
+                             const CfgRawNode& raw, TmplReaders *readers)
+{
+  if (raw.children.size() == 0) {
+    // empty subtree. done.
+    vector<string> tcnodes;
+    cstore.tmplGetChildNodes(path_comps, tcnodes);
+    if (tcnodes.size() == 0) {
+      // typeless leaf node
+      _is_leaf_typeless = true;
+    }
+    return;
+  }
+
+  // same order as cfgPathGetChildNodesDA()
+  vector<string> names;
+  MapT<string, const CfgRawNode *> cmap;
+  for (size_t i = 0; i < raw.children.size(); i++) {
+    names.push_back(raw.children[i].name);
+    cmap[raw.children[i].name] = &(raw.children[i]);
+  }
+  Cstore::sortNodes(names);
+  vector<const CfgRawNode *> craw;
+  for (size_t i = 0; i < names.size(); i++) {
+    craw.push_back(cmap[names[i]]);
+  }
+
+  size_t chunk;
+  WorkPool *pool = WorkPool::getForSplit(craw.size(), chunk);
+  if (!pool) {
+    for (size_t i = 0; i < craw.size(); i++) {
+      path_comps.push(craw[i]->name);
+      CfgNode *cn = new (_arena) CfgNode(cstore, path_comps, *(craw[i]),
+                                         readers, _arena);
+      addChildNode(cn);
+      path_comps.pop();
+    }
+    return;
+  }
+
+  #if __GNUC__ < 6
+  auto_ptr<TmplReaders> rdrs;
+  #else
+  unique_ptr<TmplReaders> rdrs;
+  #endif
+  if (!readers) {
+    rdrs.reset(new TmplReaders(cstore, pool));
+    readers = rdrs.get();
+  }
+  vector<CfgNode *> cnodes(craw.size(), NULL);
+  vector<BuildTask *> tasks;
+  {
+    WorkPool::Group g(pool);
+    for (size_t i = 0; i < craw.size(); i += chunk) {
+      size_t end = ((i + chunk) < craw.size() ? (i + chunk) : craw.size());
+      tasks.push_back(new BuildTask(path_comps, craw, cnodes, i, end,
+                                    readers, _arena));
+      g.add(tasks.back());
+    }
+    g.wait();
+  }
+  for (size_t i = 0; i < tasks.size(); i++) {
+    delete tasks[i];
+  }
+  for (size_t i = 0; i < cnodes.size(); i++) {
+    addChildNode(cnodes[i]);
+  }
+}
+
+/* add the child nodes of "anode" and "wnode" (both at "path_comps") that
+ * may differ (see buildChangedActiveWorking()). a child that is only in one
+ * of the configs (added or deleted) is built with its whole subtree, and a
+ * child that is in both is only followed if it is marked changed.
+ */
+void
+CfgNode::add_changed_child_nodes(Cstore& cstore, Cpath& path_comps,
+                                 CfgNode *anode, CfgNode *wnode)
+{
+  vector<string> acnodes, wcnodes;
+  cstore.cfgPathGetChildNodesDA(path_comps, acnodes, true, true);
+  cstore.cfgPathGetChildNodesDA(path_comps, wcnodes, false, true);
+  MapT<string, bool> amap, wmap;
+  for (size_t i = 0; i < acnodes.size(); i++) {
+    amap[acnodes[i]] = true;
+  }
+  for (size_t i = 0; i < wcnodes.size(); i++) {
+    wmap[wcnodes[i]] = true;
+  }
+
+  CfgArena *arena = anode->_arena;
+  for (size_t i = 0; i < acnodes.size(); i++) {
+    if (wmap.find(acnodes[i]) != wmap.end()) {
+      continue;
+    }
+    // deleted
+    path_comps.push(acnodes[i]);
+    anode->addChildNode(new (arena) CfgNode(cstore, path_comps, true, true,
+                                            arena));
+    path_comps.pop();
+  }
+  for (size_t i = 0; i < wcnodes.size(); i++) {
+    path_comps.push(wcnodes[i]);
+    if (amap.find(wcnodes[i]) == amap.end()) {
+      // added
+      wnode->addChildNode(new (arena) CfgNode(cstore, path_comps, false, true,
+                                              arena));
+    } else if (cstore.cfgPathChanged(path_comps)) {
+      if (!cstore.cfgPathExists(path_comps, true)
+          || !cstore.cfgPathExists(path_comps, false)) {
+        /* deactivated in (at least) one of the configs, in which case the
+         * other one is treated as added/deleted by the comparison. so
+         * build both subtrees as a whole.
+         */
+        anode->addChildNode(new (arena) CfgNode(cstore, path_comps, true,
+                                                true, arena));
+        wnode->addChildNode(new (arena) CfgNode(cstore, path_comps, false,
+                                                true, arena));
+      } else {
+        CfgNode *acn = new (arena) CfgNode(arena);
+        CfgNode *wcn = new (arena) CfgNode(arena);
+        CfgRawNode raw;
+        acn->init_node(cstore, path_comps, true, false, raw);
+        wcn->init_node(cstore, path_comps, false, false, raw);
+        anode->addChildNode(acn);
+        wnode->addChildNode(wcn);
+        if (!acn->isLeaf() && !acn->isInvalid()) {
+          add_changed_child_nodes(cstore, path_comps, acn, wcn);
+        }
+      }
+    }
+    path_comps.pop();
+  }
+}
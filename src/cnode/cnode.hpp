@@ -19,23 +19,66 @@
 #include <cstdio>
 #include <vector>
 #include <string>
+#include <tr1/memory>
 
 #include <cstore/cstore.hpp>
 #include <cnode/cnode-util.hpp>
+#include <cnode/cnode-arena.hpp>
 #include <commit/commit-algorithm.hpp>
 
 namespace cnode {
 
+/* if a node is constructed with an "arena", its descendants are allocated
+ * in the arena (see CfgArena). the node itself is allocated by the caller
+ * as usual. names and values are interned (see cstore::Intern).
+ */
 class CfgNode : public TreeNode<CfgNode>, public commit::CommitData {
 public:
   // constructor for parser
   CfgNode(cstore::Cpath& path_comps, char *name, char *val, char *comment,
-          int deact, cstore::Cstore *cstore, bool tag_if_invalid = false);
+          int deact, cstore::Cstore *cstore, bool tag_if_invalid = false,
+          CfgArena *arena = NULL);
   // constructor for active/working config
   CfgNode(cstore::Cstore& cstore, cstore::Cpath& path_comps,
-          bool active = false, bool recursive = true);
+          bool active = false, bool recursive = true,
+          CfgArena *arena = NULL);
+  // constructor for a single node (see Cstore::cfgPathGetNodeDA())
+  CfgNode(cstore::Cstore& cstore, cstore::Cpath& path_comps,
+          const cstore::CfgRawNode& raw);
+
+  ~CfgNode() {
+    if (_arena) {
+      // child nodes are owned by the arena
+      clearChildNodes();
+    }
+  };
+
+  // allocate in "arena" (or as usual if NULL)
+  static void *operator new(size_t size) { return ::operator new(size); };
+  static void *operator new(size_t size, CfgArena *arena);
+  static void operator delete(void *p) { ::operator delete(p); };
+  static void operator delete(void *p, CfgArena *arena);
 
-  ~CfgNode() {};
+  /* construct both the active and working config trees at the same time
+   * (same as the constructor above with active and working config).
+   */
+  static void buildActiveWorking(cstore::Cstore& cstore,
+                                 cstore::Cpath& path_comps,
+                                 std::tr1::shared_ptr<CfgNode>& aroot,
+                                 std::tr1::shared_ptr<CfgNode>& wroot,
+                                 CfgArena *arena = NULL);
+  /* same as above but only build the parts of the two trees that may
+   * differ, i.e., the subtrees marked "changed" in the session (see
+   * Cstore::cfgPathChanged()) and the added/deleted subtrees under them.
+   * the rest of the trees is omitted from both, so this is for the
+   * comparison of the two (e.g., commit) and not for anything that needs
+   * the whole config.
+   */
+  static void buildChangedActiveWorking(cstore::Cstore& cstore,
+                                        cstore::Cpath& path_comps,
+                                        std::tr1::shared_ptr<CfgNode>& aroot,
+                                        std::tr1::shared_ptr<CfgNode>& wroot,
+                                        CfgArena *arena = NULL);
 
   bool isTag() const { return _is_tag; }
   bool isTagNode() const { return (_is_tag && !_is_value); }
@@ -49,13 +92,26 @@ public:
   bool isEmpty() const { return (!_is_leaf && numChildNodes() == 0); }
   bool exists() const { return _exists; }
 
-  const std::string& getName() const { return _name; }
-  const std::string& getValue() const { return _value; }
+  const std::string& getName() const { return *_name; }
+  const std::string& getValue() const { return *_value; }
   const std::vector<std::string>& getValues() const { return _values; }
   const std::string& getComment() const { return _comment; }
+  // interned name/value, i.e., can be compared/hashed as pointers
+  const std::string *getInternedName() const { return _name; }
+  const std::string *getInternedValue() const { return _value; }
+  // key among the siblings, i.e., value for "tag value" and name otherwise
+  const std::string *getInternedKey() const {
+    return (_is_value ? _value : _name);
+  }
+
+  /* return the child node with the specified (interned) key, or NULL if
+   * not found. an index is built on first use if there are many child
+   * nodes, so this is not thread-safe.
+   */
+  CfgNode *findChildNode(const std::string *key) const;
 
   void addMultiValue(char *val) { _values.push_back(val); }
-  void setValue(char *val) { _value = val; }
+  void setValue(char *val) { _value = cstore::Intern::get(val); }
 
   // XXX testing
   void rprint(size_t lvl) {
@@ -79,10 +135,38 @@ private:
   bool _is_leaf_typeless;
   bool _is_invalid;
   bool _exists;
-  std::string _name;
-  std::string _value;
+  const std::string *_name;
+  const std::string *_value;
   std::vector<std::string> _values;
   std::string _comment;
+  CfgArena *_arena;
+
+  // child node index (see findChildNode())
+  static const size_t C_CHILD_INDEX_MIN = 16;
+  typedef cstore::MapT<const std::string *, CfgNode *,
+                       cstore::Intern::Hash> ChildIndexT;
+  // shared by copies (see commit) until the child nodes change
+  mutable std::tr1::shared_ptr<ChildIndexT> _child_index;
+  mutable size_t _child_index_gen;
+
+  // for subtree read in a single pass and built in parallel
+  class TmplReaders;
+  class BuildTask;
+  class BuildRootTask;
+  CfgNode(CfgArena *arena);
+  CfgNode(cstore::Cstore& cstore, cstore::Cpath& path_comps,
+          const cstore::CfgRawNode& raw, TmplReaders *readers,
+          CfgArena *arena);
+  bool init_node(cstore::Cstore& cstore, cstore::Cpath& path_comps,
+                 bool active, bool recursive, cstore::CfgRawNode& raw);
+  bool init_raw_node(cstore::Cstore& cstore, cstore::Cpath& path_comps,
+                     const cstore::CfgRawNode& raw);
+  void add_raw_child_nodes(cstore::Cstore& cstore, cstore::Cpath& path_comps,
+                           const cstore::CfgRawNode& raw,
+                           TmplReaders *readers);
+  static void add_changed_child_nodes(cstore::Cstore& cstore,
+                                      cstore::Cpath& path_comps,
+                                      CfgNode *anode, CfgNode *wnode);
 };
 
 } // namespace cnode
@@ -15,14 +15,20 @@
  */
 
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <chrono>
 
 #include <cli_cstore.h>
 #include <commit/commit-algorithm.hpp>
+#include <commit/commit-profile.hpp>
 #include <cnode/cnode-algorithm.hpp>
 
 using namespace commit;
@@ -67,6 +73,12 @@ static const char *commit_hook_dirs[3] = {
   NULL
 };
 
+// for profiling (same order as vtw_act_type)
+static const char *commit_act_names[top_act] = {
+  "delete", "create", "activate", "update", "syntax", "commit",
+  "begin", "end"
+};
+
 static void
 _set_node_commit_state(CfgNode& node, CommitState s, bool recursive)
 {
@@ -314,12 +326,21 @@ _exec_tmpl_actions(Cstore& cs, CommitState s, char *at_str,
   }
 
   TRACE_INIT("Executing the \"%s\" ...", disp_path.to_string().c_str());
+  CommitProfile::Event ev("action", disp_path.to_string());
+  unsigned long long obytes = action_output_bytes;
+  last_action_status = 0;
   setenv("COMMIT_ACTION", aenv, 1);
   set_in_delete_action((act == delete_act));
   bool ret = cs.executeTmplActions(at_str, path, disp_path, actions, def);
   set_in_delete_action(false);
   unsetenv("COMMIT_ACTION");
   TRACE_DISPLAY("");
+  ev.addArg("action", commit_act_names[act]);
+  ev.addArg("commit_action", aenv);
+  ev.addArg("priority", node.getPriority());
+  ev.addArg("exit", last_action_status);
+  ev.addArg("output_bytes", action_output_bytes - obytes);
+  ev.addArg("ok", ret);
 
   return ret;
 }
@@ -702,6 +723,8 @@ _commit_exec_prio_subtree(Cstore& cs, PrioNode *proot)
   CfgNode *cfg = proot->getCfgNode();
   CommittedPathListT clist;
   bool ret = false;
+  CommitProfile::Event ev("subtree", proot->getCommitPath().to_string());
+  ev.addArg("priority", proot->getPriority());
   if (cfg) {
     if (proot->getCommitState() == COMMIT_STATE_ADDED
         && proot->parentCreateFailed()) {
@@ -739,10 +762,12 @@ _commit_exec_prio_subtree(Cstore& cs, PrioNode *proot)
     }
   }
   proot->setSucceeded(true);
+  ev.addArg("ok", 1);
   return true;
 
 commit_failed:
   proot->setSucceeded(false);
+  ev.addArg("ok", 0);
   return false;
 }
 
@@ -854,6 +879,488 @@ _execute_hooks(CommitHook hook)
   redirect_output();
 }
 
+/* report the result of a prio subtree and update the counts
+ * (succeeded/failed).
+ */
+static void
+_commit_report_prio_subtree(PrioNode *p, bool ok, bool for_delete,
+                            size_t& s, size_t& f)
+{
+  if (ok) {
+    ++s;
+    return;
+  }
+  if (for_delete) {
+    OUTPUT_USER("delete [ %s ] failed\n",
+                p->getCommitPath().to_string().c_str());
+  } else {
+    OUTPUT_USER("[[%s]] failed\n", p->getCommitPath().to_string().c_str());
+  }
+  ++f;
+}
+
+static void
+_commit_exec_and_report(Cstore& cs, PrioNode *p, bool for_delete,
+                        size_t& s, size_t& f)
+{
+  _commit_report_prio_subtree(p, _commit_exec_prio_subtree(cs, p),
+                              for_delete, s, f);
+}
+
+
+////// parallel commit
+/* opt-in: if VYOS_COMMIT_JOBS is greater than 1, prio subtrees with the
+ * same priority are executed concurrently by up to that many worker
+ * processes. the priority levels are still processed strictly in order.
+ *
+ * each worker is a forked process, so it has its own copy of the cstore
+ * (paths etc.) and of all the global state used by template actions. the
+ * user output of each worker is buffered and then output in a
+ * deterministic order (by commit path) after the whole level is done.
+ */
+static size_t
+_get_commit_jobs()
+{
+  const char *s = getenv("VYOS_COMMIT_JOBS");
+  long n = (s ? strtol(s, NULL, 10) : 0);
+  return (n > 1 ? (size_t) n : 1);
+}
+
+struct CommitJob {
+  CommitJob(PrioNode *p)
+    : node(p), pid(-1), out(NULL), err(NULL), ok(false) {};
+  PrioNode *node;
+  pid_t pid;
+  FILE *out;
+  FILE *err;
+  bool ok;
+};
+
+static bool
+_commit_job_cmp(const CommitJob& a, const CommitJob& b)
+{
+  return (a.node->getCommitPath().to_string()
+          < b.node->getCommitPath().to_string());
+}
+
+static void
+_commit_flush_output()
+{
+  fflush(stdout);
+  fflush(stderr);
+  if (out_stream) {
+    fflush(out_stream);
+  }
+  if (err_stream) {
+    fflush(err_stream);
+  }
+}
+
+// copy buffered output to stream
+static void
+_commit_copy_output(FILE *buf, FILE *stream)
+{
+  if (!buf) {
+    return;
+  }
+  if (stream) {
+    char data[4096];
+    size_t n;
+    rewind(buf);
+    while ((n = fread(data, 1, sizeof(data), buf)) > 0) {
+      fwrite(data, 1, n, stream);
+    }
+  }
+  fclose(buf);
+}
+
+// start a worker for the job. return false if failed.
+static bool
+_commit_start_job(Cstore& cs, CommitJob& job)
+{
+  job.out = tmpfile();
+  job.err = tmpfile();
+  if (!job.out || !job.err) {
+    return false;
+  }
+  _commit_flush_output();
+  job.pid = fork();
+  if (job.pid < 0) {
+    return false;
+  }
+  if (job.pid == 0) {
+    // worker
+    if (out_stream) {
+      dup2(fileno(job.out), fileno(out_stream));
+    }
+    if (err_stream) {
+      dup2(fileno(job.err), fileno(err_stream));
+    }
+    bool ok = _commit_exec_prio_subtree(cs, job.node);
+    _commit_flush_output();
+    _exit(ok ? 0 : 1);
+  }
+  return true;
+}
+
+// whether any node in the batch is an ancestor of another one
+static bool
+_commit_batch_dependent(const vector<PrioNode *>& batch)
+{
+  for (size_t i = 0; i < batch.size(); i++) {
+    for (PrioNode *p = batch[i]->getParent(); p; p = p->getParent()) {
+      if (find(batch.begin(), batch.end(), p) != batch.end()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/* execute a batch of independent prio subtrees, i.e., with the same
+ * priority or in the same dependency "wave" (see below).
+ *   remaining: number of prio subtrees remaining in the queue including
+ *              the batch (for "last in queue" marking).
+ */
+static void
+_commit_exec_prio_batch(Cstore& cs, vector<PrioNode *>& batch, size_t jobs,
+                        bool for_delete, size_t remaining,
+                        size_t& s, size_t& f)
+{
+  PrioNode *last = NULL;
+  if (remaining == batch.size()) {
+    // run the "last in queue" separately after everything else
+    last = batch.back();
+    batch.pop_back();
+  }
+
+  if (jobs < 2 || batch.size() < 2 || _commit_batch_dependent(batch)) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      set_if_last(remaining - i);
+      _commit_exec_and_report(cs, batch[i], for_delete, s, f);
+    }
+  } else {
+    vector<CommitJob> jvec;
+    for (size_t i = 0; i < batch.size(); i++) {
+      jvec.push_back(CommitJob(batch[i]));
+    }
+    sort(jvec.begin(), jvec.end(), _commit_job_cmp);
+
+    size_t next = 0, running = 0;
+    while (next < jvec.size() || running > 0) {
+      while (running < jobs && next < jvec.size()) {
+        CommitJob& j = jvec[next++];
+        if (_commit_start_job(cs, j)) {
+          running++;
+          continue;
+        }
+        // failed to start worker => just do it here
+        _commit_copy_output(j.out, NULL);
+        _commit_copy_output(j.err, NULL);
+        j.out = NULL;
+        j.err = NULL;
+        j.pid = -1;
+        j.ok = _commit_exec_prio_subtree(cs, j.node);
+      }
+      if (running == 0) {
+        continue;
+      }
+      int status;
+      pid_t pid = wait(&status);
+      if (pid < 0) {
+        // no more children (should not happen)
+        break;
+      }
+      for (size_t i = 0; i < jvec.size(); i++) {
+        if (jvec[i].pid == pid) {
+          jvec[i].ok = (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+          jvec[i].pid = -1;
+          running--;
+          break;
+        }
+      }
+    }
+
+    // the result in the worker is not visible here, so set it again
+    for (size_t i = 0; i < jvec.size(); i++) {
+      CommitJob& j = jvec[i];
+      j.node->setSucceeded(j.ok);
+      _commit_copy_output(j.out, out_stream);
+      _commit_copy_output(j.err, err_stream);
+      _commit_report_prio_subtree(j.node, j.ok, for_delete, s, f);
+    }
+  }
+
+  if (last) {
+    set_if_last(1);
+    _commit_exec_and_report(cs, last, for_delete, s, f);
+  }
+}
+
+// get all prio subtrees with the same (i.e., the next) priority
+template<class Q> static void
+_get_commit_prio_batch(Q& q, vector<PrioNode *>& batch)
+{
+  unsigned int prio = q.top()->getPriority();
+  while (!q.empty() && q.top()->getPriority() == prio) {
+    batch.push_back(q.top());
+    q.pop();
+  }
+}
+
+
+////// dependency-based scheduling
+/* a template can declare "depends:" config paths, in which case the prio
+ * subtrees are scheduled by a dependency graph instead of strictly by
+ * priority:
+ *   - a prio subtree that declares dependencies only waits for the prio
+ *     subtrees matching its declared paths and for its ancestors in the
+ *     prio tree (i.e., the hierarchical constraint still applies).
+ *   - any other prio subtree waits for all prio subtrees with lower
+ *     priority, same as before.
+ * for delete, all the edges are reversed. the graph is then executed in
+ * topological "waves", i.e., each wave contains all the prio subtrees
+ * whose dependencies have been satisfied by the previous waves.
+ *
+ * to keep the graph linear in size, the priority constraint goes through a
+ * chain of "barriers" (one per priority after the first) instead of edges
+ * between all pairs: the barrier of a priority waits for the previous
+ * barrier and for all prio subtrees with the previous priority.
+ *
+ * a declared path is a prefix of the commit path, and "node.tag" matches
+ * any tag value. if nothing declares dependencies, or if the graph has a
+ * cycle, the normal priority ordering is used.
+ */
+static void
+_get_commit_deps(PrioNode *p, vector<vector<string> >& deps)
+{
+  const char *str = p->getDepends();
+  if (!str) {
+    return;
+  }
+  vector<string> dep;
+  string comp;
+  for (const char *c = str; ; c++) {
+    if (*c && *c != '\n' && *c != ' ' && *c != '\t') {
+      comp += *c;
+      continue;
+    }
+    if (comp.length() > 0) {
+      dep.push_back(comp);
+      comp.clear();
+    }
+    if (!*c || *c == '\n') {
+      if (dep.size() > 0) {
+        deps.push_back(dep);
+        dep.clear();
+      }
+      if (!*c) {
+        break;
+      }
+    }
+  }
+}
+
+// whether the declared path matches (i.e., is a prefix of) the commit path
+static bool
+_commit_dep_matches(const vector<string>& dep, const Cpath& path)
+{
+  if (dep.size() > path.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < dep.size(); i++) {
+    if (dep[i] != "node.tag" && dep[i] != path[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// whether p is a prefix of (or the same as) path
+static bool
+_commit_path_within(const Cpath& path, const Cpath& p)
+{
+  if (p.size() > path.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < p.size(); i++) {
+    if (strcmp(p[i], path[i]) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// order within a wave: same as the priority queue, then by commit path
+struct CommitWaveCmp {
+  CommitWaveCmp(bool for_delete) : _for_delete(for_delete) {};
+  bool operator()(PrioNode *a, PrioNode *b) const {
+    if (a->getPriority() != b->getPriority()) {
+      return (_for_delete ? (a->getPriority() > b->getPriority())
+                          : (a->getPriority() < b->getPriority()));
+    }
+    return (a->getCommitPath().to_string() < b->getCommitPath().to_string());
+  };
+  bool _for_delete;
+};
+
+/* get the dependency "waves" for the prio subtrees in the queue. return
+ * false if the normal priority ordering should be used instead.
+ */
+template<class Q> static bool
+_get_commit_waves(const Q& q, bool for_delete,
+                  vector<vector<PrioNode *> >& waves)
+{
+  Q tq(q);
+  vector<PrioNode *> nodes;
+  vector<vector<vector<string> > > deps;
+  bool declared = false;
+  while (!tq.empty()) {
+    nodes.push_back(tq.top());
+    tq.pop();
+    deps.push_back(vector<vector<string> >());
+    _get_commit_deps(nodes.back(), deps.back());
+    declared = (declared || deps.back().size() > 0);
+  }
+  if (!declared) {
+    return false;
+  }
+
+  size_t n = nodes.size();
+  vector<Cpath> paths(n);
+  MapT<PrioNode *, size_t> idx;
+  // level[i]: index of the priority of i (nodes are in queue order)
+  vector<size_t> level(n, 0);
+  for (size_t i = 0; i < n; i++) {
+    paths[i] = nodes[i]->getCommitPath();
+    idx[nodes[i]] = i;
+    if (i > 0) {
+      level[i] = (level[i - 1]
+                  + (nodes[i]->getPriority() != nodes[i - 1]->getPriority()
+                     ? 1 : 0));
+    }
+  }
+  // barrier of level l (l >= 1) is "n + l - 1"
+  size_t nb = (n > 0 ? level[n - 1] : 0);
+
+  /* succs[i]: prio subtrees (or barriers) that must wait for i. the
+   * barriers are set up first.
+   */
+  vector<vector<size_t> > succs(n + nb);
+  vector<size_t> npreds(n + nb, 0);
+  for (size_t i = 0; i < n; i++) {
+    if (level[i] < nb) {
+      succs[i].push_back(n + level[i]);
+      ++npreds[n + level[i]];
+    }
+  }
+  for (size_t l = 1; l < nb; l++) {
+    succs[n + l - 1].push_back(n + l);
+    ++npreds[n + l];
+  }
+  for (size_t i = 0; i < n; i++) {
+    vector<size_t> preds;
+    // prio tree: ancestors first, or descendants first for delete
+    for (PrioNode *p = nodes[i]->getParent(); p; p = p->getParent()) {
+      MapT<PrioNode *, size_t>::iterator it = idx.find(p);
+      if (it == idx.end()) {
+        continue;
+      }
+      if (for_delete) {
+        succs[i].push_back(it->second);
+        ++npreds[it->second];
+      } else {
+        preds.push_back(it->second);
+      }
+    }
+    if (deps[i].size() == 0) {
+      // priority: wait for the barrier of its priority
+      if (level[i] > 0) {
+        preds.push_back(n + level[i] - 1);
+      }
+    } else {
+      // declared: the reverse for delete
+      for (size_t j = 0; j < n; j++) {
+        if (j == i || _commit_path_within(paths[j], paths[i])) {
+          // self or descendant
+          continue;
+        }
+        for (size_t k = 0; k < deps[i].size(); k++) {
+          if (!_commit_dep_matches(deps[i][k], paths[j])) {
+            continue;
+          }
+          if (for_delete) {
+            succs[i].push_back(j);
+            ++npreds[j];
+          } else {
+            preds.push_back(j);
+          }
+          break;
+        }
+      }
+    }
+    for (size_t j = 0; j < preds.size(); j++) {
+      succs[preds[j]].push_back(i);
+      ++npreds[i];
+    }
+  }
+
+  vector<PrioNode *> wave;
+  vector<size_t> ready;
+  for (size_t i = 0; i < n; i++) {
+    if (npreds[i] == 0) {
+      ready.push_back(i);
+    }
+  }
+  size_t done = 0;
+  while (ready.size() > 0) {
+    vector<size_t> next;
+    wave.clear();
+    for (size_t i = 0; i < ready.size(); i++) {
+      wave.push_back(nodes[ready[i]]);
+      // a barrier is passed as soon as it is ready
+      vector<size_t> todo(1, ready[i]);
+      while (todo.size() > 0) {
+        size_t r = todo.back();
+        todo.pop_back();
+        ++done;
+        for (size_t j = 0; j < succs[r].size(); j++) {
+          size_t x = succs[r][j];
+          if (--npreds[x] == 0) {
+            if (x >= n) {
+              todo.push_back(x);
+            } else {
+              next.push_back(x);
+            }
+          }
+        }
+      }
+    }
+    sort(wave.begin(), wave.end(), CommitWaveCmp(for_delete));
+    waves.push_back(wave);
+    ready = next;
+  }
+  if (done != n + nb) {
+    OUTPUT_USER("Warning: commit dependency cycle detected\n"
+                "         using priority ordering instead\n");
+    waves.clear();
+    return false;
+  }
+  return true;
+}
+
+static void
+_commit_exec_waves(Cstore& cs, vector<vector<PrioNode *> >& waves,
+                   size_t jobs, bool for_delete, size_t remaining,
+                   size_t& s, size_t& f)
+{
+  for (size_t i = 0; i < waves.size(); i++) {
+    size_t num = waves[i].size();
+    _commit_exec_prio_batch(cs, waves[i], jobs, for_delete, remaining, s, f);
+    remaining -= num;
+  }
+}
+
 
 ////// class CommitData
 CommitData::CommitData()
@@ -1002,6 +1509,12 @@ CommitData::getPriority() const
   return (_def.get() ? _def->getPriority() : 0);
 }
 
+const char *
+CommitData::getDepends() const
+{
+  return (_def.get() ? _def->getDepends() : NULL);
+}
+
 void
 CommitData::setPriority(unsigned int p)
 {
@@ -1049,6 +1562,12 @@ PrioNode::getPriority() const
   return (_node ? _node->getPriority() : 0);
 }
 
+const char *
+PrioNode::getDepends() const
+{
+  return (_node ? _node->getDepends() : NULL);
+}
+
 CommitState
 PrioNode::getCommitState() const
 {
@@ -1250,8 +1769,8 @@ commit::isCommitPathEffective(Cstore& cs, const Cpath& pcomps,
   return (in_active ? !marked : marked);
 }
 
-bool
-commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
+static bool
+_do_commit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
 {
   /* get the lock first.
    * note: the getCommitLock() interface provided by Cstore guarantees
@@ -1259,14 +1778,18 @@ commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
    * normally or abnormally), so this is all that is required in terms
    * of commit locking.
    */
+  CommitProfile::Event ev_lock("phase", "lock");
   if (!cs.getCommitLock()) {
     OUTPUT_USER("Configuration system temporarily locked "
                 "due to another commit in progress\n");
     return false;
   }
+  ev_lock.end();
 
   Cpath p;
+  CommitProfile::Event ev_diff("phase", "diff");
   CfgNode *root = getCommitTree(&cfg1, &cfg2, p);
+  ev_diff.end();
   if (!root) {
     /* "session changed" check has already been performed before commit
      * execution, so no need to repeat it here.
@@ -1286,6 +1809,7 @@ commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
     #endif
     PrioNode pn(cn.get());
     pn.setSucceeded(true);
+    CommitProfile::Event ev_cfg("phase", "commit_config");
     if (!cs.commitConfig(pn)) {
       OUTPUT_USER("Failed to generate committed config\n");
       return false;
@@ -1293,15 +1817,20 @@ commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
     return true;
   }
 
+  CommitProfile::Event ev_pre("phase", "pre_hooks");
   _execute_hooks(PRE_COMMIT);
+  ev_pre.end();
   set_in_commit(true);
 
+  CommitProfile::Event ev_prio("phase", "prio_queue");
   PrioNode proot(root); // proot corresponds to root
   _get_commit_prio_subtrees(root, proot);
   // at this point all prio nodes have been detached from root
   PrioQueueT pq;
   DelPrioQueueT dpq;
   _get_commit_prio_queue(&proot, pq, dpq);
+  ev_prio.addArg("subtrees", pq.size() + dpq.size());
+  ev_prio.end();
   size_t s = 0, f = 0;
 
   debug_on = !!getenv("VYOS_DEBUG");
@@ -1310,35 +1839,53 @@ commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
   int num = pq.size();
   // decrease by one because we have one root element
   --num;
+  size_t jobs = _get_commit_jobs();
+  CommitProfile::Event ev_exec("phase", "execute");
+  ev_exec.addArg("jobs", jobs);
+  vector<vector<PrioNode *> > waves;
+  if (_get_commit_waves(dpq, true, waves)) {
+    _commit_exec_waves(cs, waves, jobs, true, num + dpq.size(), s, f);
+    while (!dpq.empty()) {
+      dpq.pop();
+    }
+    waves.clear();
+  }
   while (!dpq.empty()) {
+    if (jobs > 1) {
+      size_t remaining = num + dpq.size();
+      vector<PrioNode *> batch;
+      _get_commit_prio_batch(dpq, batch);
+      _commit_exec_prio_batch(cs, batch, jobs, true, remaining, s, f);
+      continue;
+    }
     PrioNode *p = dpq.top();
     set_if_last(num+dpq.size());
-    if (!_commit_exec_prio_subtree(cs, p)) {
-      // prio subtree failed
-      OUTPUT_USER("delete [ %s ] failed\n", 
-		  p->getCommitPath().to_string().c_str());
-      ++f;
-    } else {
-      // succeeded
-      ++s;
-    }
+    _commit_exec_and_report(cs, p, true, s, f);
     dpq.pop();
   }
+  if (_get_commit_waves(pq, false, waves)) {
+    _commit_exec_waves(cs, waves, jobs, false, pq.size(), s, f);
+    while (!pq.empty()) {
+      pq.pop();
+    }
+  }
   while (!pq.empty()) {
+    if (jobs > 1) {
+      size_t remaining = pq.size();
+      vector<PrioNode *> batch;
+      _get_commit_prio_batch(pq, batch);
+      _commit_exec_prio_batch(cs, batch, jobs, false, remaining, s, f);
+      continue;
+    }
     PrioNode *p = pq.top();
     set_if_last(pq.size());
-    if (!_commit_exec_prio_subtree(cs, p)) {
-      // prio subtree failed
-      OUTPUT_USER("[[%s]] failed\n",
-		  p->getCommitPath().to_string().c_str());
-      ++f;
-    } else {
-      // succeeded
-      ++s;
-    }
+    _commit_exec_and_report(cs, p, false, s, f);
     pq.pop();
   }
   TRACE_DISPLAY("Commit execute priority tree");
+  ev_exec.addArg("succeeded", s);
+  ev_exec.addArg("failed", f);
+  ev_exec.end();
   bool ret = true;
   const char *cst = "SUCCESS";
   if (f > 0) {
@@ -1352,12 +1899,15 @@ commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
     if(system("/opt/vyatta/sbin/vyatta-cfg-notify"));
   }
 
+  CommitProfile::Event ev_cfg("phase", "commit_config");
   if (!cs.commitConfig(proot)) {
     OUTPUT_USER("Failed to generate committed config\n");
     ret = false;
   }
+  ev_cfg.end();
 
   set_in_commit(false);
+  CommitProfile::Event ev_clear("phase", "clear_markers");
   if (!cs.clearCommittedMarkers()) {
     OUTPUT_USER("Failed to clear committed markers\n");
     ret = false;
@@ -1365,13 +1915,30 @@ commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
   if (ret) {
     ret = cs.markSessionUnsaved();
   }
+  ev_clear.end();
 
+  CommitProfile::Event ev_sync("phase", "sync");
   sync();
+  ev_sync.end();
 
+  CommitProfile::Event ev_post("phase", "post_hooks");
   setenv("COMMIT_STATUS", cst, 1);
   _execute_hooks(POST_COMMIT);
   unsetenv("COMMIT_STATUS");
+  ev_post.end();
 
   return ret;
 }
 
+bool
+commit::doCommit(Cstore& cs, CfgNode& cfg1, CfgNode& cfg2)
+{
+  CommitProfile::start();
+  CommitProfile::Event ev("commit", "commit");
+  bool ret = _do_commit(cs, cfg1, cfg2);
+  ev.addArg("ok", ret);
+  ev.end();
+  CommitProfile::finish();
+  return ret;
+}
+
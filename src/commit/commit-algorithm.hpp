@@ -22,6 +22,7 @@
 #include <tr1/memory>
 
 #include <cnode/cnode-util.hpp>
+#include <cstore/util.hpp>
 #include <cstore/cpath.hpp>
 #include <cstore/ctemplate.hpp>
 
@@ -91,6 +92,7 @@ public:
   const vtw_def *getDef() const;
   unsigned int getPriority() const;
   void setPriority(unsigned int p);
+  const char *getDepends() const;
   const vtw_node *getActions(vtw_act_type act, bool raw = false) const;
   bool isBeginEndNode() const;
 
@@ -114,6 +116,7 @@ public:
 
   CfgNode *getCfgNode();
   unsigned int getPriority() const;
+  const char *getDepends() const;
   CommitState getCommitState() const;
   Cpath getCommitPath() const;
   bool parentCreateFailed() const;
@@ -0,0 +1,242 @@
+/*
+ * Copyright (C) 2011 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <commit/commit-profile.hpp>
+
+using namespace commit;
+using namespace std;
+
+
+////// static
+// wall clock (for correlating events across processes)
+static long long
+_get_ts_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((long long) tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+static long long
+_get_mono_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+// CPU time of this process and all its waited-for children
+static long long
+_get_cpu_us()
+{
+  struct rusage s, c;
+  if (getrusage(RUSAGE_SELF, &s) != 0 || getrusage(RUSAGE_CHILDREN, &c) != 0) {
+    return 0;
+  }
+  long long us = 0;
+  us += (long long) s.ru_utime.tv_sec * 1000000 + s.ru_utime.tv_usec;
+  us += (long long) s.ru_stime.tv_sec * 1000000 + s.ru_stime.tv_usec;
+  us += (long long) c.ru_utime.tv_sec * 1000000 + c.ru_utime.tv_usec;
+  us += (long long) c.ru_stime.tv_sec * 1000000 + c.ru_stime.tv_usec;
+  return us;
+}
+
+
+////// class CommitProfile
+const char *CommitProfile::C_ENV_PROFILE = "VYOS_COMMIT_PROFILE";
+const char *CommitProfile::C_TRACE_SUFFIX = ".trace.json";
+
+int CommitProfile::_jfd = -1;
+int CommitProfile::_tfd = -1;
+int CommitProfile::_depth = 0;
+pid_t CommitProfile::_owner = -1;
+
+void
+CommitProfile::start()
+{
+  if (_depth++ > 0) {
+    return;
+  }
+  const char *file = getenv(C_ENV_PROFILE);
+  if (!file || !file[0]) {
+    return;
+  }
+  string tfile = file;
+  tfile += C_TRACE_SUFFIX;
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC;
+  _jfd = open(file, flags, 0644);
+  _tfd = open(tfile.c_str(), flags, 0644);
+  if (_jfd < 0 || _tfd < 0) {
+    fprintf(stderr, "Failed to open commit profile [%s]\n", file);
+    if (_jfd >= 0) {
+      close(_jfd);
+    }
+    if (_tfd >= 0) {
+      close(_tfd);
+    }
+    _jfd = _tfd = -1;
+    return;
+  }
+  _owner = getpid();
+  write_line(_tfd, "[");
+}
+
+void
+CommitProfile::finish()
+{
+  if (_depth == 0 || --_depth > 0 || !enabled()) {
+    return;
+  }
+  if (_owner == getpid()) {
+    ostringstream s;
+    s << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << _owner
+      << ",\"args\":{\"name\":\"commit\"}}]";
+    write_line(_tfd, s.str());
+  }
+  close(_jfd);
+  close(_tfd);
+  _jfd = _tfd = -1;
+}
+
+string
+CommitProfile::json_str(const string& str)
+{
+  string ret = "\"";
+  for (size_t i = 0; i < str.length(); i++) {
+    unsigned char c = str[i];
+    switch (c) {
+    case '"':
+      ret += "\\\"";
+      break;
+    case '\\':
+      ret += "\\\\";
+      break;
+    case '\n':
+      ret += "\\n";
+      break;
+    case '\t':
+      ret += "\\t";
+      break;
+    default:
+      if (c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        ret += buf;
+      } else {
+        ret += c;
+      }
+      break;
+    }
+  }
+  ret += "\"";
+  return ret;
+}
+
+// write a line with a single write() since other processes may be writing
+void
+CommitProfile::write_line(int fd, const string& line)
+{
+  string l = line + "\n";
+  if (write(fd, l.c_str(), l.length()) != (ssize_t) l.length()) {
+    // nothing we can do
+  }
+}
+
+
+////// class CommitProfile::Event
+CommitProfile::Event::Event(const char *type, const string& name)
+  : _type(type), _name(name), _active(enabled()), _ts(0), _start(0),
+    _cpu_start(0)
+{
+  if (_active) {
+    _ts = _get_ts_us();
+    _start = _get_mono_us();
+    _cpu_start = _get_cpu_us();
+  }
+}
+
+CommitProfile::Event::~Event()
+{
+  end();
+}
+
+void
+CommitProfile::Event::addArg(const char *key, const string& val)
+{
+  if (_active) {
+    _args.push_back(pair<string, string>(key, json_str(val)));
+  }
+}
+
+void
+CommitProfile::Event::addArg(const char *key, long long val)
+{
+  if (_active) {
+    ostringstream s;
+    s << val;
+    _args.push_back(pair<string, string>(key, s.str()));
+  }
+}
+
+void
+CommitProfile::Event::end()
+{
+  if (!_active) {
+    return;
+  }
+  _active = false;
+  if (!enabled()) {
+    return;
+  }
+  long long dur = _get_mono_us() - _start;
+  long long cpu = _get_cpu_us() - _cpu_start;
+  pid_t pid = getpid();
+
+  string args;
+  for (size_t i = 0; i < _args.size(); i++) {
+    args += ",";
+    args += json_str(_args[i].first);
+    args += ":";
+    args += _args[i].second;
+  }
+
+  ostringstream j;
+  j << "{\"type\":" << json_str(_type) << ",\"name\":" << json_str(_name)
+    << ",\"pid\":" << pid << ",\"ts\":" << _ts << ",\"dur\":" << dur
+    << ",\"cpu\":" << cpu << args << "}";
+  write_line(_jfd, j.str());
+
+  /* chrome trace: "complete" event. all events are in the commit process,
+   * and each (worker) process is a "thread".
+   */
+  ostringstream t;
+  t << "{\"name\":" << json_str(_name) << ",\"cat\":" << json_str(_type)
+    << ",\"ph\":\"X\",\"pid\":" << _owner << ",\"tid\":" << pid
+    << ",\"ts\":" << _ts << ",\"dur\":" << dur
+    << ",\"args\":{\"cpu\":" << cpu << args << "}},";
+  write_line(_tfd, t.str());
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2011 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMIT_PROFILE_HPP_
+#define _COMMIT_PROFILE_HPP_
+#include <vector>
+#include <string>
+
+#include <sys/types.h>
+
+namespace commit {
+
+/* commit profiling.
+ *
+ * if the VYOS_COMMIT_PROFILE environment variable is set to a file name,
+ * each commit phase, prio subtree, and template action execution is
+ * recorded as an "event" with its wall time, CPU time (including child
+ * processes), and event-specific attributes. the events are written to:
+ *   <file>            one JSON object per line.
+ *   <file>.trace.json Chrome trace format (chrome://tracing, perfetto).
+ *
+ * events are appended as they complete, so events from forked workers
+ * (e.g., parallel commit) end up in the same files, identified by pid.
+ */
+class CommitProfile {
+public:
+  /* start/finish profiling. these can be nested, and only the outermost
+   * pair opens/closes the files.
+   */
+  static void start();
+  static void finish();
+  static bool enabled() { return (_jfd >= 0); };
+
+  class Event {
+  public:
+    Event(const char *type, const std::string& name);
+    ~Event();
+
+    void addArg(const char *key, const std::string& val);
+    void addArg(const char *key, long long val);
+    void end();
+
+  private:
+    std::string _type;
+    std::string _name;
+    // key and JSON-formatted value
+    std::vector<std::pair<std::string, std::string> > _args;
+    bool _active;
+    long long _ts;
+    long long _start;
+    long long _cpu_start;
+  };
+
+private:
+  static const char *C_ENV_PROFILE;
+  static const char *C_TRACE_SUFFIX;
+
+  static int _jfd;
+  static int _tfd;
+  static int _depth;
+  static pid_t _owner;
+
+  static std::string json_str(const std::string& str);
+  static void write_line(int fd, const std::string& line);
+};
+
+} // namespace commit
+
+#endif /* _COMMIT_PROFILE_HPP_ */
@@ -22,8 +22,13 @@
 
 namespace cparse {
 
-cnode::CfgNode *parse_file(FILE *fin, cstore::Cstore& cs);
-cnode::CfgNode *parse_file(const char *fname, cstore::Cstore& cs);
+/* parse a config file. if "arena" is specified, the tree is constructed in
+ * it (see cnode::CfgArena).
+ */
+cnode::CfgNode *parse_file(FILE *fin, cstore::Cstore& cs,
+                           cnode::CfgArena *arena = NULL);
+cnode::CfgNode *parse_file(const char *fname, cstore::Cstore& cs,
+                           cnode::CfgArena *arena = NULL);
 
 } // namespace cparse
 
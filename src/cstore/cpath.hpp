@@ -16,35 +16,66 @@
 
 #ifndef _CPATH_HPP_
 #define _CPATH_HPP_
+#include <cstring>
 #include <string>
 
-#include <cstore/svector.hpp>
+#include <cstore/intern.hpp>
 
 namespace cstore { // begin namespace cstore
 
+/* path of config/template components. the components are interned (see
+ * Intern), so copying, comparing, and hashing paths only deal with the
+ * component pointers.
+ */
 class Cpath {
 public:
-  Cpath() : _data() {};
-  Cpath(const Cpath& p) : _data() { operator=(p); };
-  Cpath(const char *comps[], size_t num_comps) : _data() {
+  Cpath() : _comps(_comps_buf), _size(0), _buf_size(C_STATIC_NUM_COMPS) {};
+  Cpath(const Cpath& p)
+    : _comps(_comps_buf), _size(0), _buf_size(C_STATIC_NUM_COMPS) {
+    operator=(p);
+  };
+  Cpath(const char *comps[], size_t num_comps)
+    : _comps(_comps_buf), _size(0), _buf_size(C_STATIC_NUM_COMPS) {
     for (size_t i = 0; i < num_comps; i++) {
       push(comps[i]);
     }
   };
-  ~Cpath() {};
+  ~Cpath() {
+    if (_comps != _comps_buf) {
+      delete [] _comps;
+    }
+  };
 
-  void push(const char *comp) { _data.push_back(comp); };
-  void push(const std::string& comp) { _data.push_back(comp.c_str()); };
-  void pop() { _data.pop_back(); };
-  void pop(std::string& last) { _data.pop_back(last); };
-  void clear() { _data.assign("", 0); };
+  void push(const char *comp) { pushInterned(Intern::get(comp)); };
+  void push(const std::string& comp) { pushInterned(Intern::get(comp)); };
+  // "comp" must be from Intern
+  void pushInterned(const std::string *comp) {
+    if (_size == _buf_size) {
+      grow(_size + 1);
+    }
+    _comps[_size++] = comp;
+  };
+  void pop() {
+    if (_size > 0) {
+      --_size;
+    }
+  };
+  void pop(std::string& last) {
+    if (_size > 0) {
+      last = *(_comps[--_size]);
+    }
+  };
+  void clear() { _size = 0; };
 
   Cpath& operator=(const Cpath& p) {
-    _data = p._data;
+    if (this != &p) {
+      _size = 0;
+      append(p);
+    }
     return *this;
   };
   Cpath& operator/=(const Cpath& p) {
-    _data /= p._data;
+    append(p);
     return *this;
   }
   Cpath operator/(const Cpath& rhs) {
@@ -54,27 +85,67 @@ public:
   };
 
   bool operator==(const Cpath& rhs) const {
-    return (_data == rhs._data);
+    return (_size == rhs._size
+            && memcmp(_comps, rhs._comps, _size * sizeof(*_comps)) == 0);
   };
   const char *operator[](size_t idx) const {
-    return _data[idx];
+    return (idx < _size ? _comps[idx]->c_str() : NULL);
+  };
+  // interned component at "idx"
+  const std::string *interned(size_t idx) const {
+    return (idx < _size ? _comps[idx] : NULL);
   };
 
-  size_t size() const { return _data.size(); };
-  size_t hash() const { return _data.hash(); };
+  size_t size() const { return _size; };
+  size_t hash() const {
+    size_t h = _size;
+    for (size_t i = 0; i < _size; i++) {
+      h = (h * 31) + Intern::hash(_comps[i]);
+    }
+    return h;
+  };
   const char *back() const {
-    return (size() > 0 ? _data[size() - 1] : NULL);
+    return (size() > 0 ? _comps[size() - 1]->c_str() : NULL);
+  };
+  std::string to_string() const {
+    std::string ret;
+    for (size_t i = 0; i < _size; i++) {
+      if (i > 0) {
+        ret += " ";
+      }
+      ret += *(_comps[i]);
+    }
+    return ret;
   };
-  std::string to_string() const { return _data.to_string(); };
 
 private:
-  struct CpathParams {
-    static const char separator = 0;
-    static const size_t static_num_elems = 24;
-    static const size_t static_buf_len = 256;
-  };
+  static const size_t C_STATIC_NUM_COMPS = 16;
+
+  const std::string **_comps;
+  const std::string *_comps_buf[C_STATIC_NUM_COMPS];
+  size_t _size;
+  size_t _buf_size;
 
-  cstore::svector<CpathParams> _data;
+  void append(const Cpath& p) {
+    if ((_size + p._size) > _buf_size) {
+      grow(_size + p._size);
+    }
+    memcpy(_comps + _size, p._comps, p._size * sizeof(*_comps));
+    _size += p._size;
+  };
+  void grow(size_t min_size) {
+    size_t n = _buf_size;
+    while (n < min_size) {
+      n *= 2;
+    }
+    const std::string **tmp = new const std::string *[n];
+    memcpy(tmp, _comps, _size * sizeof(*_comps));
+    if (_comps != _comps_buf) {
+      delete [] _comps;
+    }
+    _comps = tmp;
+    _buf_size = n;
+  };
 };
 
 struct CpathHash {
@@ -86,4 +157,3 @@ struct CpathHash {
 } // end namespace cstore
 
 #endif /* _CPATH_HPP_ */
-
@@ -32,7 +32,9 @@
 #include <cli_cstore.h>
 #include <cstore/cstore.hpp>
 #include <cstore/unionfs/cstore-unionfs.hpp>
+#include <cstore/snapshot/cstore-snapshot.hpp>
 #include <cstore/cstore-varref.hpp>
+#include <cstore/work-pool.hpp>
 #include <cnode/cnode.hpp>
 #include <cnode/cnode-algorithm.hpp>
 #include <cparse/cparse.hpp>
@@ -66,6 +68,10 @@ const string Cstore::C_ENV_SHAPI_COMP_HELP = "_cli_shell_api_comp_help";
 const string Cstore::C_ENV_SHAPI_HELP_ITEMS = "_cli_shell_api_hitems";
 const string Cstore::C_ENV_SHAPI_HELP_STRS = "_cli_shell_api_hstrs";
 
+//// config store backend selection
+const string Cstore::C_ENV_CSTORE_BACKEND = "VYATTA_CSTORE_BACKEND";
+const string Cstore::C_CSTORE_BACKEND_SNAPSHOT = "snapshot";
+
 //// dirs/files
 const string Cstore::C_ENUM_SCRIPT_DIR = "/opt/vyatta/share/enumeration";
 const string Cstore::C_LOGFILE_STDOUT = "/var/log/vyatta/cfg-stdout.log";
@@ -75,6 +81,11 @@ const unsigned int Cstore::SORT_DEFAULT = 0;
 const unsigned int Cstore::SORT_DEB_VERSION = 0;
 const unsigned int Cstore::SORT_NONE = 1;
 
+//// batch commands
+const unsigned int Cstore::CMD_DELETE = 0;
+const unsigned int Cstore::CMD_SET = 1;
+const unsigned int Cstore::CMD_COMMENT = 2;
+
 ////// static
 bool Cstore::_init = false;
 MapT<unsigned int, Cstore::SortFuncT> Cstore::_sort_func_map;
@@ -92,6 +103,7 @@ MapT<unsigned int, Cstore::SortFuncT> Cstore::_sort_func_map;
  *       this base class.
  */
 Cstore::Cstore(string& env)
+  : _in_batch(false)
 {
   init();
 
@@ -102,10 +114,21 @@ Cstore::Cstore(string& env)
 
 
 ////// factory functions
+// whether the "snapshot" config store is selected (see SnapshotCstore)
+static bool
+use_snapshot_cstore()
+{
+  const char *b = getenv(Cstore::C_ENV_CSTORE_BACKEND.c_str());
+  return (b && Cstore::C_CSTORE_BACKEND_SNAPSHOT == b);
+}
+
 // for "current session" (see UnionfsCstore constructor for details)
 Cstore *
 Cstore::createCstore(bool use_edit_level)
 {
+  if (use_snapshot_cstore()) {
+    return (new snapshot::SnapshotCstore(use_edit_level));
+  }
   return (new unionfs::UnionfsCstore(use_edit_level));
 }
 
@@ -128,6 +151,9 @@ Cstore::contains_whitespace(const char *name) {
 Cstore *
 Cstore::createCstore(const string& session_id, string& env)
 {
+  if (use_snapshot_cstore()) {
+    return (new snapshot::SnapshotCstore(session_id, env));
+  }
   return (new unionfs::UnionfsCstore(session_id, env));
 }
 
@@ -220,6 +246,9 @@ Cstore::getParsedTmpl(const Cpath& path_comps, MapT<string, string>& tmap,
   if (def->getValHelp()) {
     tmap["val_help"] = def->getValHelp();
   }
+  if (def->getDepends()) {
+    tmap["depends"] = def->getDepends();
+  }
   return true;
 }
 
@@ -1544,6 +1573,35 @@ Cstore::cfgPathGetValuesDA(const Cpath& path_comps, vector<string>& values,
   return read_value_vec(values, active_cfg);
 }
 
+/* read the whole subtree at the specified path, including values, comments,
+ * and markers, in a single pass.
+ *   root: (output) the subtree. the name of the root is the last path comp.
+ *   active_cfg: whether to read from active config.
+ * return false if the node doesn't exist or if the backend doesn't support
+ * this (in which case the caller should fall back to the per-node
+ * observers). otherwise return true.
+ *
+ * note that this is "deactivate-aware": the "marked deactivated" state of
+ * each node is returned as is, and it's up to the caller to interpret it.
+ */
+bool
+Cstore::cfgPathGetSubtreeDA(const Cpath& path_comps, CfgRawNode& root,
+                            bool active_cfg)
+{
+  return get_subtree_da(path_comps, root, active_cfg, true);
+}
+
+/* same as above but only read the node itself, i.e., the children of the
+ * returned node only have names. this is for walking a config one node at
+ * a time without reading the whole subtree into memory.
+ */
+bool
+Cstore::cfgPathGetNodeDA(const Cpath& path_comps, CfgRawNode& node,
+                         bool active_cfg)
+{
+  return get_subtree_da(path_comps, node, active_cfg, false);
+}
+
 /* get comment of specified node.
  *   comment: (output) node comment.
  *   active_cfg: whether to get comment from active config.
@@ -1930,6 +1988,23 @@ Cstore::unmarkCfgPathDeactivated(const Cpath& path_comps)
   return (unmark_deactivated() && mark_changed_with_ancestors());
 }
 
+// parse a config file with its own template reader (see loadFile())
+class ParseFileTask : public WorkPool::Task {
+public:
+  ParseFileTask(FILE *fin, Cstore *reader, CfgArena *arena)
+    : _fin(fin), _reader(reader), _arena(arena), root(NULL) {};
+  ~ParseFileTask() { delete _reader; };
+  void run() { root = cparse::parse_file(_fin, *_reader, _arena); };
+
+private:
+  FILE *_fin;
+  Cstore *_reader;
+  CfgArena *_arena;
+
+public:
+  CfgNode *root;
+};
+
 // load specified config file
 bool
 Cstore::loadFile(const char *filename)
@@ -1946,47 +2021,152 @@ Cstore::loadFile(const char *filename)
     return false;
   }
 
-  // get the config tree from the file
-  CfgNode *froot = cparse::parse_file(fin, *this);
+  /* get the config tree from the file and the config tree from the active
+   * config. these are independent, so parse the file in the pool (if any)
+   * while reading the active config. both trees are built in an arena so
+   * that they can be released together once the diff is done.
+   */
+  #if __GNUC__ < 6
+  auto_ptr<CfgArena> arena(new CfgArena());
+  auto_ptr<CfgNode> aroot;
+  #else
+  unique_ptr<CfgArena> arena(new CfgArena());
+  unique_ptr<CfgNode> aroot;
+  #endif
+  ParseFileTask ptask(fin, createTmplReader(), arena.get());
+  Cpath args;
+  {
+    WorkPool::Group g(WorkPool::get());
+    g.add(&ptask);
+    aroot.reset(new CfgNode(*this, args, true, true, arena.get()));
+  }
   fclose(fin);
+  CfgNode *froot = ptask.root;
   if (!froot) {
     output_user("Failed to parse specified config file\n");
     return false;
   }
 
-  // get the config tree from the active config
-  Cpath args;
-  CfgNode aroot(*this, args, true, true);
-
   // get the "commands diff" between the two
   vector<Cpath> del_list;
   vector<Cpath> set_list;
   vector<Cpath> com_list;
-  get_cmds_diff(aroot, *froot, del_list, set_list, com_list);
+  get_cmds_diff(*aroot, *froot, del_list, set_list, com_list);
 
   delete froot;
+  aroot.reset();
+  arena.reset();
   // "apply" the changes to the working config
+  applyCommands(del_list, set_list, com_list);
+  return true;
+}
+
+/* apply the specified commands to the working config as one batch: first
+ * the deletes, then the sets, and then the comments, each in the specified
+ * order (see the other applyCommands() below).
+ * return true if all commands succeeded. otherwise return false.
+ */
+bool
+Cstore::applyCommands(const vector<Cpath>& del_list,
+                      const vector<Cpath>& set_list,
+                      const vector<Cpath>& com_list)
+{
+  vector<BatchCmdT> cmds;
+  cmds.reserve(del_list.size() + set_list.size() + com_list.size());
   for (size_t i = 0; i < del_list.size(); i++) {
-    if (!deleteCfgPath(del_list[i])) {
-      print_path_vec("Delete [", "] failed\n", del_list[i], "'");
-    }
+    cmds.push_back(BatchCmdT(CMD_DELETE, del_list[i]));
   }
   for (size_t i = 0; i < set_list.size(); i++) {
-    if (!validateSetPath(set_list[i]) || !setCfgPath(set_list[i])) {
-      print_path_vec("Set [", "] failed\n", set_list[i], "'");
-    }
+    cmds.push_back(BatchCmdT(CMD_SET, set_list[i]));
   }
   for (size_t i = 0; i < com_list.size(); i++) {
-    if (!commentCfgPath(com_list[i])) {
-      string comment = string(com_list[i][com_list[i].size()-1]);
+    cmds.push_back(BatchCmdT(CMD_COMMENT, com_list[i]));
+  }
+  return applyCommands(cmds);
+}
+
+/* apply the specified commands to the working config as one batch, in the
+ * specified order. the commands are applied the same way as individual
+ * commands except that
+ *   (1) the sets don't re-check the existence of path prefixes that are
+ *       already known to exist from earlier sets in the batch, and
+ *   (2) the "changed" markers for the sets are created once at the end of
+ *       the batch instead of up to root for every set.
+ * a delete ends the current batch (i.e., the pending markers are created
+ * and the known paths are forgotten) before it is applied, so a set after
+ * it sees the result of the delete.
+ * a failed command is reported and the rest of the batch is still applied.
+ * return true if all commands succeeded. otherwise return false.
+ */
+bool
+Cstore::applyCommands(const vector<BatchCmdT>& cmds)
+{
+  ASSERT_IN_SESSION;
+
+  bool ret = true;
+  for (size_t i = 0; i < cmds.size(); i++) {
+    const Cpath& path_comps = cmds[i].second;
+    if (cmds[i].first == CMD_DELETE) {
+      if (!end_batch()) {
+        ret = false;
+      }
+      if (!deleteCfgPath(path_comps)) {
+        print_path_vec("Delete [", "] failed\n", path_comps, "'");
+        ret = false;
+      }
+    } else if (cmds[i].first == CMD_SET) {
+      _in_batch = true;
+      if (!validateSetPath(path_comps) || !setCfgPath(path_comps)) {
+        print_path_vec("Set [", "] failed\n", path_comps, "'");
+        ret = false;
+      }
+    } else if (!commentCfgPath(path_comps)) {
+      string comment = string(path_comps[path_comps.size()-1]);
       if (comment.find("CONFIGURATION COMMENTED OUT DURING MIGRATION BELOW") == string::npos
        && comment.find("CONFIGURATION COMMENTED OUT DURING MIGRATION ABOVE") == string::npos) {
-        print_path_vec("Comment [", "] failed\n", com_list[i], "'");
+        print_path_vec("Comment [", "] failed\n", path_comps, "'");
+        ret = false;
       }
     }
   }
+  if (!end_batch()) {
+    ret = false;
+  }
+  return ret;
+}
 
-  return true;
+/* end the current batch (if any): create the pending "changed" markers and
+ * forget the paths known to exist.
+ * return true if successful. otherwise return false.
+ */
+bool
+Cstore::end_batch()
+{
+  bool ret = true;
+  _in_batch = false;
+  _batch_paths.clear();
+  /* mark the deepest paths first so that marking the others stops at their
+   * own markers.
+   */
+  MapT<Cpath, bool, CpathHash> marked;
+  for (size_t i = _batch_changed.size(); i > 0; i--) {
+    const Cpath& cpath = _batch_changed[i - 1];
+    if (marked.find(cpath) != marked.end()) {
+      continue;
+    }
+    marked[cpath] = true;
+    #if __GNUC__ < 6
+    auto_ptr<SavePaths> save(create_save_paths());
+    #else
+    unique_ptr<SavePaths> save(create_save_paths());
+    #endif
+    append_cfg_path(cpath);
+    if (!mark_changed_with_ancestors()) {
+      ret = false;
+    }
+  }
+  _batch_changed.clear();
+  return ret;
 }
 
 /* "changed" status handling.
@@ -2158,6 +2338,31 @@ Cstore::assert_internal(bool cond, const char *fmt, ...)
 
 
 ////// private functions
+/* read the subtree (or only the node if not "recursive") at the specified
+ * path (see cfgPathGetSubtreeDA()).
+ */
+bool
+Cstore::get_subtree_da(const Cpath& path_comps, CfgRawNode& root,
+                       bool active_cfg, bool recursive)
+{
+  if (!active_cfg) {
+    ASSERT_IN_SESSION;
+  }
+
+  #if __GNUC__ < 6
+  auto_ptr<SavePaths> save(create_save_paths());
+  #else
+  unique_ptr<SavePaths> save(create_save_paths());
+  #endif
+  append_cfg_path(path_comps);
+  if (!read_cfg_subtree(root, active_cfg, recursive)) {
+    return false;
+  }
+  root.name = (path_comps.size() > 0 ? path_comps[path_comps.size() - 1]
+               : "");
+  return true;
+}
+
 bool
 Cstore::sort_func_deb_version(string a, string b)
 {
@@ -2175,6 +2380,18 @@ Cstore::sort_nodes(vector<string>& nvec, unsigned int sort_alg)
   sort(nvec.begin(), nvec.end(), p->second);
 }
 
+bool
+Cstore::cmp_nodes(const string& a, const string& b, unsigned int sort_alg)
+{
+  MapT<unsigned int, Cstore::SortFuncT>::iterator p
+    = _sort_func_map.find(sort_alg);
+  if (p == _sort_func_map.end()) {
+    // not sorted
+    return false;
+  }
+  return p->second(a, b);
+}
+
 /* try to append the logical path to template path.
  *   is_tag: (output) whether the last component is a "tag".
  * return false if logical path is not valid. otherwise return true.
@@ -2210,6 +2427,19 @@ Cstore::append_tmpl_path(const Cpath& path_comps, bool& is_tag)
 
 typedef MapT<Cpath, tr1::shared_ptr<Ctemplate>, CpathHash> TmplCacheT;
 static TmplCacheT _tmpl_cache;
+static RwLock _tmpl_cache_lock;
+
+void
+Cstore::clearCaches()
+{
+  {
+    RwLock::Write l(_tmpl_cache_lock);
+    _tmpl_cache.clear();
+  }
+  unionfs::UnionfsCstore::clearNameCaches();
+  // nothing refers to the interned strings any more
+  Intern::clear();
+}
 
 /* check whether specified "logical path" is valid template path.
  * then template at the path is parsed.
@@ -2237,6 +2467,7 @@ Cstore::get_parsed_tmpl(const Cpath& path_comps, bool validate_vals,
     }
     // we are starting from root => caching applies
     do_caching = true;
+    RwLock::Read l(_tmpl_cache_lock);
     TmplCacheT::iterator p = _tmpl_cache.find(path_comps);
     if (p != _tmpl_cache.end()) {
       // return cached
@@ -2380,6 +2611,7 @@ Cstore::get_parsed_tmpl(const Cpath& path_comps, bool validate_vals,
 
   if (do_caching && rtmpl.get()) {
     // only cache if we got a valid template
+    RwLock::Write l(_tmpl_cache_lock);
     _tmpl_cache[path_comps] = rtmpl;
   }
   return rtmpl;
@@ -2557,6 +2789,12 @@ Cstore::set_cfg_path(const Cpath& path_comps, bool output)
     // partial path
     ppath.push(path_comps[i]);
 
+    if (_in_batch && (i + 1) < path_comps.size()
+        && _batch_paths.find(ppath) != _batch_paths.end()) {
+      // already known to exist in this batch
+      continue;
+    }
+
     // get template at this level
     def = get_parsed_tmpl(ppath, false);
     if (!def.get()) {
@@ -2570,6 +2808,9 @@ Cstore::set_cfg_path(const Cpath& path_comps, bool output)
 
     // nop if this level already in working (including deactivated)
     if (cfg_path_exists(ppath, false, true)) {
+      if (_in_batch && (!def->isValue() || def->isTag())) {
+        _batch_paths[ppath] = true;
+      }
       continue;
     }
 
@@ -2623,7 +2864,16 @@ Cstore::set_cfg_path(const Cpath& path_comps, bool output)
         }
       }
     }
-    if (!mark_changed_with_ancestors()) {
+    if (_in_batch) {
+      // mark it at the end of the batch (see applyCommands())
+      Cpath cpath(ppath);
+      if (def->isValue() && !def->isTag()) {
+        cpath.pop();
+      } else {
+        _batch_paths[ppath] = true;
+      }
+      _batch_changed.push_back(cpath);
+    } else if (!mark_changed_with_ancestors()) {
       ret = false;
       break;
     }
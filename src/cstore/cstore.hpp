@@ -52,9 +52,26 @@ namespace cstore { // begin namespace cstore
 
 using namespace std;
 
+/* a config subtree as stored by the backend (see cfgPathGetSubtreeDA()).
+ * names are unescaped, and children are in no particular order. for a
+ * single node (see cfgPathGetNodeDA()), the children only have names.
+ */
+struct CfgRawNode {
+  CfgRawNode() : deactivated(false), is_default(false), has_value(false),
+                 has_comment(false) {};
+  string name;
+  bool deactivated; // "marked deactivated"
+  bool is_default;
+  bool has_value;
+  vector<string> values;
+  bool has_comment;
+  string comment;
+  vector<CfgRawNode> children;
+};
+
 class Cstore {
 public:
-  Cstore() { init(); };
+  Cstore() : _in_batch(false) { init(); };
   Cstore(string& env);
   virtual ~Cstore() {};
 
@@ -62,6 +79,13 @@ public:
   static Cstore *createCstore(bool use_edit_level = false);
   static Cstore *createCstore(const string& session_id, string& env);
 
+  /* clear the process-wide caches that refer to config paths (including
+   * values) and free the interned strings (see Intern::clear()). the
+   * template caches keyed by template file are kept. no Cstore, CfgNode,
+   * or Cpath may still be in use.
+   */
+  static void clearCaches();
+
   // constants
   static const string C_NODE_STATUS_DELETED;
   static const string C_NODE_STATUS_ADDED;
@@ -81,6 +105,9 @@ public:
   static const string C_ENV_SHAPI_HELP_ITEMS;
   static const string C_ENV_SHAPI_HELP_STRS;
 
+  static const string C_ENV_CSTORE_BACKEND;
+  static const string C_CSTORE_BACKEND_SNAPSHOT;
+
   static const string C_ENUM_SCRIPT_DIR;
   static const string C_LOGFILE_STDOUT;
 
@@ -95,6 +122,12 @@ public:
   static const unsigned int SORT_DEB_VERSION;
   static const unsigned int SORT_NONE;
 
+  // batch commands (see applyCommands())
+  static const unsigned int CMD_DELETE;
+  static const unsigned int CMD_SET;
+  static const unsigned int CMD_COMMENT;
+  typedef pair<unsigned int, Cpath> BatchCmdT;
+
   ////// the public cstore interface
   //// functions implemented in this base class
   // these operate on template path
@@ -104,6 +137,11 @@ public:
   bool getParsedTmpl(const Cpath& path_comps, MapT<string, string>& tmap,
                      bool allow_val = true);
   void tmplGetChildNodes(const Cpath& path_comps, vector<string>& cnodes);
+  /* return a new object with the same template tree and paths as this
+   * one. it can be used in another thread at the same time as this one,
+   * but only for the template functions above. caller owns it.
+   */
+  virtual Cstore *createTmplReader() = 0;
 
   /******
    * functions for actual CLI operations:
@@ -184,6 +222,10 @@ public:
      */
   // load
   bool loadFile(const char *filename);
+  bool applyCommands(const vector<Cpath>& del_list,
+                     const vector<Cpath>& set_list,
+                     const vector<Cpath>& com_list);
+  bool applyCommands(const vector<BatchCmdT>& cmds);
 
   /******
    * these functions are observers of the current "working config" or
@@ -274,6 +316,10 @@ public:
   bool cfgPathGetValuesDA(const Cpath& path_comps, vector<string>& values,
                           bool active_cfg = false,
                           bool include_deactivated = true);
+  bool cfgPathGetSubtreeDA(const Cpath& path_comps, CfgRawNode& root,
+                           bool active_cfg = false);
+  bool cfgPathGetNodeDA(const Cpath& path_comps, CfgRawNode& node,
+                        bool active_cfg = false);
   // working AND active configs
   void cfgPathGetDeletedChildNodesDA(const Cpath& path_comps,
                                      vector<string>& cnodes,
@@ -296,6 +342,11 @@ public:
                         unsigned int sort_alg = SORT_DEFAULT) {
     sort_nodes(nvec, sort_alg);
   };
+  // whether node "a" goes before node "b" in sortNodes() order
+  static bool cmpNodes(const string& a, const string& b,
+                       unsigned int sort_alg = SORT_DEFAULT) {
+    return cmp_nodes(a, b, sort_alg);
+  };
 
   /* these are internal API functions and operate on current cfg and
    * tmpl paths during cstore operations. they are only used to work around
@@ -323,6 +374,14 @@ private:
   // for variable reference
   class VarRef;
 
+  ////// batch state (see applyCommands())
+  bool _in_batch;
+  // paths known to exist in working config
+  MapT<Cpath, bool, CpathHash> _batch_paths;
+  // paths to be marked changed at the end of the batch
+  vector<Cpath> _batch_changed;
+  bool end_batch();
+
   ////// virtual
   /* "path modifiers"
    * note: only these functions are allowed to permanently change the paths.
@@ -383,6 +442,16 @@ private:
   virtual bool marked_deactivated(bool active_cfg) = 0;
   virtual bool get_comment(string& comment, bool active_cfg) = 0;
   virtual bool marked_display_default(bool active_cfg) = 0;
+  /* read the whole subtree (or only the node itself if not "recursive")
+   * in one pass. return false if the node doesn't exist or the backend
+   * doesn't support this.
+   */
+  virtual bool read_cfg_subtree(CfgRawNode& root, bool active_cfg,
+                                bool recursive) {
+    return false;
+  };
+  bool get_subtree_da(const Cpath& path_comps, CfgRawNode& root,
+                      bool active_cfg, bool recursive);
 
   // observers for "edit/tmpl levels" (for "edit"-related operations)
   /* note that these should be handled in the base class since they
@@ -416,6 +485,8 @@ private:
   static bool sort_func_deb_version(string a, string b);
   static void sort_nodes(vector<string>& nvec,
                          unsigned int sort_alg = SORT_DEFAULT);
+  static bool cmp_nodes(const string& a, const string& b,
+                        unsigned int sort_alg = SORT_DEFAULT);
 
   // init
   static bool _init;
@@ -85,6 +85,7 @@ public:
   };
   const char *getCompHelp() const { return _def->def_comp_help; };
   const char *getValHelp() const { return _def->def_val_help; };
+  const char *getDepends() const { return _def->def_depends; };
   unsigned int getTagLimit() const { return _def->def_tag; };
   unsigned int getMultiLimit() const { return _def->def_multi; };
   unsigned int getPriority() const { return _def->def_priority; };
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <string>
+#include <tr1/unordered_map>
+
+#include <cstore/intern.hpp>
+#include <cstore/work-pool.hpp>
+
+using namespace cstore;
+using namespace std;
+
+////// static
+/* key referring to the characters of a string (so that a lookup doesn't
+ * need to construct a string). a key in the table refers to the interned
+ * string itself.
+ */
+struct StrRef {
+  StrRef(const char *s, size_t l, size_t h) : str(s), len(l), hash(h) {};
+  const char *str;
+  size_t len;
+  size_t hash;
+  bool operator==(const StrRef& rhs) const {
+    return (len == rhs.len && memcmp(str, rhs.str, len) == 0);
+  };
+};
+
+struct StrRefHash {
+  size_t operator()(const StrRef& s) const { return s.hash; };
+};
+
+typedef tr1::unordered_map<StrRef, const string *, StrRefHash> InternMapT;
+
+/* the table is split into shards (by hash) so that threads building trees
+ * at the same time don't all contend for one lock.
+ */
+static const size_t C_NUM_SHARDS = 16;
+
+struct Shard {
+  RwLock lock;
+  InternMapT strs;
+};
+
+// never freed since interned strings may be used until exit
+static Shard *
+_get_shards()
+{
+  static Shard *shards = new Shard[C_NUM_SHARDS];
+  return shards;
+}
+
+// FNV-1a
+static size_t
+_hash_str(const char *str, size_t len)
+{
+  size_t h = 2166136261U;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char) str[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+
+////// class Intern
+const string *
+Intern::get(const char *str)
+{
+  return get(str, strlen(str));
+}
+
+const string *
+Intern::empty()
+{
+  static const string *estr = get("", 0);
+  return estr;
+}
+
+const string *
+Intern::get(const char *str, size_t len)
+{
+  size_t h = _hash_str(str, len);
+  Shard& s = _get_shards()[h % C_NUM_SHARDS];
+  StrRef key(str, len, h);
+  {
+    RwLock::Read l(s.lock);
+    InternMapT::const_iterator it = s.strs.find(key);
+    if (it != s.strs.end()) {
+      return it->second;
+    }
+  }
+
+  RwLock::Write l(s.lock);
+  InternMapT::const_iterator it = s.strs.find(key);
+  if (it != s.strs.end()) {
+    // added by another thread in the meantime
+    return it->second;
+  }
+  const string *istr = new string(str, len);
+  s.strs[StrRef(istr->data(), len, h)] = istr;
+  return istr;
+}
+
+void
+Intern::clear()
+{
+  const string *estr = empty();
+  Shard *shards = _get_shards();
+  for (size_t i = 0; i < C_NUM_SHARDS; i++) {
+    RwLock::Write l(shards[i].lock);
+    InternMapT::iterator it = shards[i].strs.begin();
+    while (it != shards[i].strs.end()) {
+      if (it->second == estr) {
+        ++it;
+        continue;
+      }
+      delete it->second;
+      shards[i].strs.erase(it++);
+    }
+  }
+}
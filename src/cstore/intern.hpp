@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _INTERN_HPP_
+#define _INTERN_HPP_
+#include <string>
+
+namespace cstore { // begin namespace cstore
+
+/* process-wide table of interned strings, i.e., path components, node
+ * names, and values. an interned string is never freed or modified, so it
+ * is identified by its address: two interned strings are equal if and only
+ * if they are the same object, and they can be hashed and compared as
+ * integers (see Cpath).
+ *
+ * the table can be used by multiple threads (see WorkPool).
+ */
+class Intern {
+public:
+  // return the interned copy of "str"
+  static const std::string *get(const char *str);
+  static const std::string *get(const std::string& str) {
+    return get(str.c_str(), str.length());
+  };
+  static const std::string *get(const char *str, size_t len);
+  // interned empty string
+  static const std::string *empty();
+  /* free all interned strings except the empty one. only for long-lived
+   * processes between independent operations, e.g., the shell API daemon
+   * between requests: no interned string (or anything keyed by one) may
+   * still be in use. see Cstore::clearCaches().
+   */
+  static void clear();
+
+  // hash of an interned string
+  static size_t hash(const std::string *istr) {
+    return ((size_t) istr >> 3);
+  };
+  struct Hash {
+    size_t operator()(const std::string *istr) const {
+      return hash(istr);
+    };
+  };
+};
+
+} // end namespace cstore
+
+#endif /* _INTERN_HPP_ */
@@ -0,0 +1,1721 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include <cli_cstore.h>
+#include <cstore/snapshot/cstore-snapshot.hpp>
+#include <cnode/cnode.hpp>
+#include <commit/commit-algorithm.hpp>
+
+namespace cstore { // begin namespace cstore
+namespace snapshot { // begin namespace snapshot
+
+////// constants
+// node flags
+static const unsigned int C_F_VALUE = 0x1;
+static const unsigned int C_F_COMMENT = 0x2;
+static const unsigned int C_F_DEACTIVATED = 0x4;
+static const unsigned int C_F_DISPLAY_DEFAULT = 0x8;
+static const unsigned int C_F_CHANGED = 0x10;
+static const unsigned int C_F_UNSAVED = 0x20;
+
+// flags that are not part of the config itself (i.e., session state)
+static const unsigned int C_F_SESSION = (C_F_CHANGED | C_F_UNSAVED);
+
+// record types
+static const char C_OP_TREE = 'T';
+static const char C_OP_ATTRS = 'A';
+static const char C_OP_DELETE = 'D';
+
+
+////// config tree
+/* a node in the config tree. child names are the same as the unionfs
+ * store's directory names, i.e., "escaped".
+ *
+ * nodes are shared between trees (e.g., the working config and the active
+ * config) and between versions of a tree, so a node must only be modified
+ * if it is not shared, i.e., if it is "unique". _get_mutable() below copies
+ * the shared nodes along a path.
+ */
+typedef MapT<string, SnapNodeP> SnapChildMapT;
+
+struct SnapNode {
+  SnapNode() : flags(0), value(), comment(), children() {};
+  unsigned int flags;
+  string value;
+  string comment;
+  SnapChildMapT children;
+};
+
+/* return the node at the first "n" comps under "root", or NULL if it
+ * doesn't exist.
+ */
+static const SnapNodeP *
+_find(const SnapNodeP& root, const vector<string>& comps, size_t n)
+{
+  if (!root) {
+    return NULL;
+  }
+  const SnapNodeP *cur = &root;
+  for (size_t i = 0; i < n; i++) {
+    SnapChildMapT::const_iterator it = (*cur)->children.find(comps[i]);
+    if (it == (*cur)->children.end()) {
+      return NULL;
+    }
+    cur = &(it->second);
+  }
+  return cur;
+}
+
+/* return the node at the first "n" comps under "root" for modification,
+ * i.e., the nodes along the path are copied if shared. if "create", the
+ * missing nodes are created. otherwise return NULL if it doesn't exist.
+ */
+static SnapNode *
+_get_mutable(SnapNodeP& root, const vector<string>& comps, size_t n,
+             bool create)
+{
+  if (!root) {
+    if (!create) {
+      return NULL;
+    }
+    root.reset(new SnapNode());
+  } else if (!root.unique()) {
+    root.reset(new SnapNode(*root));
+  }
+  SnapNode *cur = root.get();
+  for (size_t i = 0; i < n; i++) {
+    SnapChildMapT::iterator it = cur->children.find(comps[i]);
+    if (it == cur->children.end()) {
+      if (!create) {
+        return NULL;
+      }
+      SnapNodeP c(new SnapNode());
+      cur->children[comps[i]] = c;
+      cur = c.get();
+      continue;
+    }
+    if (!it->second.unique()) {
+      it->second.reset(new SnapNode(*(it->second)));
+    }
+    cur = it->second.get();
+  }
+  return cur;
+}
+
+// replace the subtree at the first "n" comps with "node"
+static void
+_put_subtree(SnapNodeP& root, const vector<string>& comps, size_t n,
+             const SnapNodeP& node)
+{
+  if (n == 0) {
+    root = node;
+    return;
+  }
+  SnapNode *p = _get_mutable(root, comps, n - 1, true);
+  p->children[comps[n - 1]] = node;
+}
+
+// delete the subtree at the first "n" comps
+static void
+_del_subtree(SnapNodeP& root, const vector<string>& comps, size_t n)
+{
+  if (n == 0) {
+    root.reset();
+    return;
+  }
+  if (!_find(root, comps, n)) {
+    return;
+  }
+  SnapNode *p = _get_mutable(root, comps, n - 1, false);
+  p->children.erase(comps[n - 1]);
+}
+
+/* return "node" with the specified flag(s) cleared in the whole subtree
+ * (excluding "node" itself if !self). only the nodes that need to be
+ * modified are copied.
+ *   prune: if a node doesn't have any of the flags, its descendants don't
+ *          either (e.g., "changed").
+ */
+static SnapNodeP
+_without_flag(const SnapNodeP& node, unsigned int flag, bool self,
+              bool prune)
+{
+  if (prune && self && !(node->flags & flag)) {
+    return node;
+  }
+  SnapNodeP ret = node;
+  SnapChildMapT::const_iterator it = node->children.begin();
+  for (; it != node->children.end(); ++it) {
+    SnapNodeP c = _without_flag(it->second, flag, true, prune);
+    if (c != it->second) {
+      if (ret == node) {
+        ret.reset(new SnapNode(*node));
+      }
+      ret->children[it->first] = c;
+    }
+  }
+  if (self && (node->flags & flag)) {
+    if (ret == node) {
+      ret.reset(new SnapNode(*node));
+    }
+    ret->flags &= ~flag;
+  }
+  return ret;
+}
+
+// whether two nodes have the same config attributes
+static bool
+_same_attrs(const SnapNode& n1, const SnapNode& n2)
+{
+  unsigned int f1 = (n1.flags & ~C_F_SESSION);
+  unsigned int f2 = (n2.flags & ~C_F_SESSION);
+  return (f1 == f2
+          && (!(f1 & C_F_VALUE) || n1.value == n2.value)
+          && (!(f1 & C_F_COMMENT) || n1.comment == n2.comment));
+}
+
+/* return the working config tree "work" (without any session flags)
+ * re-marked "changed" relative to the active config tree "active". the
+ * unchanged subtrees are shared with "active".
+ *   changed: (output) whether "work" is different from "active".
+ */
+static SnapNodeP
+_resync(const SnapNodeP& work, const SnapNodeP *active, bool& changed)
+{
+  if (active && work == *active) {
+    changed = false;
+    return work;
+  }
+  const SnapNode *a = (active ? active->get() : NULL);
+  bool diff = (!a || !_same_attrs(*work, *a)
+               || work->children.size() != a->children.size());
+  SnapNodeP ret(new SnapNode(*work));
+  SnapChildMapT::iterator it = ret->children.begin();
+  for (; it != ret->children.end(); ++it) {
+    const SnapNodeP *ac = NULL;
+    if (a) {
+      SnapChildMapT::const_iterator ai = a->children.find(it->first);
+      if (ai != a->children.end()) {
+        ac = &(ai->second);
+      }
+    }
+    bool cchanged = false;
+    it->second = _resync(it->second, ac, cchanged);
+    diff = (diff || cchanged);
+  }
+  changed = diff;
+  if (!diff) {
+    return *active;
+  }
+  ret->flags |= C_F_CHANGED;
+  return ret;
+}
+
+// number of nodes that are different in "work" relative to "active"
+static unsigned long long
+_count_diff(const SnapNodeP& work, const SnapNodeP *active)
+{
+  if (active && work == *active) {
+    return 0;
+  }
+  const SnapNode *a = (active ? active->get() : NULL);
+  unsigned long long num = ((!a || !_same_attrs(*work, *a)) ? 1 : 0);
+  SnapChildMapT::const_iterator it = work->children.begin();
+  for (; it != work->children.end(); ++it) {
+    const SnapNodeP *ac = NULL;
+    if (a) {
+      SnapChildMapT::const_iterator ai = a->children.find(it->first);
+      if (ai != a->children.end()) {
+        ac = &(ai->second);
+      }
+    }
+    num += _count_diff(it->second, ac);
+  }
+  if (a) {
+    // deleted
+    for (it = a->children.begin(); it != a->children.end(); ++it) {
+      if (work->children.find(it->first) == work->children.end()) {
+        num++;
+      }
+    }
+  }
+  return num;
+}
+
+
+////// config tree file
+/* file format:
+ *   <header> <record>*
+ *     record: <u32 len> <op> <path> <data>   (len: size excluding itself)
+ *       C_OP_TREE:   data is <node>. replace the subtree at <path>.
+ *       C_OP_ATTRS:  data is <attrs>. set attributes of the node at <path>
+ *                    (create it if necessary).
+ *       C_OP_DELETE: no data. delete the subtree at <path>.
+ *     path: <u32 num> <str>*num
+ *     str: <u32 len> <bytes>
+ *     attrs: <u32 flags> <str value> <str comment>
+ *     node: <attrs> <u32 num> (<str name> <node>)*num
+ * all integers are in host byte order since the file is local.
+ *
+ * a file is only modified by appending records, after which "end" in the
+ * header is updated. compaction writes the whole tree to a new file (as a
+ * single C_OP_TREE record), renames it over the old one, and then marks the
+ * old one "superseded". since each process maps the header (shared), it
+ * can check if its tree is up to date without any syscall. a new file is
+ * synced to disk before it is renamed/linked in place.
+ *
+ * writers hold an exclusive flock() on the file.
+ */
+struct SnapHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t superseded;
+  uint64_t end;
+  uint64_t snap_size;
+};
+
+class SnapWriter {
+public:
+  SnapWriter() : _buf(), _rec_start(0) {};
+
+  void putU32(uint32_t v) {
+    _buf.append((const char *) &v, sizeof(v));
+  };
+  void putStr(const string& s) {
+    putU32(s.size());
+    _buf.append(s);
+  };
+  void putAttrs(const SnapNode& n) {
+    putU32(n.flags);
+    putStr(n.value);
+    putStr(n.comment);
+  };
+  void putNode(const SnapNode& n);
+
+  void beginRecord(char op, const vector<string>& comps, size_t n);
+  void endRecord();
+
+  // convenience functions for complete records
+  void attrsRecord(const vector<string>& comps, size_t n,
+                   const SnapNode& node) {
+    beginRecord(C_OP_ATTRS, comps, n);
+    putAttrs(node);
+    endRecord();
+  };
+  void treeRecord(const vector<string>& comps, size_t n,
+                  const SnapNode& node) {
+    beginRecord(C_OP_TREE, comps, n);
+    putNode(node);
+    endRecord();
+  };
+  void deleteRecord(const vector<string>& comps, size_t n) {
+    beginRecord(C_OP_DELETE, comps, n);
+    endRecord();
+  };
+
+  const string& data() const { return _buf; };
+  bool empty() const { return _buf.empty(); };
+
+private:
+  string _buf;
+  size_t _rec_start;
+};
+
+void
+SnapWriter::putNode(const SnapNode& n)
+{
+  putAttrs(n);
+  putU32(n.children.size());
+  SnapChildMapT::const_iterator it = n.children.begin();
+  for (; it != n.children.end(); ++it) {
+    putStr(it->first);
+    putNode(*(it->second));
+  }
+}
+
+void
+SnapWriter::beginRecord(char op, const vector<string>& comps, size_t n)
+{
+  _rec_start = _buf.size();
+  putU32(0);
+  _buf += op;
+  putU32(n);
+  for (size_t i = 0; i < n; i++) {
+    putStr(comps[i]);
+  }
+}
+
+void
+SnapWriter::endRecord()
+{
+  uint32_t len = (_buf.size() - _rec_start - sizeof(uint32_t));
+  _buf.replace(_rec_start, sizeof(len), (const char *) &len, sizeof(len));
+}
+
+class SnapReader {
+public:
+  SnapReader(const char *data, size_t len) : _p(data), _end(data + len) {};
+
+  bool done() const { return (_p >= _end); };
+  bool getU32(uint32_t& v) {
+    if ((size_t) (_end - _p) < sizeof(v)) {
+      return false;
+    }
+    memcpy(&v, _p, sizeof(v));
+    _p += sizeof(v);
+    return true;
+  };
+  bool getStr(string& s) {
+    uint32_t len;
+    if (!getU32(len) || (size_t) (_end - _p) < len) {
+      return false;
+    }
+    s.assign(_p, len);
+    _p += len;
+    return true;
+  };
+  bool getAttrs(SnapNode& n) {
+    uint32_t f;
+    if (!getU32(f) || !getStr(n.value) || !getStr(n.comment)) {
+      return false;
+    }
+    n.flags = f;
+    return true;
+  };
+  bool getNode(SnapNodeP& n);
+  bool applyRecord(SnapNodeP& root);
+
+private:
+  const char *_p;
+  const char *_end;
+};
+
+bool
+SnapReader::getNode(SnapNodeP& n)
+{
+  n.reset(new SnapNode());
+  uint32_t num;
+  if (!getAttrs(*n) || !getU32(num)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < num; i++) {
+    string name;
+    SnapNodeP c;
+    if (!getStr(name) || !getNode(c)) {
+      return false;
+    }
+    n->children[name] = c;
+  }
+  return true;
+}
+
+// apply the next record to "root"
+bool
+SnapReader::applyRecord(SnapNodeP& root)
+{
+  uint32_t len, num;
+  if (!getU32(len) || (size_t) (_end - _p) < len || len < 1) {
+    return false;
+  }
+  SnapReader r(_p, len);
+  _p += len;
+
+  char op = *(r._p++);
+  vector<string> comps;
+  if (!r.getU32(num)) {
+    return false;
+  }
+  for (uint32_t i = 0; i < num; i++) {
+    string c;
+    if (!r.getStr(c)) {
+      return false;
+    }
+    comps.push_back(c);
+  }
+  switch (op) {
+  case C_OP_TREE: {
+    SnapNodeP n;
+    if (!r.getNode(n)) {
+      return false;
+    }
+    _put_subtree(root, comps, comps.size(), n);
+    break;
+  }
+  case C_OP_ATTRS: {
+    SnapNode a;
+    if (!r.getAttrs(a)) {
+      return false;
+    }
+    SnapNode *n = _get_mutable(root, comps, comps.size(), true);
+    n->flags = a.flags;
+    n->value = a.value;
+    n->comment = a.comment;
+    break;
+  }
+  case C_OP_DELETE:
+    _del_subtree(root, comps, comps.size());
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+/* the file storing a config tree and the in-memory tree. the tree is
+ * brought up to date by refresh() (for reading) and lock() (for
+ * modification).
+ */
+class SnapStore {
+public:
+  SnapStore(const string& file)
+    : _file(file), _fd(-1), _hdr(NULL), _pos(0), _locked(false),
+      _root() {};
+  ~SnapStore() { close_file(); };
+
+  const string& file() const { return _file; };
+  SnapNodeP& root() { return _root; };
+
+  /* bring the tree up to date with the file. return false if the file
+   * doesn't exist or is invalid.
+   */
+  bool refresh();
+
+  /* lock the file for modification and bring the tree up to date. if the
+   * file doesn't exist and "create", create it from the current tree.
+   */
+  bool lock(bool create);
+
+  // append the records (the tree has already been modified accordingly)
+  bool append(const SnapWriter& w);
+
+  /* release the lock. if "rewrite" or the log is large enough, compact the
+   * file first.
+   */
+  bool unlock(bool rewrite = false);
+
+  // remove the file (must be locked)
+  bool remove();
+
+private:
+  static const char C_MAGIC[8];
+  static const uint32_t C_VERSION = 1;
+  static const uint64_t C_COMPACT_MIN = 65536;
+
+  bool open_file(bool load);
+  void close_file();
+  bool replay(uint64_t from, uint64_t to);
+  bool write_file(const string& path, uint64_t& end, uint64_t& snap_size);
+  bool sync_dir();
+  bool set_superseded();
+
+  string _file;
+  int _fd;
+  volatile SnapHeader *_hdr;
+  uint64_t _pos;
+  bool _locked;
+  SnapNodeP _root;
+};
+
+const char SnapStore::C_MAGIC[8] = { 'V', 'Y', 'S', 'N', 'A', 'P', 0, 0 };
+
+bool
+SnapStore::open_file(bool load)
+{
+  if (_file.empty()) {
+    return false;
+  }
+  int fd = open(_file.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0 && errno == EACCES) {
+    // read-only access (e.g., operational mode)
+    fd = open(_file.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *m = MAP_FAILED;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapHeader)
+      || (m = mmap(NULL, sizeof(SnapHeader), PROT_READ, MAP_SHARED, fd, 0))
+         == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  _hdr = (volatile SnapHeader *) m;
+  _fd = fd;
+  if (memcmp((const char *) _hdr->magic, C_MAGIC, sizeof(C_MAGIC)) != 0
+      || _hdr->version != C_VERSION) {
+    close_file();
+    return false;
+  }
+  if (!load) {
+    _pos = _hdr->end;
+    return true;
+  }
+  _root.reset();
+  _pos = sizeof(SnapHeader);
+  return replay(_pos, _hdr->end);
+}
+
+void
+SnapStore::close_file()
+{
+  if (_hdr) {
+    munmap((void *) _hdr, sizeof(SnapHeader));
+    _hdr = NULL;
+  }
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  _pos = 0;
+  _locked = false;
+}
+
+bool
+SnapStore::replay(uint64_t from, uint64_t to)
+{
+  if (to <= from) {
+    return true;
+  }
+  string buf(to - from, 0);
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t n = pread(_fd, &(buf[done]), buf.size() - done, from + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  SnapReader r(buf.data(), buf.size());
+  while (!r.done()) {
+    if (!r.applyRecord(_root)) {
+      // corrupt
+      return false;
+    }
+  }
+  _pos = to;
+  return true;
+}
+
+bool
+SnapStore::refresh()
+{
+  if (_fd >= 0 && _hdr->superseded) {
+    close_file();
+  }
+  if (_fd < 0) {
+    return open_file(true);
+  }
+  uint64_t end = _hdr->end;
+  if (end > _pos) {
+    return replay(_pos, end);
+  }
+  return true;
+}
+
+// write the current tree to a new file at "path"
+bool
+SnapStore::write_file(const string& path, uint64_t& end, uint64_t& snap_size)
+{
+  SnapWriter w;
+  vector<string> comps;
+  SnapNode empty;
+  w.treeRecord(comps, 0, (_root ? *_root : empty));
+
+  SnapHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, C_MAGIC, sizeof(C_MAGIC));
+  hdr.version = C_VERSION;
+  hdr.snap_size = w.data().size();
+  hdr.end = sizeof(hdr) + hdr.snap_size;
+
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return false;
+  }
+  // must be on disk before it is renamed/linked over the old file
+  bool ret = (write(fd, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr)
+              && write(fd, w.data().data(), w.data().size())
+                 == (ssize_t) w.data().size()
+              && fsync(fd) == 0);
+  if (close(fd) != 0 || !ret) {
+    unlink(path.c_str());
+    return false;
+  }
+  end = hdr.end;
+  snap_size = hdr.snap_size;
+  return true;
+}
+
+// sync the dir containing the file (i.e., a rename/link of the file)
+bool
+SnapStore::sync_dir()
+{
+  string dir = _file.substr(0, _file.rfind('/') + 1);
+  int fd = open((dir.empty() ? "." : dir.c_str()),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ret = (fsync(fd) == 0);
+  close(fd);
+  return ret;
+}
+
+bool
+SnapStore::set_superseded()
+{
+  uint32_t s = 1;
+  return (pwrite(_fd, &s, sizeof(s), offsetof(SnapHeader, superseded))
+          == (ssize_t) sizeof(s));
+}
+
+bool
+SnapStore::lock(bool create)
+{
+  while (true) {
+    if (!refresh()) {
+      if (_fd >= 0 || !create) {
+        // invalid file, or doesn't exist
+        return false;
+      }
+      // create the file. link() fails if someone else created it first.
+      char sfx[32];
+      snprintf(sfx, sizeof(sfx), ".new.%d", getpid());
+      string tmp = _file + sfx;
+      uint64_t end, ssize;
+      unlink(tmp.c_str());
+      if (!write_file(tmp, end, ssize)) {
+        return false;
+      }
+      int r = link(tmp.c_str(), _file.c_str());
+      unlink(tmp.c_str());
+      if (r != 0 && errno != EEXIST) {
+        return false;
+      }
+      if (r == 0 && !sync_dir()) {
+        return false;
+      }
+      continue;
+    }
+    if (flock(_fd, LOCK_EX) != 0) {
+      return false;
+    }
+    struct stat fst, st;
+    if (!_hdr->superseded && fstat(_fd, &fst) == 0
+        && stat(_file.c_str(), &st) == 0 && fst.st_dev == st.st_dev
+        && fst.st_ino == st.st_ino) {
+      break;
+    }
+    /* compacted while waiting for the lock, or removed without being
+     * marked (see UnionfsCstore::commitConfig()) => retry with the new file
+     */
+    close_file();
+  }
+  _locked = true;
+  // catch up with any modification made before we got the lock
+  return refresh();
+}
+
+bool
+SnapStore::append(const SnapWriter& w)
+{
+  if (!_locked) {
+    return false;
+  }
+  if (w.empty()) {
+    return true;
+  }
+  const string& d = w.data();
+  uint64_t end = _hdr->end;
+  size_t done = 0;
+  while (done < d.size()) {
+    ssize_t n = pwrite(_fd, d.data() + done, d.size() - done, end + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  end += d.size();
+  if (pwrite(_fd, &end, sizeof(end), offsetof(SnapHeader, end))
+      != (ssize_t) sizeof(end)) {
+    return false;
+  }
+  _pos = end;
+  return true;
+}
+
+bool
+SnapStore::unlock(bool rewrite)
+{
+  if (!_locked) {
+    return false;
+  }
+  uint64_t log_size = (_hdr->end - sizeof(SnapHeader) - _hdr->snap_size);
+  if (!rewrite
+      && (log_size < C_COMPACT_MIN || log_size < _hdr->snap_size * 2)) {
+    _locked = false;
+    return (flock(_fd, LOCK_UN) == 0);
+  }
+
+  // compact: write new file, rename it over, and mark the old one
+  char sfx[32];
+  snprintf(sfx, sizeof(sfx), ".new.%d", getpid());
+  string tmp = _file + sfx;
+  uint64_t end, ssize;
+  unlink(tmp.c_str());
+  bool ret = false;
+  if (write_file(tmp, end, ssize)) {
+    if (rename(tmp.c_str(), _file.c_str()) == 0) {
+      ret = set_superseded();
+      if (!sync_dir()) {
+        ret = false;
+      }
+    } else {
+      unlink(tmp.c_str());
+    }
+  }
+  // closing the old file also releases the lock
+  close_file();
+  if (ret) {
+    // our tree is the content of the new file, so no need to reload
+    ret = open_file(false);
+  }
+  return ret;
+}
+
+bool
+SnapStore::remove()
+{
+  if (!_locked) {
+    return false;
+  }
+  bool ret = (unlink(_file.c_str()) == 0 && set_superseded());
+  close_file();
+  _root.reset();
+  return ret;
+}
+
+
+////// constructor/destructor
+SnapshotCstore::SnapshotCstore(bool use_edit_level)
+  : UnionfsCstore(use_edit_level), _active(NULL), _work(NULL),
+    _active_import(), _active_imported(false)
+{
+  init_stores();
+}
+
+SnapshotCstore::SnapshotCstore(const string& sid, string& env)
+  : UnionfsCstore(sid, env), _active(NULL), _work(NULL),
+    _active_import(), _active_imported(false)
+{
+  init_stores();
+  // make sure the whole session uses this store
+  env += (" { declare -x -r " + C_ENV_CSTORE_BACKEND + "="
+          + C_CSTORE_BACKEND_SNAPSHOT + "; } >&/dev/null || true");
+}
+
+SnapshotCstore::~SnapshotCstore()
+{
+  delete _active;
+  delete _work;
+}
+
+////// public virtual functions declared in base class
+bool
+SnapshotCstore::markSessionUnsaved()
+{
+  vector<string> comps;
+  return modify_attrs(false, comps, C_F_UNSAVED, 0);
+}
+
+bool
+SnapshotCstore::unmarkSessionUnsaved()
+{
+  vector<string> comps;
+  return modify_attrs(false, comps, 0, C_F_UNSAVED);
+}
+
+bool
+SnapshotCstore::sessionUnsaved()
+{
+  SnapNodeP& r = get_tree(false);
+  return (r && (r->flags & C_F_UNSAVED));
+}
+
+bool
+SnapshotCstore::sessionChanged()
+{
+  SnapNodeP& r = get_tree(false);
+  return (r && (r->flags & C_F_CHANGED));
+}
+
+/* set up the session associated with this object. the working config
+ * starts as the active config (shared).
+ */
+bool
+SnapshotCstore::setupSession()
+{
+  if (inSession()) {
+    return true;
+  }
+  try {
+    b_fs::create_directories(tmp_root.path_cstr());
+  } catch (...) {
+    output_internal("setup session failed to create session directories\n");
+    return false;
+  }
+  _work->root() = get_tree(true);
+  if (!_work->lock(true)) {
+    output_internal("setup session failed to create [%s]\n",
+                    _work->file().c_str());
+    return false;
+  }
+  return _work->unlock();
+}
+
+bool
+SnapshotCstore::teardownSession()
+{
+  if (!inSession()) {
+    output_internal("teardown invalid session [%s]\n",
+                    work_root.path_cstr());
+    return false;
+  }
+  if (!_work->lock(false) || !_work->remove()) {
+    output_internal("failed to remove session [%s]\n",
+                    _work->file().c_str());
+    return false;
+  }
+  bool ret = false;
+  try {
+    b_fs::remove_all(tmp_root.path_cstr());
+    ret = true;
+  } catch (...) {
+  }
+  if (!ret) {
+    output_internal("failed to remove session directories\n");
+  }
+  return ret;
+}
+
+bool
+SnapshotCstore::inSession()
+{
+  string wstr = work_root.path_cstr();
+  return (!wstr.empty() && wstr.find(C_DEF_WORK_PREFIX) == 0
+          && _work->refresh());
+}
+
+/* construct the new active config in "nroot" according to the commit
+ * results (same as the unionfs store but on the trees).
+ */
+bool
+SnapshotCstore::construct_commit_active(commit::PrioNode& node,
+                                        SnapNodeP& nroot,
+                                        const SnapNodeP& aroot,
+                                        const SnapNodeP& wroot)
+{
+  vector<string> comps;
+  {
+    #if __GNUC__ < 6
+    auto_ptr<SavePaths> save(create_save_paths());
+    #else
+    unique_ptr<SavePaths> save(create_save_paths());
+    #endif
+    reset_paths();
+    append_cfg_path(node.getCommitPath());
+    get_cfg_comps(comps);
+  }
+
+  size_t n = comps.size();
+  if (_find(nroot, comps, n)) {
+    _del_subtree(nroot, comps, n);
+    cnode::CfgNode *c = node.getCfgNode();
+    if (c && c->isTag() && n > 0) {
+      const SnapNodeP *p = _find(nroot, comps, n - 1);
+      if (p && (*p)->children.empty() && !(*p)->flags) {
+        _del_subtree(nroot, comps, n - 1);
+      }
+    }
+  }
+  if (node.succeeded()) {
+    // prio subtree succeeded
+    const SnapNodeP *wn = _find(wroot, comps, n);
+    if (wn) {
+      _put_subtree(nroot, comps, n,
+                   _without_flag(*wn, C_F_SESSION, true, true));
+    }
+    if (!node.hasSubtreeFailure()) {
+      // whole subtree succeeded => stop recursion
+      return true;
+    }
+  } else {
+    // prio subtree failed
+    const SnapNodeP *an = _find(aroot, comps, n);
+    if (an) {
+      _put_subtree(nroot, comps, n, *an);
+    }
+    if (!node.hasSubtreeSuccess()) {
+      // whole subtree failed => stop recursion
+      return true;
+    }
+  }
+  for (size_t i = 0; i < node.numChildNodes(); i++) {
+    if (!construct_commit_active(*(node.childAt(i)), nroot, aroot, wroot)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+SnapshotCstore::commitConfig(commit::PrioNode& node)
+{
+  /* holding the commit lock, so the active config dir doesn't change. make
+   * sure an import (if needed) is done now.
+   */
+  _active_imported = false;
+  get_tree(true);
+  if (!_work->lock(false)) {
+    output_internal("failed to lock working config\n");
+    return false;
+  }
+  if (!_active->lock(true)) {
+    output_internal("failed to lock active config\n");
+    _work->unlock();
+    return false;
+  }
+  SnapNodeP aroot = _active->root();
+  SnapNodeP wroot = _work->root();
+  SnapNodeP nroot;
+  if (!wroot || !construct_commit_active(node, nroot, aroot, wroot)) {
+    _active->unlock();
+    _work->unlock();
+    return false;
+  }
+  if (!nroot) {
+    nroot.reset(new SnapNode());
+  }
+
+  /* write the changes through to the active config dir. the active config
+   * tree file is removed first so that it is never newer or older than
+   * the dir, i.e., if this fails, the dir is imported again.
+   */
+  if (!_active->remove()
+      || !write_dir_changes(aroot.get(), *nroot, active_root.path_cstr())) {
+    output_internal("failed to write committed config to [%s]\n",
+                    active_root.path_cstr());
+    _work->unlock();
+    return false;
+  }
+
+  /* new working config is the same as before but with "changed" relative
+   * to the new active config.
+   */
+  bool changed;
+  _active->root() = nroot;
+  _work->root() = _resync(_without_flag(wroot, C_F_SESSION, true, true),
+                          &nroot, changed);
+  bool ret = (_active->lock(true) && _active->unlock());
+  if (!_work->unlock(true)) {
+    ret = false;
+  }
+  if (!ret) {
+    output_internal("failed to write committed config\n");
+  }
+  return ret;
+}
+
+/* write the changes from "o" (NULL if new) to "n" to the unionfs store's
+ * config dir "dir" (i.e., the reverse of import_dir()).
+ */
+bool
+SnapshotCstore::write_dir_changes(const SnapNode *o, const SnapNode& n,
+                                  const string& dir)
+{
+  if (o == &n) {
+    // shared => no change
+    return true;
+  }
+  SnapNode empty;
+  const SnapNode& on = (o ? *o : empty);
+  const unsigned int fl[] = { C_F_VALUE, C_F_COMMENT, C_F_DISPLAY_DEFAULT,
+                              C_F_DEACTIVATED, 0 };
+  const string *fnames[] = { &C_VAL_NAME, &C_COMMENT_FILE,
+                             &C_MARKER_DEF_VALUE, &C_MARKER_DEACTIVATE };
+  for (size_t i = 0; fl[i]; i++) {
+    bool ohas = (on.flags & fl[i]);
+    bool nhas = (n.flags & fl[i]);
+    string file = dir + "/" + *(fnames[i]);
+    const string *odata = NULL;
+    const string *ndata = NULL;
+    if (fl[i] == C_F_VALUE) {
+      odata = &on.value;
+      ndata = &n.value;
+    } else if (fl[i] == C_F_COMMENT) {
+      odata = &on.comment;
+      ndata = &n.comment;
+    }
+    if (nhas && (!ohas || (ndata && *ndata != *odata))) {
+      if (!write_file(file.c_str(), (ndata ? *ndata : string()))) {
+        return false;
+      }
+    } else if (!nhas && ohas && unlink(file.c_str()) != 0
+               && errno != ENOENT) {
+      return false;
+    }
+  }
+
+  try {
+    SnapChildMapT::const_iterator it = on.children.begin();
+    for (; it != on.children.end(); ++it) {
+      if (n.children.find(it->first) == n.children.end()) {
+        b_fs::remove_all((dir + "/" + it->first).c_str());
+      }
+    }
+    for (it = n.children.begin(); it != n.children.end(); ++it) {
+      string cdir = dir + "/" + it->first;
+      SnapChildMapT::const_iterator oc = on.children.find(it->first);
+      if (oc == on.children.end()) {
+        b_fs::create_directory(cdir.c_str());
+      }
+      if (!write_dir_changes((oc == on.children.end()
+                              ? NULL : oc->second.get()),
+                             *(it->second), cdir)) {
+        return false;
+      }
+    }
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+
+////// virtual functions defined in base class
+bool
+SnapshotCstore::cfg_node_exists(bool active_cfg)
+{
+  return (get_node(active_cfg) != NULL);
+}
+
+bool
+SnapshotCstore::add_node()
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  size_t n = comps.size();
+  bool ret = false;
+  if (lock_store(false)) {
+    SnapNodeP& root = _work->root();
+    if (n > 0 && !_find(root, comps, n) && _find(root, comps, n - 1)) {
+      SnapWriter w;
+      w.attrsRecord(comps, n, *_get_mutable(root, comps, n, true));
+      ret = _work->append(w);
+    }
+    _work->unlock();
+  }
+  if (!ret) {
+    output_internal("failed to add node [%s]\n", cfg_path_to_str().c_str());
+  }
+  return ret;
+}
+
+bool
+SnapshotCstore::remove_node()
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  size_t n = comps.size();
+  if (!lock_store(false)) {
+    return false;
+  }
+  bool ret = false;
+  if (!_find(_work->root(), comps, n)) {
+    output_internal("remove non-existent node [%s]\n",
+                    cfg_path_to_str().c_str());
+  } else {
+    SnapWriter w;
+    _del_subtree(_work->root(), comps, n);
+    w.deleteRecord(comps, n);
+    ret = _work->append(w);
+  }
+  _work->unlock();
+  return ret;
+}
+
+void
+SnapshotCstore::get_all_child_node_names_impl(vector<string>& cnodes,
+                                              bool active_cfg)
+{
+  const SnapNode *n = get_node(active_cfg);
+  if (!n) {
+    return;
+  }
+  SnapChildMapT::const_iterator it = n->children.begin();
+  for (; it != n->children.end(); ++it) {
+    cnodes.push_back(unescape_name(it->first));
+  }
+}
+
+bool
+SnapshotCstore::read_value_vec(vector<string>& vvec, bool active_cfg)
+{
+  const SnapNode *n = get_node(active_cfg);
+  if (!n || !(n->flags & C_F_VALUE)) {
+    return false;
+  }
+
+  // same format as the unionfs store's value file
+  split_values(n->value, vvec);
+  return true;
+}
+
+bool
+SnapshotCstore::write_value_vec(const vector<string>& vvec, bool active_cfg)
+{
+  string ostr = "";
+  for (size_t i = 0; i < vvec.size(); i++) {
+    if (i > 0) {
+      // subsequent values require delimiter
+      ostr += "\n";
+    }
+    ostr += vvec[i];
+  }
+  if (ostr.size() > C_UNIONFS_MAX_FILE_SIZE) {
+    output_internal("failed to write node value (too large) [%s]\n",
+                    cfg_path_to_str().c_str());
+    return false;
+  }
+
+  vector<string> comps;
+  get_cfg_comps(comps);
+  if (!modify_attrs(active_cfg, comps, 0, 0, &ostr)) {
+    output_internal("failed to write node value [%s]\n",
+                    cfg_path_to_str().c_str());
+    return false;
+  }
+  return true;
+}
+
+bool
+SnapshotCstore::rename_child_node(const char *oname, const char *nname)
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  size_t n = comps.size();
+  if (!lock_store(false)) {
+    return false;
+  }
+  SnapNodeP& root = _work->root();
+  const SnapNodeP *p = _find(root, comps, n);
+  bool ret = false;
+  if (p) {
+    SnapChildMapT::const_iterator oi = (*p)->children.find(oname);
+    if (oi != (*p)->children.end()
+        && (*p)->children.find(nname) == (*p)->children.end()) {
+      SnapNodeP c = oi->second;
+      SnapNode *m = _get_mutable(root, comps, n, false);
+      m->children.erase(oname);
+      m->children[nname] = c;
+
+      SnapWriter w;
+      comps.push_back(nname);
+      w.treeRecord(comps, n + 1, *c);
+      comps[n] = oname;
+      w.deleteRecord(comps, n + 1);
+      ret = _work->append(w);
+    }
+  }
+  _work->unlock();
+  if (!ret) {
+    output_internal("cannot rename node [%s,%s,%s]\n",
+                    cfg_path_to_str().c_str(), oname, nname);
+  }
+  return ret;
+}
+
+bool
+SnapshotCstore::copy_child_node(const char *oname, const char *nname)
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  size_t n = comps.size();
+  if (!lock_store(false)) {
+    return false;
+  }
+  SnapNodeP& root = _work->root();
+  const SnapNodeP *p = _find(root, comps, n);
+  bool ret = false;
+  if (p) {
+    SnapChildMapT::const_iterator oi = (*p)->children.find(oname);
+    if (oi != (*p)->children.end()
+        && (*p)->children.find(nname) == (*p)->children.end()) {
+      // the copy is simply shared
+      SnapNodeP c = oi->second;
+      _get_mutable(root, comps, n, false)->children[nname] = c;
+
+      SnapWriter w;
+      comps.push_back(nname);
+      w.treeRecord(comps, n + 1, *c);
+      ret = _work->append(w);
+    }
+  }
+  _work->unlock();
+  if (!ret) {
+    output_internal("cannot copy node [%s,%s,%s]\n",
+                    cfg_path_to_str().c_str(), oname, nname);
+  }
+  return ret;
+}
+
+bool
+SnapshotCstore::mark_display_default()
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  return modify_attrs(false, comps, C_F_DISPLAY_DEFAULT, 0);
+}
+
+bool
+SnapshotCstore::unmark_display_default()
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  return modify_attrs(false, comps, 0, C_F_DISPLAY_DEFAULT);
+}
+
+bool
+SnapshotCstore::marked_display_default(bool active_cfg)
+{
+  const SnapNode *n = get_node(active_cfg);
+  return (n && (n->flags & C_F_DISPLAY_DEFAULT));
+}
+
+bool
+SnapshotCstore::marked_deactivated(bool active_cfg)
+{
+  const SnapNode *n = get_node(active_cfg);
+  return (n && (n->flags & C_F_DEACTIVATED));
+}
+
+bool
+SnapshotCstore::mark_deactivated()
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  return modify_attrs(false, comps, C_F_DEACTIVATED, 0);
+}
+
+bool
+SnapshotCstore::unmark_deactivated()
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  return modify_attrs(false, comps, 0, C_F_DEACTIVATED);
+}
+
+bool
+SnapshotCstore::unmark_deactivated_descendants()
+{
+  return clear_subtree_flag(C_F_DEACTIVATED, false, false);
+}
+
+// mark current work path and all ancestors as "changed"
+bool
+SnapshotCstore::mark_changed_with_ancestors()
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  if (!lock_store(false)) {
+    return false;
+  }
+  SnapNodeP& root = _work->root();
+  SnapWriter w;
+  for (size_t i = comps.size() + 1; i > 0; i--) {
+    const SnapNodeP *p = _find(root, comps, i - 1);
+    if (!p) {
+      // don't do anything if the node is not there
+      continue;
+    }
+    if ((*p)->flags & C_F_CHANGED) {
+      // reached a node already marked => done
+      break;
+    }
+    SnapNode *m = _get_mutable(root, comps, i - 1, false);
+    m->flags |= C_F_CHANGED;
+    w.attrsRecord(comps, i - 1, *m);
+  }
+  bool ret = _work->append(w);
+  _work->unlock();
+  if (!ret) {
+    output_internal("failed to mark changed [%s]\n",
+                    cfg_path_to_str().c_str());
+  }
+  return ret;
+}
+
+/* remove all "changed" markers under the current work path. this is used,
+ * e.g., at the end of "commit" to reset a subtree.
+ */
+bool
+SnapshotCstore::unmark_changed_with_descendants()
+{
+  /* a node not marked "changed" cannot have any marked descendant (see
+   * mark_changed_with_ancestors()), so only marked nodes are visited.
+   */
+  return clear_subtree_flag(C_F_CHANGED, true, true);
+}
+
+// remove the comment at the current work path
+bool
+SnapshotCstore::remove_comment()
+{
+  const SnapNode *n = get_node(false);
+  if (!n || !(n->flags & C_F_COMMENT)) {
+    return false;
+  }
+  vector<string> comps;
+  get_cfg_comps(comps);
+  return modify_attrs(false, comps, 0, C_F_COMMENT);
+}
+
+// set comment at the current work path
+bool
+SnapshotCstore::set_comment(const string& comment)
+{
+  if (comment.size() > C_UNIONFS_MAX_FILE_SIZE) {
+    return false;
+  }
+  vector<string> comps;
+  get_cfg_comps(comps);
+  return modify_attrs(false, comps, 0, 0, NULL, &comment);
+}
+
+// discard all changes in working config
+bool
+SnapshotCstore::discard_changes(unsigned long long& num_removed)
+{
+  SnapNodeP aroot = get_tree(true);
+  if (!lock_store(false)) {
+    output_internal("discard failed [%s]\n", _work->file().c_str());
+    return false;
+  }
+  SnapNodeP& root = _work->root();
+  num_removed = (root ? _count_diff(root, &aroot) : 0);
+
+  // need to keep unsaved marker
+  bool unsaved = (root && (root->flags & C_F_UNSAVED));
+  root = aroot;
+  if (unsaved) {
+    vector<string> comps;
+    _get_mutable(root, comps, 0, true)->flags |= C_F_UNSAVED;
+    if (num_removed > 0) {
+      // the unsaved marker itself is not a change
+      num_removed--;
+    }
+  }
+  if (!_work->unlock(true)) {
+    output_internal("discard failed [%s]\n", _work->file().c_str());
+    return false;
+  }
+  return true;
+}
+
+// get comment at the current work or active path
+bool
+SnapshotCstore::get_comment(string& comment, bool active_cfg)
+{
+  const SnapNode *n = get_node(active_cfg);
+  if (!n || !(n->flags & C_F_COMMENT)) {
+    return false;
+  }
+  comment = n->comment;
+  return true;
+}
+
+bool
+SnapshotCstore::read_cfg_subtree(CfgRawNode& root, bool active_cfg,
+                                 bool recursive)
+{
+  const SnapNode *n = get_node(active_cfg);
+  if (!n) {
+    return false;
+  }
+  copy_raw_subtree(*n, root, recursive);
+  return true;
+}
+
+// whether current work path is "changed"
+bool
+SnapshotCstore::cfg_node_changed()
+{
+  const SnapNode *n = get_node(false);
+  return (n && (n->flags & C_F_CHANGED));
+}
+
+
+////// private functions
+void
+SnapshotCstore::init_stores()
+{
+  string wfile = work_root.path_cstr();
+  if (!wfile.empty()) {
+    wfile += C_SNAPSHOT_SUFFIX;
+  }
+  _active = new SnapStore(active_root.path_cstr() + C_SNAPSHOT_SUFFIX);
+  _work = new SnapStore(wfile);
+}
+
+/* return the (up-to-date) tree of the active or working config. if the
+ * active config has never been stored, it is imported from the unionfs
+ * store's active config dir (and stored by the next modification).
+ */
+SnapNodeP&
+SnapshotCstore::get_tree(bool active_cfg)
+{
+  SnapStore *s = get_store(active_cfg);
+  if (!s->refresh()) {
+    if (active_cfg) {
+      if (!_active_imported) {
+        _active_import.reset(new SnapNode());
+        import_dir(active_root.path_cstr(), *_active_import);
+        _active_imported = true;
+      }
+      s->root() = _active_import;
+    } else {
+      s->root().reset();
+    }
+  }
+  return s->root();
+}
+
+bool
+SnapshotCstore::lock_store(bool active_cfg)
+{
+  // make sure an imported active config is stored
+  get_tree(active_cfg);
+  SnapStore *s = get_store(active_cfg);
+  if (!s->lock(active_cfg)) {
+    output_internal("failed to lock config [%s]\n", s->file().c_str());
+    return false;
+  }
+  return true;
+}
+
+void
+SnapshotCstore::get_cfg_comps(vector<string>& comps)
+{
+  const char *p = mutable_cfg_path.path_cstr();
+  while (*p) {
+    const char *e = strchr(p, '/');
+    size_t len = (e ? (size_t) (e - p) : strlen(p));
+    if (len > 0) {
+      comps.push_back(string(p, len));
+    }
+    p += (e ? (len + 1) : len);
+  }
+}
+
+const SnapNode *
+SnapshotCstore::get_node(bool active_cfg)
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  const SnapNodeP *p = _find(get_tree(active_cfg), comps, comps.size());
+  return (p ? p->get() : NULL);
+}
+
+// copy the in-memory subtree "n" to "raw" (see read_cfg_subtree())
+void
+SnapshotCstore::copy_raw_subtree(const SnapNode& n, CfgRawNode& raw,
+                                 bool recursive)
+{
+  raw.deactivated = (n.flags & C_F_DEACTIVATED);
+  raw.is_default = (n.flags & C_F_DISPLAY_DEFAULT);
+  if (n.flags & C_F_VALUE) {
+    raw.has_value = true;
+    split_values(n.value, raw.values);
+  }
+  if (n.flags & C_F_COMMENT) {
+    raw.has_comment = true;
+    raw.comment = n.comment;
+  }
+  raw.children.resize(n.children.size());
+  size_t i = 0;
+  SnapChildMapT::const_iterator it = n.children.begin();
+  for (; it != n.children.end(); ++it, ++i) {
+    raw.children[i].name = unescape_name(it->first);
+    if (recursive) {
+      copy_raw_subtree(*(it->second), raw.children[i], true);
+    }
+  }
+}
+
+/* modify the attributes of the node at "comps". the node is created if
+ * necessary unless only clearing flags.
+ */
+bool
+SnapshotCstore::modify_attrs(bool active_cfg, const vector<string>& comps,
+                             unsigned int set, unsigned int clear,
+                             const string *value, const string *comment)
+{
+  if (!lock_store(active_cfg)) {
+    return false;
+  }
+  SnapStore *s = get_store(active_cfg);
+  size_t n = comps.size();
+  const SnapNodeP *p = _find(s->root(), comps, n);
+  if (!value && !comment
+      && (p ? (((*p)->flags & set) == set && !((*p)->flags & clear))
+            : !set)) {
+    // nothing to do
+    return s->unlock();
+  }
+  SnapNode *m = _get_mutable(s->root(), comps, n, true);
+  m->flags = ((m->flags | set) & ~clear);
+  if (value) {
+    m->flags |= C_F_VALUE;
+    m->value = *value;
+  }
+  if (comment) {
+    m->flags |= C_F_COMMENT;
+    m->comment = *comment;
+  } else if (clear & C_F_COMMENT) {
+    m->comment.clear();
+  }
+  SnapWriter w;
+  w.attrsRecord(comps, n, *m);
+  bool ret = s->append(w);
+  if (!s->unlock()) {
+    ret = false;
+  }
+  return ret;
+}
+
+// log the attribute changes between "o" and "n" (same structure)
+static void
+_log_attrs_diff(const SnapNodeP& o, const SnapNodeP& n,
+                vector<string>& comps, SnapWriter& w)
+{
+  if (o == n) {
+    return;
+  }
+  if (o->flags != n->flags) {
+    w.attrsRecord(comps, comps.size(), *n);
+  }
+  SnapChildMapT::const_iterator it = n->children.begin();
+  for (; it != n->children.end(); ++it) {
+    comps.push_back(it->first);
+    _log_attrs_diff(o->children.find(it->first)->second, it->second, comps,
+                    w);
+    comps.pop_back();
+  }
+}
+
+// clear a flag in the subtree at the current work path
+bool
+SnapshotCstore::clear_subtree_flag(unsigned int flag, bool self, bool prune)
+{
+  vector<string> comps;
+  get_cfg_comps(comps);
+  if (!lock_store(false)) {
+    return false;
+  }
+  SnapNodeP& root = _work->root();
+  const SnapNodeP *p = _find(root, comps, comps.size());
+  bool ret = true;
+  if (p) {
+    SnapNodeP o = *p;
+    SnapNodeP n = _without_flag(o, flag, self, prune);
+    if (n != o) {
+      SnapWriter w;
+      _put_subtree(root, comps, comps.size(), n);
+      _log_attrs_diff(o, n, comps, w);
+      ret = _work->append(w);
+    }
+  }
+  if (!_work->unlock()) {
+    ret = false;
+  }
+  if (!ret) {
+    output_internal("failed to clear markers [%s]\n",
+                    cfg_path_to_str().c_str());
+  }
+  return ret;
+}
+
+// import the unionfs store's config dir "dir" into "node"
+void
+SnapshotCstore::import_dir(const string& dir, SnapNode& node)
+{
+  DIR *dp = opendir(dir.c_str());
+  if (!dp) {
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(dp))) {
+    string name = de->d_name;
+    string path = dir + "/" + name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    if (name == C_VAL_NAME) {
+      if (read_whole_file(FsPath(path), node.value)) {
+        node.flags |= C_F_VALUE;
+      }
+    } else if (name == C_COMMENT_FILE) {
+      if (read_whole_file(FsPath(path), node.comment)) {
+        node.flags |= C_F_COMMENT;
+      }
+    } else if (name == C_MARKER_DEF_VALUE) {
+      node.flags |= C_F_DISPLAY_DEFAULT;
+    } else if (name == C_MARKER_DEACTIVATE) {
+      node.flags |= C_F_DEACTIVATED;
+    } else if (name[0] != '.' && path_is_directory(path.c_str())) {
+      SnapNodeP c(new SnapNode());
+      import_dir(path, *c);
+      node.children[name] = c;
+    }
+  }
+  closedir(dp);
+}
+
+} // end namespace snapshot
+} // end namespace cstore
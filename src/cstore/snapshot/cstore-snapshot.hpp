@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CSTORE_SNAPSHOT_H_
+#define _CSTORE_SNAPSHOT_H_
+#include <vector>
+#include <string>
+#include <tr1/memory>
+
+#include <cstore/cstore.hpp>
+#include <cstore/unionfs/cstore-unionfs.hpp>
+
+namespace cstore { // begin namespace cstore
+namespace snapshot { // begin namespace snapshot
+
+using unionfs::FsPath;
+namespace b_fs = boost::filesystem;
+
+// config tree node and the file storing a tree (see cstore-snapshot.cpp)
+struct SnapNode;
+class SnapStore;
+typedef tr1::shared_ptr<SnapNode> SnapNodeP;
+
+/* "snapshot" config store.
+ *
+ * the active and working configs are kept as immutable, structurally
+ * shared in-memory trees (i.e., copy-on-write along the modified path), so
+ * config operations do not touch the filesystem for each node. each tree
+ * is persisted to a single file containing a snapshot followed by an
+ * append-only log of modifications. the file is compacted (i.e., rewritten
+ * as a single snapshot) when the log becomes too large.
+ *
+ * the template tree, the path handling, and the commit lock/markers are
+ * the same as the unionfs store, so this only replaces the config storage.
+ *
+ * the active config dir of the unionfs store remains authoritative since
+ * everything else (other processes, scripts, etc.) reads it. the active
+ * config tree file is only a copy: a commit writes the changes through to
+ * the active config dir, and a unionfs store commit removes the file, in
+ * which case the active config is imported from the dir again.
+ */
+class SnapshotCstore : public unionfs::UnionfsCstore {
+public:
+  SnapshotCstore(bool use_edit_level);
+  SnapshotCstore(const string& session_id, string& env);
+  virtual ~SnapshotCstore();
+
+  ////// public virtual functions declared in base class
+  bool markSessionUnsaved();
+  bool unmarkSessionUnsaved();
+  bool sessionUnsaved();
+  bool sessionChanged();
+  bool setupSession();
+  bool teardownSession();
+  bool inSession();
+  bool commitConfig(commit::PrioNode& pnode);
+
+private:
+  SnapStore *_active;
+  SnapStore *_work;
+  SnapNodeP _active_import;
+  bool _active_imported;
+
+  void init_stores();
+  SnapStore *get_store(bool active_cfg) {
+    return (active_cfg ? _active : _work);
+  };
+  SnapNodeP& get_tree(bool active_cfg);
+  bool lock_store(bool active_cfg);
+  void get_cfg_comps(vector<string>& comps);
+  const SnapNode *get_node(bool active_cfg);
+  bool modify_attrs(bool active_cfg, const vector<string>& comps,
+                    unsigned int set, unsigned int clear,
+                    const string *value = NULL,
+                    const string *comment = NULL);
+  bool clear_subtree_flag(unsigned int flag, bool self, bool prune);
+  void import_dir(const string& dir, SnapNode& node);
+  void copy_raw_subtree(const SnapNode& n, CfgRawNode& raw, bool recursive);
+  bool construct_commit_active(commit::PrioNode& node, SnapNodeP& nroot,
+                               const SnapNodeP& aroot,
+                               const SnapNodeP& wroot);
+  bool write_dir_changes(const SnapNode *o, const SnapNode& n,
+                         const string& dir);
+
+  ////// virtual functions defined in base class
+  // these operate on current work path
+  bool add_node();
+  bool remove_node();
+  void get_all_child_node_names_impl(vector<string>& cnodes, bool active_cfg);
+  bool write_value_vec(const vector<string>& vvec, bool active_cfg);
+  bool rename_child_node(const char *oname, const char *nname);
+  bool copy_child_node(const char *oname, const char *nname);
+  bool mark_display_default();
+  bool unmark_display_default();
+  bool mark_deactivated();
+  bool unmark_deactivated();
+  bool unmark_deactivated_descendants();
+  bool mark_changed_with_ancestors();
+  bool unmark_changed_with_descendants();
+  bool remove_comment();
+  bool set_comment(const string& comment);
+  bool discard_changes(unsigned long long& num_removed);
+
+  // observers for work path
+  bool cfg_node_changed();
+
+  // observers for work path or active path
+  bool cfg_node_exists(bool active_cfg);
+  bool read_value_vec(vector<string>& vvec, bool active_cfg);
+  bool marked_deactivated(bool active_cfg);
+  bool get_comment(string& comment, bool active_cfg);
+  bool marked_display_default(bool active_cfg);
+  bool read_cfg_subtree(CfgRawNode& root, bool active_cfg, bool recursive);
+};
+
+} // end namespace snapshot
+} // end namespace cstore
+
+#endif /* _CSTORE_SNAPSHOT_H_ */
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cstore/unionfs/commit-markers.hpp>
+
+namespace cstore { // begin namespace cstore
+namespace unionfs { // begin namespace unionfs
+
+////// constants
+const char CommitMarkers::C_MAGIC[8] = { 'V', 'Y', 'C', 'M', 'A', 'R', 'K', 'X' };
+
+static const char *C_IDX_SUFFIX = ".idx";
+static const char *C_LOCK_SUFFIX = ".lock";
+static const char *C_TMP_SUFFIX = ".tmp";
+
+
+////// static
+/* exclusive lock on the lock file (released on destruction). the lock
+ * file is removed by clear() with the lock held, so retry if the file
+ * locked is no longer the one at the path.
+ */
+class MarkerLock {
+public:
+  MarkerLock(const string& file) {
+    while (true) {
+      _fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+      if (_fd < 0) {
+        return;
+      }
+      struct stat fst, pst;
+      if (flock(_fd, LOCK_EX) != 0 || fstat(_fd, &fst) != 0) {
+        close(_fd);
+        _fd = -1;
+        return;
+      }
+      if (stat(file.c_str(), &pst) == 0 && pst.st_dev == fst.st_dev
+          && pst.st_ino == fst.st_ino) {
+        return;
+      }
+      close(_fd);
+    }
+  };
+  ~MarkerLock() {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  };
+  bool locked() const { return (_fd >= 0); };
+
+private:
+  int _fd;
+};
+
+
+////// constructor/destructor
+CommitMarkers::CommitMarkers(const string& file)
+  : _file(file), _idx_file(file + C_IDX_SUFFIX),
+    _lock_file(file + C_LOCK_SUFFIX), _base(NULL), _len(0),
+    _writable(false), _mfd(-1)
+{
+}
+
+CommitMarkers::~CommitMarkers()
+{
+  unmap();
+}
+
+
+////// public functions
+bool
+CommitMarkers::find(const string& marker)
+{
+  if (!map_current(false)) {
+    // no table (e.g., marker file written without one)
+    return find_in_file(marker);
+  }
+  return find_in_table(marker, hash_str(marker));
+}
+
+bool
+CommitMarkers::add(const string& marker)
+{
+  MarkerLock l(_lock_file);
+  if (!l.locked()) {
+    return false;
+  }
+  if (!map_current(true) && !rebuild_table()) {
+    return false;
+  }
+  uint64_t h = hash_str(marker);
+  if (find_in_table(marker, h)) {
+    // already marked
+    return true;
+  }
+
+  // append to the marker file
+  int fd = open(_file.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  string line = marker + "\n";
+  bool ret = (fstat(fd, &st) == 0
+              && write(fd, line.data(), line.length())
+                 == static_cast<ssize_t>(line.length()));
+  close(fd);
+  if (!ret) {
+    return false;
+  }
+  if (_mfd < 0) {
+    // marker file just created
+    _mfd = open(_file.c_str(), O_RDONLY);
+  }
+
+  // then to the table
+  Header *hdr = header();
+  if ((hdr->num_entries + 1) * 2 > hdr->num_slots) {
+    // full. the new table includes the new marker.
+    return rebuild_table();
+  }
+  insert_slot(slots(), hdr->num_slots, h, st.st_size);
+  ++(hdr->num_entries);
+  return true;
+}
+
+bool
+CommitMarkers::clear()
+{
+  MarkerLock l(_lock_file);
+  if (!l.locked()) {
+    return false;
+  }
+  if (map_current(true)) {
+    // processes that have it mapped should not see the old markers
+    __atomic_store_n(&(header()->stale), 1, __ATOMIC_RELEASE);
+  }
+  unmap();
+  bool ret = true;
+  if (unlink(_idx_file.c_str()) != 0 && errno != ENOENT) {
+    ret = false;
+  }
+  if (unlink(_file.c_str()) != 0 && errno != ENOENT) {
+    ret = false;
+  }
+  // last since it is still locked
+  if (unlink(_lock_file.c_str()) != 0 && errno != ENOENT) {
+    ret = false;
+  }
+  return ret;
+}
+
+
+////// private functions
+// FNV-1a (0 is reserved for empty slots)
+uint64_t
+CommitMarkers::hash_str(const string& str)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < str.length(); i++) {
+    h ^= (unsigned char) str[i];
+    h *= 1099511628211ULL;
+  }
+  return (h ? h : 1);
+}
+
+void
+CommitMarkers::insert_slot(Slot *s, uint64_t num_slots, uint64_t h,
+                           uint64_t off)
+{
+  uint64_t i = (h & (num_slots - 1));
+  while (s[i].hash != 0) {
+    i = ((i + 1) & (num_slots - 1));
+  }
+  s[i].off = off;
+  // readers don't take the lock, so publish the hash last
+  __atomic_store_n(&(s[i].hash), h, __ATOMIC_RELEASE);
+}
+
+bool
+CommitMarkers::map(bool writable)
+{
+  int fd = open(_idx_file.c_str(), (writable ? O_RDWR : O_RDONLY));
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0
+      && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+    base = mmap(NULL, st.st_size,
+                (PROT_READ | (writable ? PROT_WRITE : 0)), MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    return false;
+  }
+  _base = static_cast<char *>(base);
+  _len = st.st_size;
+  Header *hdr = header();
+  if (memcmp(hdr->magic, C_MAGIC, sizeof(C_MAGIC)) != 0
+      || hdr->version != C_VERSION
+      || _len != (sizeof(Header) + hdr->num_slots * sizeof(Slot))) {
+    unmap();
+    return false;
+  }
+  _writable = writable;
+  _mfd = open(_file.c_str(), O_RDONLY);
+  return true;
+}
+
+void
+CommitMarkers::unmap()
+{
+  if (_base) {
+    munmap(_base, _len);
+    _base = NULL;
+    _len = 0;
+  }
+  if (_mfd >= 0) {
+    close(_mfd);
+    _mfd = -1;
+  }
+  _writable = false;
+}
+
+// make sure the current table is mapped (writable if specified)
+bool
+CommitMarkers::map_current(bool writable)
+{
+  if (_base && (_writable || !writable)
+      && __atomic_load_n(&(header()->stale), __ATOMIC_ACQUIRE) == 0) {
+    return true;
+  }
+  unmap();
+  return map(writable);
+}
+
+bool
+CommitMarkers::find_in_table(const string& marker, uint64_t h)
+{
+  uint64_t n = header()->num_slots;
+  const Slot *s = slots();
+  vector<char> buf(marker.length() + 1);
+  for (uint64_t i = (h & (n - 1)); ; i = ((i + 1) & (n - 1))) {
+    uint64_t sh = __atomic_load_n(&(s[i].hash), __ATOMIC_ACQUIRE);
+    if (sh == 0) {
+      return false;
+    }
+    if (sh != h) {
+      continue;
+    }
+    if (_mfd < 0) {
+      /* the table was mapped before the marker file was created (add()
+       * builds the first table before appending)
+       */
+      _mfd = open(_file.c_str(), O_RDONLY);
+      if (_mfd < 0) {
+        continue;
+      }
+    }
+    // confirm with the marker file
+    if (pread(_mfd, &(buf[0]), buf.size(), s[i].off)
+          == static_cast<ssize_t>(buf.size())
+        && memcmp(&(buf[0]), marker.data(), marker.length()) == 0
+        && buf[marker.length()] == '\n') {
+      return true;
+    }
+  }
+}
+
+bool
+CommitMarkers::find_in_file(const string& marker)
+{
+  bool ret = false;
+  try {
+    std::ifstream fin(_file.c_str());
+    while (!fin.eof() && !fin.bad() && !fin.fail()) {
+      string in;
+      getline(fin, in);
+      if (in == marker) {
+        ret = true;
+        break;
+      }
+    }
+    fin.close();
+  } catch (...) {
+    ret = false;
+  }
+  return ret;
+}
+
+/* build a new table from the marker file (which is the authoritative copy)
+ * and switch to it. this is used both for the initial table and when the
+ * table is full, so the cost is amortized over the added markers.
+ * note: must be called with the lock held.
+ */
+bool
+CommitMarkers::rebuild_table()
+{
+  vector<uint64_t> hashes;
+  vector<uint64_t> offs;
+  {
+    std::ifstream fin(_file.c_str());
+    uint64_t off = 0;
+    string in;
+    while (getline(fin, in)) {
+      if (fin.eof()) {
+        // incomplete line
+        break;
+      }
+      hashes.push_back(hash_str(in));
+      offs.push_back(off);
+      off += (in.length() + 1);
+    }
+  }
+
+  uint64_t num_slots = C_MIN_SLOTS;
+  while (num_slots < (hashes.size() * 4)) {
+    num_slots *= 2;
+  }
+  size_t len = (sizeof(Header) + num_slots * sizeof(Slot));
+  string tmp = _idx_file + C_TMP_SUFFIX;
+  int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return false;
+  }
+  void *base = MAP_FAILED;
+  if (ftruncate(fd, len) == 0) {
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  Header *hdr = static_cast<Header *>(base);
+  memcpy(hdr->magic, C_MAGIC, sizeof(C_MAGIC));
+  hdr->version = C_VERSION;
+  hdr->stale = 0;
+  hdr->num_slots = num_slots;
+  hdr->num_entries = hashes.size();
+  Slot *s = reinterpret_cast<Slot *>(static_cast<char *>(base)
+                                     + sizeof(Header));
+  for (size_t i = 0; i < hashes.size(); i++) {
+    insert_slot(s, num_slots, hashes[i], offs[i]);
+  }
+  munmap(base, len);
+  if (rename(tmp.c_str(), _idx_file.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+
+  // switch to the new table
+  if (_base) {
+    __atomic_store_n(&(header()->stale), 1, __ATOMIC_RELEASE);
+  }
+  unmap();
+  return map(true);
+}
+
+} // end namespace unionfs
+} // end namespace cstore
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMMIT_MARKERS_HPP_
+#define _COMMIT_MARKERS_HPP_
+#include <string>
+
+#include <stdint.h>
+
+namespace cstore { // begin namespace cstore
+namespace unionfs { // begin namespace unionfs
+
+using namespace std;
+
+/* store of the "committed" markers of a commit.
+ *
+ * the markers are kept in the marker file (one per line, as before), which
+ * is only ever appended to. in addition, "<marker file>.idx" is an open
+ * addressing hash table of (hash, file offset) for all markers in the
+ * file, so a lookup is a probe in the table plus one read to confirm the
+ * marker at the offset instead of a scan of the whole file.
+ *
+ * the table is memory-mapped shared, so processes started during the
+ * commit (e.g., action scripts querying "effective" status) and forked
+ * commit workers see the markers as they are added. any number of
+ * processes can add markers (serialized by "<marker file>.lock"). when the
+ * table is full, it is replaced by a larger one and the old one is marked
+ * stale so that processes that have it mapped switch to the new one.
+ */
+class CommitMarkers {
+public:
+  CommitMarkers(const string& file);
+  ~CommitMarkers();
+
+  // whether the specified marker is in the store
+  bool find(const string& marker);
+  // add the specified marker. return true if successful.
+  bool add(const string& marker);
+  // remove all markers (and the lock file). return true if successful.
+  bool clear();
+
+private:
+  // file format
+  static const char C_MAGIC[8];
+  static const uint32_t C_VERSION = 1;
+  static const uint64_t C_MIN_SLOTS = 1024;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t stale;
+    uint64_t num_slots;
+    uint64_t num_entries;
+  };
+
+  // hash 0 means empty slot. "off" is the offset of the marker line.
+  struct Slot {
+    uint64_t hash;
+    uint64_t off;
+  };
+
+  string _file;
+  string _idx_file;
+  string _lock_file;
+
+  // current mapping of the table (and the marker file for reading)
+  char *_base;
+  size_t _len;
+  bool _writable;
+  int _mfd;
+
+  static uint64_t hash_str(const string& str);
+  static void insert_slot(Slot *s, uint64_t num_slots, uint64_t h,
+                          uint64_t off);
+
+  Header *header() const { return reinterpret_cast<Header *>(_base); };
+  Slot *slots() const {
+    return reinterpret_cast<Slot *>(_base + sizeof(Header));
+  };
+  bool map(bool writable);
+  void unmap();
+  bool map_current(bool writable);
+  bool find_in_table(const string& marker, uint64_t h);
+  bool find_in_file(const string& marker);
+  bool rebuild_table();
+};
+
+} // end namespace unionfs
+} // end namespace cstore
+
+#endif /* _COMMIT_MARKERS_HPP_ */
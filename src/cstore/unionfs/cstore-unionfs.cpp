@@ -26,15 +26,30 @@
 #include <sys/mount.h>
 #include <wait.h>
 #include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <sys/file.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include <cli_cstore.h>
 #include <cstore/unionfs/cstore-unionfs.hpp>
+#include <cstore/unionfs/tmpl-index.hpp>
+#include <cstore/work-pool.hpp>
 #include <cnode/cnode.hpp>
 #include <commit/commit-algorithm.hpp>
 
+// from linux/fs.h, which conflicts with sys/mount.h
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+// from linux/magic.h
+#ifndef OVERLAYFS_SUPER_MAGIC
+#define OVERLAYFS_SUPER_MAGIC 0x794c7630
+#endif
+
 namespace cstore { // begin namespace cstore
 namespace unionfs { // begin namespace unionfs
 
@@ -61,6 +76,12 @@ const string UnionfsCstore::C_DEF_WORK_PREFIX
 const string UnionfsCstore::C_DEF_TMP_PREFIX
   = UnionfsCstore::C_DEF_CFG_ROOT + "/tmp/tmp_";
 
+// union mount type
+const string UnionfsCstore::C_ENV_UNION_MOUNT = "VYATTA_UNION_MOUNT";
+const string UnionfsCstore::C_UNION_MOUNT_OVERLAY = "overlay";
+const string UnionfsCstore::C_OVERLAY_WORK_DIR = ".overlay-work";
+const string UnionfsCstore::C_MOUNT_LOCK_FILE = ".mount.lock";
+
 // markers
 const string UnionfsCstore::C_MARKER_DEF_VALUE  = "def";
 const string UnionfsCstore::C_MARKER_DEACTIVATE = ".disable";
@@ -73,6 +94,7 @@ const string UnionfsCstore::C_TAG_NAME = "node.tag";
 const string UnionfsCstore::C_VAL_NAME = "node.val";
 const string UnionfsCstore::C_DEF_NAME = "node.def";
 const string UnionfsCstore::C_COMMIT_LOCK_FILE = "/opt/vyatta/config/.lock";
+const string UnionfsCstore::C_SNAPSHOT_SUFFIX = ".snap";
 
 pid_t pid;
 int status;
@@ -82,7 +104,7 @@ int commpipe[2];
 static MapT<char, string> _fs_escape_chars;
 static MapT<string, char> _fs_unescape_chars;
 static void
-_init_fs_escape_chars()
+_do_init_fs_escape_chars()
 {
   _fs_escape_chars[-1] = "\%\%\%";
   _fs_escape_chars['%'] = "\%25";
@@ -93,6 +115,14 @@ _init_fs_escape_chars()
   _fs_unescape_chars["\%2F"] = '/';
 }
 
+// the maps are read without locking, so only initialize once
+static void
+_init_fs_escape_chars()
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, _do_init_fs_escape_chars);
+}
+
 static string
 _escape_char(char c)
 {
@@ -104,42 +134,54 @@ _escape_char(char c)
   }
 }
 
-static MapT<string, string> _escape_path_name_cache;
+// the caches are keyed by the interned names (see Intern)
+typedef MapT<const string *, string, Intern::Hash> NameCacheT;
+
+static NameCacheT _escape_path_name_cache;
+static RwLock _escape_path_name_lock;
 
 static string
-_escape_path_name(const string& path)
+_escape_path_name(const string *ipath)
 {
-  MapT<string, string>::iterator p
-    = _escape_path_name_cache.find(path);
-  if (p != _escape_path_name_cache.end()) {
-    // found escaped string in cache. just return it.
-    return p->second;
+  {
+    RwLock::Read l(_escape_path_name_lock);
+    NameCacheT::iterator p = _escape_path_name_cache.find(ipath);
+    if (p != _escape_path_name_cache.end()) {
+      // found escaped string in cache. just return it.
+      return p->second;
+    }
   }
 
   // special case for empty string
-  string npath = (path.size() == 0) ? _fs_escape_chars[-1] : "";
+  const string& path = *ipath;
+  string npath = (path.size() == 0) ? _fs_escape_chars.find(-1)->second : "";
   for (size_t i = 0; i < path.size(); i++) {
     npath += _escape_char(path[i]);
   }
 
   // cache it before return
-  _escape_path_name_cache[path] = npath;
+  RwLock::Write l(_escape_path_name_lock);
+  _escape_path_name_cache[ipath] = npath;
   return npath;
 }
 
-static MapT<string, string> _unescape_path_name_cache;
+static NameCacheT _unescape_path_name_cache;
+static RwLock _unescape_path_name_lock;
 
 static string
-_unescape_path_name(const string& path)
+_unescape_path_name(const string *ipath)
 {
-  MapT<string, string>::iterator p
-    = _unescape_path_name_cache.find(path);
-  if (p != _unescape_path_name_cache.end()) {
-    // found unescaped string in cache. just return it.
-    return p->second;
+  {
+    RwLock::Read l(_unescape_path_name_lock);
+    NameCacheT::iterator p = _unescape_path_name_cache.find(ipath);
+    if (p != _unescape_path_name_cache.end()) {
+      // found unescaped string in cache. just return it.
+      return p->second;
+    }
   }
 
   // assume all escape patterns are 3-char
+  const string& path = *ipath;
   string npath = "";
   for (size_t i = 0; i < path.size(); i++) {
     if ((path.size() - i) < 3) {
@@ -155,7 +197,7 @@ _unescape_path_name(const string& path)
         npath = "";
         break;
       }
-      npath += string(1, _fs_unescape_chars[s]);
+      npath += string(1, c);
       // skip the escape sequence
       i += 2;
     } else {
@@ -163,10 +205,77 @@ _unescape_path_name(const string& path)
     }
   }
   // cache it before return
-  _unescape_path_name_cache[path] = npath;
+  RwLock::Write l(_unescape_path_name_lock);
+  _unescape_path_name_cache[ipath] = npath;
   return npath;
 }
 
+/* reads the entries of a directory with getdents64() (skipping "." and
+ * "..") without allocating anything per entry.
+ */
+class DirEntryReader {
+public:
+  DirEntryReader(int dfd)
+    : _dfd(dfd), _len(0), _off(0), _failed(false), _errno(0) {};
+
+  // return the next entry, or NULL if no more (or error)
+  const struct dirent64 *next() {
+    while (1) {
+      if (_off >= _len) {
+        long n = syscall(SYS_getdents64, _dfd, _buf, sizeof(_buf));
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n <= 0) {
+          _failed = (n < 0);
+          _errno = (n < 0 ? errno : 0);
+          return NULL;
+        }
+        _len = n;
+        _off = 0;
+      }
+      const struct dirent64 *d
+        = reinterpret_cast<const struct dirent64 *>(_buf + _off);
+      _off += d->d_reclen;
+      const char *name = d->d_name;
+      if (!(name[0] == '.' && (name[1] == 0
+                               || (name[1] == '.' && name[2] == 0)))) {
+        return d;
+      }
+    }
+  };
+
+  /* get the type of the entry. this is only a stat if the filesystem
+   * doesn't provide it (or it's a symlink, which is followed). return
+   * false if the entry cannot be stat'ed.
+   */
+  bool type(const struct dirent64 *d, unsigned char& t) {
+    t = d->d_type;
+    if (t == DT_UNKNOWN || t == DT_LNK) {
+      struct stat st;
+      if (fstatat(_dfd, d->d_name, &st, 0) != 0) {
+        t = DT_UNKNOWN;
+        return false;
+      }
+      t = (S_ISDIR(st.st_mode) ? DT_DIR
+           : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN));
+    }
+    return true;
+  };
+
+  bool failed() const { return _failed; };
+  // errno of the failure
+  int error() const { return _errno; };
+
+private:
+  int _dfd;
+  char _buf[16384];
+  long _len;
+  long _off;
+  bool _failed;
+  int _errno;
+};
+
 // Fall-through for Boost's filesystem::copy_file "complexity"
 void stream_file( const char* srce_file, const char* dest_file )
 {
@@ -226,6 +335,7 @@ vector<int> getActiveCommits()
  *       valid.
  */
 UnionfsCstore::UnionfsCstore(bool use_edit_level)
+  : mount_lock_fd(-1)
 {
   // set up root dir strings
   char *val;
@@ -291,7 +401,7 @@ UnionfsCstore::UnionfsCstore(bool use_edit_level)
  *       explicit session setup/teardown functions as needed.
  */
 UnionfsCstore::UnionfsCstore(const string& sid, string& env)
-  : Cstore(env)
+  : Cstore(env), mount_lock_fd(-1)
 {
   tmpl_root = C_DEF_TMPL_ROOT;
   tmpl_path = tmpl_root;
@@ -328,6 +438,18 @@ UnionfsCstore::UnionfsCstore(const string& sid, string& env)
 
 UnionfsCstore::~UnionfsCstore()
 {
+  unlock_session_mounts();
+}
+
+void
+UnionfsCstore::clearNameCaches()
+{
+  {
+    RwLock::Write l(_escape_path_name_lock);
+    _escape_path_name_cache.clear();
+  }
+  RwLock::Write l(_unescape_path_name_lock);
+  _unescape_path_name_cache.clear();
 }
 
 ////// public virtual functions declared in base class
@@ -428,6 +550,11 @@ UnionfsCstore::setupSession()
 
     // union mount
     if (!do_mount(change_root, active_root, work_root)) {
+      // don't leave an unmounted session behind
+      b_s::error_code ec;
+      b_fs::remove_all(work_root.path_cstr(), ec);
+      b_fs::remove_all(change_root.path_cstr(), ec);
+      b_fs::remove_all(tmp_root.path_cstr(), ec);
       return false;
     }
   } else if (!path_is_directory(work_root)) {
@@ -474,6 +601,8 @@ UnionfsCstore::setupSession()
       }
     }
   }
+  // nothing is re-mounted
+  unlock_session_mounts();
 
   if (!old_pids.empty()) {
     for (size_t i = 0; i < directories.size(); i++) {
@@ -520,7 +649,9 @@ UnionfsCstore::teardownSession()
   }
 
   // unmount the work root (union)
-  if (!do_umount(work_root)) {
+  bool umounted = do_umount(work_root);
+  unlock_session_mounts();
+  if (!umounted) {
     return false;
   }
 
@@ -555,9 +686,7 @@ UnionfsCstore::inSession()
 bool
 UnionfsCstore::clearCommittedMarkers()
 {
-  try {
-    b_fs::remove(commit_marker_file.path_cstr());
-  } catch (...) {
+  if (!commit_markers->clear()) {
     output_internal("failed to clear committed markers\n");
     return false;
   }
@@ -687,18 +816,22 @@ UnionfsCstore::sync_dir(const FsPath& src, const FsPath& dst,
                 src.path_cstr(), dst.path_cstr());
     return false;
   }
-  MapT<string, bool> smap;
+  // entry types come with the listing, so no stat for each entry
+  MapT<string, unsigned char> smap;
   MapT<string, bool> dmap;
   vector<string> sentries;
   vector<string> dentries;
-  check_dir_entries(src, &sentries, false);
-  check_dir_entries(dst, &dentries, false);
+  vector<unsigned char> stypes;
+  vector<unsigned char> dtypes;
+  check_dir_entries(src, &sentries, false, false, &stypes);
+  check_dir_entries(dst, &dentries, false, false, &dtypes);
   for (size_t i = 0; i < sentries.size(); i++) {
-    smap[sentries[i]] = true;
+    smap[sentries[i]] = stypes[i];
   }
   for (size_t i = 0; i < dentries.size(); i++) {
     dmap[dentries[i]] = true;
-    if (smap.find(dentries[i]) == smap.end()) {
+    MapT<string, unsigned char>::iterator sp = smap.find(dentries[i]);
+    if (sp == smap.end()) {
       // entry in dst but not in src => delete
       FsPath d(dst);
       if (!mark_dir_changed(d, root)) {
@@ -714,7 +847,7 @@ UnionfsCstore::sync_dir(const FsPath& src, const FsPath& dst,
       FsPath d(dst);
       push_path(s, dentries[i].c_str());
       push_path(d, dentries[i].c_str());
-      if (path_is_regular(s) && path_is_regular(d)) {
+      if (sp->second == DT_REG && dtypes[i] == DT_REG) {
         // it's file => compare and replace if necessary
         string ds, dd;
         if (!read_whole_file(s, ds) || !read_whole_file(d, dd)) {
@@ -734,7 +867,7 @@ UnionfsCstore::sync_dir(const FsPath& src, const FsPath& dst,
             return false;
           }
         }
-      } else if (path_is_directory(s) && path_is_directory(d)) {
+      } else if (sp->second == DT_DIR && dtypes[i] == DT_DIR) {
         // it's dir => recurse
         if (!sync_dir(s, d, root)) {
           return false;
@@ -755,7 +888,7 @@ UnionfsCstore::sync_dir(const FsPath& src, const FsPath& dst,
       push_path(s, sentries[i].c_str());
       push_path(d, sentries[i].c_str());
       try {
-        if (path_is_regular(s)) {
+        if (stypes[i] == DT_REG) {
           // it's file
           try {
             b_fs::copy_file(s.path_cstr(), d.path_cstr());
@@ -781,12 +914,366 @@ UnionfsCstore::sync_dir(const FsPath& src, const FsPath& dst,
   return true;
 }
 
+/* list the entries of a config dir without unescaping the names.
+ * dot files other than the comment file and dot dirs are skipped.
+ */
+bool
+UnionfsCstore::read_dir_raw(const FsPath& d, vector<string>& files,
+                            vector<string>& dirs)
+{
+  DIR *dp = opendir(d.path_cstr());
+  if (!dp) {
+    return false;
+  }
+  struct dirent *de;
+  while ((de = readdir(dp))) {
+    const char *n = de->d_name;
+    bool is_dir = false;
+    if (de->d_type == DT_DIR) {
+      is_dir = true;
+    } else if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+      FsPath p(d);
+      p.push(n);
+      is_dir = path_is_directory(p);
+    }
+    if (n[0] == '.') {
+      if (!is_dir && C_COMMENT_FILE == n) {
+        files.push_back(n);
+      }
+      continue;
+    }
+    if (is_dir) {
+      dirs.push_back(n);
+    } else {
+      files.push_back(n);
+    }
+  }
+  closedir(dp);
+  return true;
+}
+
+/* compare the changed work node "rel" with the active config and stage
+ * the differences, i.e., new subtrees and changed files are copied into
+ * "stage". only the children marked changed are visited.
+ */
+bool
+UnionfsCstore::stage_changed_node(const FsPath& rel, const FsPath& stage,
+                                  vector<IncCommitOp>& ops)
+{
+  FsPath wp(work_root);
+  FsPath ap(active_root);
+  wp /= rel;
+  ap /= rel;
+  vector<string> wfiles, wdirs, afiles, adirs;
+  if (!read_dir_raw(wp, wfiles, wdirs) || !read_dir_raw(ap, afiles, adirs)) {
+    return false;
+  }
+  MapT<string, bool> amap;
+  for (size_t i = 0; i < afiles.size(); i++) {
+    amap[afiles[i]] = true;
+  }
+  for (size_t i = 0; i < adirs.size(); i++) {
+    amap[adirs[i]] = false;
+  }
+
+  // files
+  MapT<string, bool> wmap;
+  for (size_t i = 0; i < wfiles.size(); i++) {
+    wmap[wfiles[i]] = true;
+    FsPath wf(wp);
+    FsPath af(ap);
+    wf.push(wfiles[i]);
+    af.push(wfiles[i]);
+    string wd;
+    if (!read_whole_file(wf, wd)) {
+      return false;
+    }
+    MapT<string, bool>::iterator it = amap.find(wfiles[i]);
+    if (it != amap.end() && it->second) {
+      string ad;
+      if (!read_whole_file(af, ad)) {
+        return false;
+      }
+      if (wd == ad) {
+        continue;
+      }
+    } else if (it != amap.end()) {
+      // was a dir
+      return false;
+    }
+    char sname[32];
+    snprintf(sname, sizeof(sname), "%zu", ops.size());
+    FsPath sf(stage);
+    sf.push(sname);
+    if (!write_file(sf, wd)) {
+      return false;
+    }
+    FsPath rf(rel);
+    rf.push(wfiles[i]);
+    ops.push_back(IncCommitOp(IncCommitOp::PUT_FILE, rf, sf));
+  }
+  for (size_t i = 0; i < afiles.size(); i++) {
+    if (wmap.find(afiles[i]) == wmap.end()) {
+      FsPath rf(rel);
+      rf.push(afiles[i]);
+      ops.push_back(IncCommitOp(IncCommitOp::DEL_FILE, rf, FsPath()));
+    }
+  }
+
+  // child nodes
+  for (size_t i = 0; i < wdirs.size(); i++) {
+    wmap[wdirs[i]] = false;
+    FsPath rd(rel);
+    rd.push(wdirs[i]);
+    MapT<string, bool>::iterator it = amap.find(wdirs[i]);
+    if (it == amap.end()) {
+      // new subtree
+      char sname[32];
+      snprintf(sname, sizeof(sname), "%zu", ops.size());
+      FsPath sd(stage);
+      sd.push(sname);
+      FsPath wd(wp);
+      wd.push(wdirs[i]);
+      try {
+        recursive_copy_dir(wd, sd, true);
+      } catch (...) {
+        return false;
+      }
+      ops.push_back(IncCommitOp(IncCommitOp::ADD_DIR, rd, sd));
+      continue;
+    }
+    if (it->second) {
+      // was a file
+      return false;
+    }
+    FsPath marker(wp);
+    marker.push(wdirs[i]);
+    marker.push(C_MARKER_CHANGED);
+    if (path_exists(marker) && !stage_changed_node(rd, stage, ops)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < adirs.size(); i++) {
+    if (wmap.find(adirs[i]) == wmap.end()) {
+      FsPath rd(rel);
+      rd.push(adirs[i]);
+      ops.push_back(IncCommitOp(IncCommitOp::DEL_DIR, rd, FsPath()));
+    }
+  }
+  return true;
+}
+
+/* move "from" to "to". if they are not on the same filesystem, "from" is
+ * copied instead and left in place.
+ */
+bool
+UnionfsCstore::move_commit_entry(const FsPath& from, const FsPath& to,
+                                 bool is_dir)
+{
+  // same filesystem => atomic
+  if (rename(from.path_cstr(), to.path_cstr()) == 0) {
+    return true;
+  }
+  if (errno != EXDEV) {
+    return false;
+  }
+  if (!is_dir) {
+    string data;
+    return (read_whole_file(from, data) && write_file(to, data));
+  }
+  try {
+    recursive_copy_dir(from, to, true);
+  } catch (...) {
+    return false;
+  }
+  return true;
+}
+
+/* apply "op" to the active config. whatever it replaces or deletes is
+ * saved in op.trash first so that the op can be undone (see
+ * undo_commit_op()).
+ */
+bool
+UnionfsCstore::apply_commit_op(IncCommitOp& op)
+{
+  FsPath ap(active_root);
+  ap /= op.path;
+  if (op.type != IncCommitOp::ADD_DIR && path_exists(ap)) {
+    if (!move_commit_entry(ap, op.trash, (op.type == IncCommitOp::DEL_DIR))) {
+      return false;
+    }
+    op.saved = true;
+    if (path_exists(ap)) {
+      // copied. remove the original.
+      op.touched = true;
+      try {
+        b_fs::remove_all(ap.path_cstr());
+      } catch (...) {
+        return false;
+      }
+    }
+  } else if (op.type == IncCommitOp::DEL_DIR) {
+    return false;
+  }
+  if (op.type == IncCommitOp::DEL_DIR || op.type == IncCommitOp::DEL_FILE) {
+    return true;
+  }
+  op.touched = true;
+  return move_commit_entry(op.staged, ap, (op.type == IncCommitOp::ADD_DIR));
+}
+
+// undo a (possibly partially) applied op
+bool
+UnionfsCstore::undo_commit_op(const IncCommitOp& op)
+{
+  FsPath ap(active_root);
+  ap /= op.path;
+  if (op.touched) {
+    try {
+      b_fs::remove_all(ap.path_cstr());
+    } catch (...) {
+      return false;
+    }
+  }
+  if (op.saved) {
+    return move_commit_entry(op.trash, ap, (op.type == IncCommitOp::DEL_DIR));
+  }
+  return true;
+}
+
+/* incremental version of commitConfig() for a fully successful commit:
+ * instead of copying the whole working config to the active config, only
+ * the subtrees marked changed are compared with the active config, and
+ * only the differences are staged and then moved into the active config.
+ * after that the working config is the same as the new active config, so
+ * the changes can simply be dropped.
+ *
+ * if moving the differences into the active config fails, the ones
+ * already moved are undone, and the changes are kept.
+ *   modified: (output) whether anything has been modified. if not, caller
+ *             can still fall back to the full reconstruction.
+ */
+bool
+UnionfsCstore::commit_config_incremental(bool& modified)
+{
+  modified = false;
+  FsPath stage = tmp_root;
+  stage.push("stage");
+  try {
+    b_fs::remove_all(stage.path_cstr());
+    b_fs::create_directories(stage.path_cstr());
+  } catch (...) {
+    output_internal("failed to create commit stage [%s]\n",
+                    stage.path_cstr());
+    return false;
+  }
+
+  vector<IncCommitOp> ops;
+  if (!stage_changed_node(FsPath(), stage, ops)) {
+    output_internal("failed to stage changes\n");
+    try {
+      b_fs::remove_all(stage.path_cstr());
+    } catch (...) {
+    }
+    return false;
+  }
+  output_internal("incremental commit [%zu ops]\n", ops.size());
+
+  // nothing has been modified up to here
+  if (!do_umount(work_root)) {
+    return false;
+  }
+  modified = true;
+  size_t i = 0;
+  for (; i < ops.size(); i++) {
+    char tname[32];
+    snprintf(tname, sizeof(tname), "del.%zu", i);
+    ops[i].trash = stage;
+    ops[i].trash.push(tname);
+    if (!apply_commit_op(ops[i])) {
+      output_internal("failed to commit [%s]\n", ops[i].path.path_cstr());
+      break;
+    }
+  }
+  if (i < ops.size()) {
+    // roll back, including the failed op
+    bool undone = true;
+    for (size_t j = i + 1; j > 0; j--) {
+      if (!undo_commit_op(ops[j - 1])) {
+        output_internal("failed to roll back [%s]\n",
+                        ops[j - 1].path.path_cstr());
+        undone = false;
+      }
+    }
+    if (!do_mount(change_root, active_root, work_root)) {
+      return false;
+    }
+    if (undone) {
+      // active config is back to before
+      modified = false;
+      try {
+        b_fs::remove_all(stage.path_cstr());
+      } catch (...) {
+      }
+    }
+    return false;
+  }
+
+  bool ret = true;
+  try {
+    b_fs::remove_all(change_root.path_cstr());
+    b_fs::create_directories(change_root.path_cstr());
+  } catch (...) {
+    output_internal("failed to reset [%s]\n", change_root.path_cstr());
+    ret = false;
+  }
+  if (!do_mount(change_root, active_root, work_root)) {
+    return false;
+  }
+  try {
+    FsPath active_unionfs = active_root;
+    active_unionfs.push(C_MARKER_UNIONFS);
+    b_fs::remove_all(active_unionfs.path_cstr());
+    b_fs::remove_all(stage.path_cstr());
+  } catch (...) {
+    output_internal("failed to remove commit stage\n");
+  }
+  return ret;
+}
+
 bool
 UnionfsCstore::commitConfig(commit::PrioNode& node)
 {
   FsPath active_unionfs = active_root;
   active_unionfs.push(C_MARKER_UNIONFS);
+
+  /* the active config dir is authoritative. the snapshot store's copy
+   * (if any) is going to be stale, so remove it first.
+   */
+  string snap = (string(active_root.path_cstr()) + C_SNAPSHOT_SUFFIX);
+  if (unlink(snap.c_str()) != 0 && errno != ENOENT) {
+    output_internal("failed to remove [%s]\n", snap.c_str());
+    return false;
+  }
   
+  if (node.succeeded() && !node.hasSubtreeFailure()) {
+    /* everything succeeded => if the changes are marked, only apply the
+     * changed subtrees. otherwise fall through to full reconstruction.
+     */
+    FsPath marker = work_root;
+    marker.push(C_MARKER_CHANGED);
+    bool modified = false;
+    if (path_exists(marker)) {
+      if (commit_config_incremental(modified)) {
+        return true;
+      }
+      if (modified) {
+        // failed after modifying active config => can't fall back
+        return false;
+      }
+    }
+  }
+
   // make a copy of current "work" dir
   try {
     if (path_exists(tmp_work_root)) {
@@ -885,6 +1372,240 @@ UnionfsCstore::getCommitLock()
 }
 
 
+////// template trie
+/* in-memory trie of the template tree so that template path validation
+ * (tmpl_node_exists()) and template child listing don't need any syscalls
+ * once the dirs along the path have been seen. the trie is populated
+ * lazily one dir at a time, using the precompiled template index if it is
+ * up to date for the dir (i.e., only one stat per dir). a tag node's
+ * "node.tag" is just another child, i.e., the "tag wildcard" edge.
+ *
+ * since the process may be long-lived (e.g., the shell API daemon), the
+ * trie must see templates installed after a dir has been listed. the
+ * mtime of each dir is recorded when it is listed, and the dir is
+ * re-listed if it has changed when a lookup misses or when the children
+ * are listed. so only misses and child listings cost a stat.
+ */
+struct TmplTrieNode {
+  TmplTrieNode() : listed(false), ino(0), mtime(), children() {};
+  bool listed;
+  ino_t ino;
+  struct timespec mtime;
+  MapT<string, TmplTrieNode *> children;
+};
+
+typedef MapT<string, TmplTrieNode *> TmplTrieMapT;
+static TmplTrieMapT _tmpl_tries;
+/* lookups of listed dirs only need the read lock. listing a dir needs the
+ * write lock. a node's children can only change while holding the write
+ * lock, and children that are gone when a dir is re-listed are freed, so
+ * nodes must not be used without holding the lock.
+ */
+static RwLock _tmpl_trie_lock;
+
+// free "node" and everything below it
+static void
+_tmpl_trie_free(TmplTrieNode *node)
+{
+  MapT<string, TmplTrieNode *>::iterator it = node->children.begin();
+  for (; it != node->children.end(); ++it) {
+    _tmpl_trie_free(it->second);
+  }
+  delete node;
+}
+
+// whether the dir of the listed "node" has changed since it was listed
+static bool
+_tmpl_trie_stale(const TmplTrieNode *node, const string& dir)
+{
+  struct stat st;
+  if (stat(dir.c_str(), &st) != 0) {
+    return (node->ino != 0);
+  }
+  return (st.st_ino != node->ino
+          || st.st_mtim.tv_sec != node->mtime.tv_sec
+          || st.st_mtim.tv_nsec != node->mtime.tv_nsec);
+}
+
+/* list the template dir "dir" into "node". if "node" has been listed
+ * before, existing children that are still there are kept, and the ones
+ * that are gone are freed.
+ */
+static void
+_tmpl_trie_list(TmplTrieNode *node, const string& dir, const char *root)
+{
+  node->listed = true;
+  vector<string> cnodes;
+  TmplIndex *idx = TmplIndex::getIndex(root);
+  struct stat st;
+  bool st_ok = (stat(dir.c_str(), &st) == 0);
+  node->ino = (st_ok ? st.st_ino : 0);
+  if (st_ok) {
+    node->mtime = st.st_mtim;
+  }
+  if (!idx || !st_ok || !idx->getChildNames(dir.c_str(), st, cnodes)) {
+    cnodes.clear();
+    DIR *dp = opendir(dir.c_str());
+    if (!dp) {
+      return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dp))) {
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+        continue;
+      }
+      if (de->d_type != DT_DIR) {
+        if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK) {
+          continue;
+        }
+        string c = dir + "/" + de->d_name;
+        if (stat(c.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+          continue;
+        }
+      }
+      cnodes.push_back(de->d_name);
+    }
+    closedir(dp);
+  }
+  MapT<string, TmplTrieNode *> children;
+  for (size_t i = 0; i < cnodes.size(); i++) {
+    MapT<string, TmplTrieNode *>::iterator p = node->children.find(cnodes[i]);
+    if (p != node->children.end()) {
+      children[cnodes[i]] = p->second;
+      node->children.erase(p);
+    } else {
+      children[cnodes[i]] = new TmplTrieNode();
+    }
+  }
+  // whatever is left is gone
+  MapT<string, TmplTrieNode *>::iterator it = node->children.begin();
+  for (; it != node->children.end(); ++it) {
+    _tmpl_trie_free(it->second);
+  }
+  node->children.swap(children);
+}
+
+/* walk the trie (see below). if "list" is false, no dirs are listed, and
+ * "done" is set to false if that is needed.
+ *   check_last: whether to check if the last dir has changed.
+ */
+static TmplTrieNode *
+_tmpl_trie_walk(const char *rstr, size_t rlen, const char *pstr, bool list,
+                bool check_last, bool& done)
+{
+  done = false;
+  TmplTrieNode *node = NULL;
+  TmplTrieMapT::iterator it = _tmpl_tries.find(rstr);
+  if (it != _tmpl_tries.end()) {
+    node = it->second;
+  } else if (!list) {
+    return NULL;
+  } else {
+    node = new TmplTrieNode();
+    _tmpl_tries[rstr] = node;
+  }
+  string dir(rstr, rlen);
+  const char *c = pstr + rlen;
+  while (*c) {
+    // c points to '/'
+    const char *e = strchr(c + 1, '/');
+    size_t clen = (e ? (size_t) (e - c - 1) : strlen(c + 1));
+    if (!node->listed) {
+      if (!list) {
+        return NULL;
+      }
+      _tmpl_trie_list(node, dir, rstr);
+    }
+    string comp(c + 1, clen);
+    MapT<string, TmplTrieNode *>::iterator p = node->children.find(comp);
+    if (p == node->children.end()) {
+      // miss. check if the dir has changed.
+      if (!_tmpl_trie_stale(node, dir)) {
+        done = true;
+        return NULL;
+      }
+      if (!list) {
+        return NULL;
+      }
+      _tmpl_trie_list(node, dir, rstr);
+      p = node->children.find(comp);
+      if (p == node->children.end()) {
+        done = true;
+        return NULL;
+      }
+    }
+    node = p->second;
+    dir += '/';
+    dir += comp;
+    c += (clen + 1);
+  }
+  if (!node->listed || (check_last && _tmpl_trie_stale(node, dir))) {
+    if (!list) {
+      return NULL;
+    }
+    _tmpl_trie_list(node, dir, rstr);
+  }
+  done = true;
+  return node;
+}
+
+// get the names of the children of "node". must hold the lock.
+static void
+_tmpl_trie_children(const TmplTrieNode *node, vector<string>& cnodes)
+{
+  // same as get_all_child_dir_names()
+  MapT<string, TmplTrieNode *>::const_iterator it = node->children.begin();
+  for (; it != node->children.end(); ++it) {
+    if (it->first.length() < 1 || it->first[0] == '.') {
+      continue;
+    }
+    cnodes.push_back(_unescape_path_name(Intern::get(it->first)));
+  }
+}
+
+/* find the trie node corresponding to "path" under "root".
+ *   valid: (output) false if "path" is not under "root", i.e., the trie
+ *          cannot be used.
+ *   cnodes: if not NULL, (output) the names of the node's children. in
+ *           this case its dir is checked for changes.
+ * return whether path exists.
+ */
+static bool
+_tmpl_trie_find(const FsPath& root, const FsPath& path, bool& valid,
+                vector<string> *cnodes = NULL)
+{
+  const char *rstr = root.path_cstr();
+  const char *pstr = path.path_cstr();
+  size_t rlen = root.length();
+  valid = (path.length() >= rlen && memcmp(rstr, pstr, rlen) == 0
+           && (pstr[rlen] == 0 || pstr[rlen] == '/'));
+  if (!valid) {
+    return NULL;
+  }
+
+  bool done;
+  bool check_last = (cnodes != NULL);
+  {
+    RwLock::Read l(_tmpl_trie_lock);
+    TmplTrieNode *node = _tmpl_trie_walk(rstr, rlen, pstr, false,
+                                         check_last, done);
+    if (done) {
+      if (node && cnodes) {
+        _tmpl_trie_children(node, *cnodes);
+      }
+      return (node != NULL);
+    }
+  }
+  RwLock::Write l(_tmpl_trie_lock);
+  TmplTrieNode *node = _tmpl_trie_walk(rstr, rlen, pstr, true, check_last,
+                                       done);
+  if (node && cnodes) {
+    _tmpl_trie_children(node, *cnodes);
+  }
+  return (node != NULL);
+}
+
+
 ////// virtual functions defined in base class
 /* check if current tmpl_path is a valid tmpl dir.
  * return true if valid. otherwise return false.
@@ -892,11 +1613,28 @@ UnionfsCstore::getCommitLock()
 bool
 UnionfsCstore::tmpl_node_exists()
 {
-  return (path_exists(tmpl_path) && path_is_directory(tmpl_path));
+  bool valid;
+  bool exists = _tmpl_trie_find(tmpl_root, tmpl_path, valid);
+  if (!valid) {
+    // not under template root. check the filesystem.
+    return (path_exists(tmpl_path) && path_is_directory(tmpl_path));
+  }
+  return exists;
+}
+
+void
+UnionfsCstore::get_all_tmpl_child_node_names(vector<string>& cnodes)
+{
+  bool valid;
+  _tmpl_trie_find(tmpl_root, tmpl_path, valid, &cnodes);
+  if (!valid) {
+    get_all_child_dir_names(tmpl_path, cnodes);
+  }
 }
 
 typedef MapT<FsPath, tr1::shared_ptr<vtw_def>, FsPathHash> ParsedTmplCacheT;
 static ParsedTmplCacheT _parsed_tmpl_cache;
+static RwLock _parsed_tmpl_cache_lock;
 
 /* parse template at current tmpl_path and return an allocated Ctemplate
  * pointer if successful. otherwise return 0.
@@ -906,18 +1644,36 @@ UnionfsCstore::tmpl_parse()
 {
   FsPath tp = tmpl_path;
   tp.push(C_DEF_NAME);
-  if (!path_exists(tp) || !path_is_regular(tp)) {
+  struct stat st;
+  if (stat(tp.path_cstr(), &st) != 0 || !S_ISREG(st.st_mode)) {
     // invalid
     return 0;
   }
 
-  ParsedTmplCacheT::iterator p = _parsed_tmpl_cache.find(tp);
-  if (p != _parsed_tmpl_cache.end()) {
-    // found in cache
-    return (new Ctemplate(p->second));
+  {
+    RwLock::Read l(_parsed_tmpl_cache_lock);
+    ParsedTmplCacheT::iterator p = _parsed_tmpl_cache.find(tp);
+    if (p != _parsed_tmpl_cache.end()) {
+      // found in cache
+      return (new Ctemplate(p->second));
+    }
   }
 
-  // new template => parse
+  /* not parsed yet. holding the write lock also serializes the parser,
+   * which is not reentrant.
+   */
+  RwLock::Write l(_parsed_tmpl_cache_lock);
+  // try the precompiled index first
+  TmplIndex *idx = TmplIndex::getIndex(tmpl_root.path_cstr());
+  if (idx) {
+    tr1::shared_ptr<vtw_def> def = idx->getDef(tp.path_cstr(), st);
+    if (def.get()) {
+      _parsed_tmpl_cache[tp] = def;
+      return (new Ctemplate(def));
+    }
+  }
+
+  // not in index => parse
   tr1::shared_ptr<vtw_def> def(new vtw_def);
   vtw_def *_def = def.get();
   if (_def && parse_def(_def, tp.path_cstr(), 0) == 0) {
@@ -1014,12 +1770,19 @@ UnionfsCstore::read_value_vec(vector<string>& vvec, bool active_cfg)
     return false;
   }
 
+  split_values(ostr, vvec);
+  return true;
+}
+
+// separate values in a value file using newline as delimiter
+void
+UnionfsCstore::split_values(const string& ostr, vector<string>& vvec)
+{
   /* XXX original implementation used to remove a trailing '\n' after
    *     a read. it was only necessary because it was adding a '\n' when
    *     writing the file. don't remove anything now since we shouldn't
    *     be writing it any more.
    */
-  // separate values using newline as delimiter
   size_t start_idx = 0, idx = 0;
   for (; idx < ostr.size(); idx++) {
     if (ostr[idx] == '\n') {
@@ -1034,7 +1797,6 @@ UnionfsCstore::read_value_vec(vector<string>& vvec, bool active_cfg)
     // last char is a newline => another empty value
     vvec.push_back("");
   }
-  return true;
 }
 
 bool
@@ -1348,6 +2110,15 @@ UnionfsCstore::discard_changes(unsigned long long& num_removed)
   bool unsaved = sessionUnsaved();
   bool ret = true;
 
+  /* overlayfs doesn't support changing its upper dir while mounted, so
+   * clear it while unmounted. whiteouts (char devices) and opaque dirs
+   * (xattr) are removed along with everything else.
+   */
+  bool remount = use_overlay();
+  if (remount && !do_umount(work_root)) {
+    return false;
+  }
+
   vector<b_fs::path> files;
   vector<b_fs::path> directories;
   try {
@@ -1374,6 +2145,9 @@ UnionfsCstore::discard_changes(unsigned long long& num_removed)
     output_internal("discard failed [%s]\n", change_root.path_cstr());
     ret = false;
   }
+  if (remount && !do_mount(change_root, active_root, work_root)) {
+    return false;
+  }
 
   if (unsaved) {
     // restore unsaved marker
@@ -1383,6 +2157,50 @@ UnionfsCstore::discard_changes(unsigned long long& num_removed)
   return ret;
 }
 
+class UnionfsCstore::ReadChildDirsTask : public WorkPool::Task {
+public:
+  ReadChildDirsTask(UnionfsCstore *cs, int dfd, const vector<string>& names,
+                    const vector<size_t>& dirs, CfgRawNode& node,
+                    size_t begin, size_t end)
+    : _cs(cs), _dfd(dfd), _names(names), _dirs(dirs), _node(node),
+      _begin(begin), _end(end) {};
+  void run() {
+    _cs->read_child_dirs_at(_dfd, _names, _dirs, _node, _begin, _end);
+  };
+
+private:
+  UnionfsCstore *_cs;
+  int _dfd;
+  const vector<string>& _names;
+  const vector<size_t>& _dirs;
+  CfgRawNode& _node;
+  size_t _begin;
+  size_t _end;
+};
+
+/* read the subtree at the current work or active path in a single pass.
+ * the directories are walked with openat()/getdents64() relative to the
+ * parent, so each node costs one open and a couple of getdents calls plus
+ * one open for each value/comment file, instead of the stat/open of the
+ * full path for every observer called on every node.
+ *
+ * the children of a large node are read by the WorkPool workers, which
+ * only use the dir fds and none of the path state.
+ */
+bool
+UnionfsCstore::read_cfg_subtree(CfgRawNode& root, bool active_cfg,
+                                bool recursive)
+{
+  FsPath p = (active_cfg ? get_active_path() : get_work_path());
+  int fd = open(p.path_cstr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  read_subtree_at(fd, root, recursive);
+  close(fd);
+  return true;
+}
+
 // get comment at the current work or active path
 bool
 UnionfsCstore::get_comment(string& comment, bool active_cfg)
@@ -1421,7 +2239,7 @@ UnionfsCstore::marked_committed(bool is_delete)
 {
   string marker;
   get_committed_marker(is_delete, marker);
-  return find_line_in_file(commit_marker_file, marker);
+  return commit_markers->find(marker);
 }
 
 bool
@@ -1429,8 +2247,7 @@ UnionfsCstore::mark_committed(bool is_delete)
 {
   string marker;
   get_committed_marker(is_delete, marker);
-  // write one marker per line
-  return write_file(commit_marker_file, marker + "\n", true);
+  return commit_markers->add(marker);
 }
 
 string
@@ -1458,7 +2275,7 @@ UnionfsCstore::tmpl_path_to_str() {
 void
 UnionfsCstore::push_path(FsPath& old_path, const char *new_comp)
 {
-  string comp = _escape_path_name(new_comp);
+  string comp = _escape_path_name(Intern::get(new_comp));
   old_path.push(comp);
 }
 
@@ -1472,47 +2289,212 @@ void
 UnionfsCstore::pop_path(FsPath& path, string& last)
 {
   path.pop(last);
-  last = _unescape_path_name(last);
+  last = _unescape_path_name(Intern::get(last));
+}
+
+string
+UnionfsCstore::unescape_name(const string& name)
+{
+  return _unescape_path_name(Intern::get(name));
 }
 
+/* list the entries of the directory "root" (see read_dir_entries_at()).
+ *   cnodes: (output) unescaped names. call with NULL if not needed.
+ *   types: (output) entry types (DT_*) corresponding to "cnodes".
+ *          call with NULL if not needed.
+ *   filter_nodes: only include node dirs, i.e., dirs not starting with ".".
+ *   empty_check: only check if there is any entry.
+ * return true if there is any entry. otherwise return false.
+ */
 bool
 UnionfsCstore::check_dir_entries(const FsPath& root, vector<string> *cnodes,
-                                 bool filter_nodes, bool empty_check)
+                                 bool filter_nodes, bool empty_check,
+                                 vector<unsigned char> *types)
 {
-  if (!path_exists(root) || !path_is_directory(root)) {
+  int dfd = open(root.path_cstr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd < 0) {
     // not a valid root => treat as empty
     return false;
   }
   bool found = false;
-  try {
-    b_fs::directory_iterator di(root.path_cstr());
-    for (; di != b_fs::directory_iterator(); ++di) {
-      string cname = di->path().filename().string();
-      if (filter_nodes) {
-        // must be directory
-        if (!path_is_directory(di->path().string().c_str())) {
-          continue;
-        }
-        // name cannot start with "."
-        if (cname.length() < 1 || cname[0] == '.') {
-          continue;
-        }
+  DirEntryReader dr(dfd);
+  const struct dirent64 *d;
+  while ((d = dr.next())) {
+    const char *name = d->d_name;
+    // name cannot start with "." (checked first since it's cheaper)
+    if (filter_nodes && name[0] == '.') {
+      continue;
+    }
+    unsigned char t = DT_UNKNOWN;
+    if (filter_nodes || types) {
+      dr.type(d, t);
+      // must be directory
+      if (filter_nodes && t != DT_DIR) {
+        continue;
       }
-      // found one
-      if (empty_check) {
-        // only checking and directory is not empty
-        return true;
+    }
+    // found one
+    found = true;
+    if (empty_check) {
+      // only checking and directory is not empty
+      break;
+    }
+    if (cnodes) {
+      cnodes->push_back(_unescape_path_name(Intern::get(name)));
+    }
+    if (types) {
+      types->push_back(t);
+    }
+  }
+  close(dfd);
+  return found;
+}
+
+/* read all entries of the directory "dfd" with getdents64().
+ * the entry types are resolved (following symlinks) if the filesystem
+ * doesn't provide them. return false if the directory cannot be read.
+ */
+bool
+UnionfsCstore::read_dir_entries_at(int dfd, vector<string>& names,
+                                   vector<unsigned char>& types)
+{
+  DirEntryReader dr(dfd);
+  const struct dirent64 *d;
+  while ((d = dr.next())) {
+    unsigned char t;
+    if (!dr.type(d, t)) {
+      continue;
+    }
+    names.push_back(d->d_name);
+    types.push_back(t);
+  }
+  return !dr.failed();
+}
+
+/* read a value/comment file in directory "dfd". same restrictions as
+ * read_whole_file().
+ */
+bool
+UnionfsCstore::read_file_at(int dfd, const char *name, string& data)
+{
+  int fd = openat(dfd, name, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return false;
+  }
+  if ((size_t) st.st_size > C_UNIONFS_MAX_FILE_SIZE) {
+    output_internal("read_whole_file too large\n");
+    close(fd);
+    return false;
+  }
+  string ret;
+  char buf[4096];
+  while (1) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
       }
-      if (cnodes) {
-        cnodes->push_back(_unescape_path_name(cname));
-      } else {
-        found = true;
+      close(fd);
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    ret.append(buf, n);
+  }
+  close(fd);
+  data = ret;
+  return true;
+}
+
+// read the node at "dfd" (see read_cfg_subtree())
+void
+UnionfsCstore::read_subtree_at(int dfd, CfgRawNode& node, bool recursive)
+{
+  vector<string> names;
+  vector<unsigned char> types;
+  // unreadable => treat as empty (same as check_dir_entries())
+  read_dir_entries_at(dfd, names, types);
+
+  vector<size_t> dirs;
+  for (size_t i = 0; i < names.size(); i++) {
+    const string& name = names[i];
+    // marker checks are existence checks, i.e., any file type
+    if (name == C_MARKER_DEACTIVATE) {
+      node.deactivated = true;
+    } else if (name == C_MARKER_DEF_VALUE) {
+      node.is_default = true;
+    }
+    if (types[i] == DT_DIR) {
+      // name cannot start with "."
+      if (name[0] != '.') {
+        dirs.push_back(i);
+      }
+    } else if (types[i] == DT_REG) {
+      if (name == C_VAL_NAME) {
+        string vstr;
+        if (read_file_at(dfd, name.c_str(), vstr)) {
+          node.has_value = true;
+          split_values(vstr, node.values);
+        }
+      } else if (name == C_COMMENT_FILE) {
+        node.has_comment = read_file_at(dfd, name.c_str(), node.comment);
       }
     }
-  } catch (...) {
-    // skip the rest
   }
-  return (cnodes ? (cnodes->size() > 0) : found);
+
+  node.children.resize(dirs.size());
+  if (!recursive) {
+    // only the names of the child nodes
+    for (size_t i = 0; i < dirs.size(); i++) {
+      node.children[i].name = _unescape_path_name(Intern::get(names[dirs[i]]));
+    }
+    return;
+  }
+  size_t chunk;
+  WorkPool *pool = WorkPool::getForSplit(dirs.size(), chunk);
+  if (!pool) {
+    read_child_dirs_at(dfd, names, dirs, node, 0, dirs.size());
+    return;
+  }
+
+  // large fan-out (e.g., tag node) => read the children in parallel
+  vector<ReadChildDirsTask *> tasks;
+  WorkPool::Group g(pool);
+  for (size_t i = 0; i < dirs.size(); i += chunk) {
+    size_t end = ((i + chunk) < dirs.size() ? (i + chunk) : dirs.size());
+    tasks.push_back(new ReadChildDirsTask(this, dfd, names, dirs, node, i,
+                                          end));
+    g.add(tasks.back());
+  }
+  g.wait();
+  for (size_t i = 0; i < tasks.size(); i++) {
+    delete tasks[i];
+  }
+}
+
+// read the child dirs [begin, end) of "node" (see read_subtree_at())
+void
+UnionfsCstore::read_child_dirs_at(int dfd, const vector<string>& names,
+                                  const vector<size_t>& dirs,
+                                  CfgRawNode& node, size_t begin, size_t end)
+{
+  for (size_t i = begin; i < end; i++) {
+    CfgRawNode& cn = node.children[i];
+    const string& name = names[dirs[i]];
+    cn.name = _unescape_path_name(Intern::get(name));
+    int fd = openat(dfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    read_subtree_at(fd, cn);
+    close(fd);
+  }
 }
 
 bool
@@ -1576,6 +2558,56 @@ UnionfsCstore::read_whole_file(const FsPath& fpath, string& data)
   return true;
 }
 
+/* copy the file "name" in directory "sfd" to directory "dfd" without
+ * moving the data through user space: clone it (FICLONE, i.e., only the
+ * metadata is copied on filesystems with shared extents), or failing that,
+ * copy_file_range(). return false if neither is supported for the files,
+ * in which case no file is left at the destination.
+ */
+static bool
+_copy_file_at(int sfd, int dfd, const char *name)
+{
+  int ifd = openat(sfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (ifd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(ifd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(ifd);
+    return false;
+  }
+  int ofd = openat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   st.st_mode & 07777);
+  if (ofd < 0) {
+    close(ifd);
+    return false;
+  }
+  bool ret = (ioctl(ofd, FICLONE, ifd) == 0);
+#ifdef SYS_copy_file_range
+  if (!ret) {
+    off_t left = st.st_size;
+    while (left > 0) {
+      long n = syscall(SYS_copy_file_range, ifd, NULL, ofd, NULL,
+                       (size_t) left, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      left -= n;
+    }
+    ret = (left == 0);
+  }
+#endif
+  close(ifd);
+  close(ofd);
+  if (!ret) {
+    unlinkat(dfd, name, 0);
+  }
+  return ret;
+}
+
 /* recursively copy source directory to destination.
  * will throw exception (from b_fs) if fail.
  */
@@ -1583,35 +2615,93 @@ void
 UnionfsCstore::recursive_copy_dir(const FsPath& src, const FsPath& dst,
                                   bool filter_dot_entries)
 {
-  string src_str = src.path_cstr();
-  string dst_str = dst.path_cstr();
   b_fs::create_directories(dst.path_cstr());
+  int sfd = open(src.path_cstr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (sfd < 0) {
+    throw b_fs::filesystem_error("recursive_copy_dir", src.path_cstr(),
+                                 b_s::error_code(errno,
+                                                 b_s::system_category()));
+  }
+  int dfd = open(dst.path_cstr(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd < 0) {
+    int err = errno;
+    close(sfd);
+    throw b_fs::filesystem_error("recursive_copy_dir", dst.path_cstr(),
+                                 b_s::error_code(err,
+                                                 b_s::system_category()));
+  }
+  try {
+    copy_dir_at(sfd, dfd, src, dst, filter_dot_entries);
+  } catch (...) {
+    close(sfd);
+    close(dfd);
+    throw;
+  }
+  close(sfd);
+  close(dfd);
+}
 
-  b_fs::recursive_directory_iterator di(src_str);
-  for (; di != b_fs::recursive_directory_iterator(); ++di) {
-    const char *oname = di->path().string().c_str();
-    string nname = oname;
-    nname.replace(0, src_str.length(), dst_str);
-    if (path_is_directory(oname)) {
-      b_fs::create_directory(nname);
-    } else {
-      if (filter_dot_entries) {
-        string of = di->path().filename().string();
-        if (!of.empty() && of.at(0) == '.') {
-          // filter dot files (with exceptions)
-          if (of != C_COMMENT_FILE) {
-            continue;
-          }
+// copy the content of "src" (open as "sfd") to "dst" (open as "dfd")
+void
+UnionfsCstore::copy_dir_at(int sfd, int dfd, const FsPath& src,
+                           const FsPath& dst, bool filter_dot_entries)
+{
+  DirEntryReader dr(sfd);
+  const struct dirent64 *d;
+  while ((d = dr.next())) {
+    const char *name = d->d_name;
+    FsPath s(src);
+    FsPath n(dst);
+    s.push(name);
+    n.push(name);
+    unsigned char t;
+    dr.type(d, t);
+    if (t == DT_DIR) {
+      b_fs::create_directory(n.path_cstr());
+      int csfd = openat(sfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      int cdfd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (csfd >= 0 && cdfd >= 0) {
+        try {
+          copy_dir_at(csfd, cdfd, s, n, filter_dot_entries);
+        } catch (...) {
+          close(csfd);
+          close(cdfd);
+          throw;
         }
+      } else {
+        // let b_fs do it (and report any error)
+        recursive_copy_dir(s, n, filter_dot_entries);
       }
-      try {
-        b_fs::copy_file(di->path(), nname);
-      } catch (const b_fs::filesystem_error& e) {
-        output_internal("recursive_copy_dir failed due to %s in copy_file. Falling back to internal stream_file\n", e.what());
-        stream_file(di->path().string().c_str(), nname.c_str());
+      if (csfd >= 0) {
+        close(csfd);
       }
+      if (cdfd >= 0) {
+        close(cdfd);
+      }
+      continue;
+    }
+    if (filter_dot_entries && name[0] == '.') {
+      // filter dot files (with exceptions)
+      if (C_COMMENT_FILE != name) {
+        continue;
+      }
+    }
+    if (_copy_file_at(sfd, dfd, name)) {
+      continue;
+    }
+    try {
+      b_fs::copy_file(s.path_cstr(), n.path_cstr());
+    } catch (const b_fs::filesystem_error& e) {
+      output_internal("recursive_copy_dir failed due to %s in copy_file. Falling back to internal stream_file\n", e.what());
+      stream_file(s.path_cstr(), n.path_cstr());
     }
   }
+  if (dr.failed()) {
+    // don't silently leave a partial copy
+    throw b_fs::filesystem_error("recursive_copy_dir", src.path_cstr(),
+                                 b_s::error_code(dr.error(),
+                                                 b_s::system_category()));
+  }
 }
 
 void
@@ -1621,31 +2711,215 @@ UnionfsCstore::get_committed_marker(bool is_delete, string& marker)
   marker += mutable_cfg_path.path_cstr();
 }
 
+/* whether the session uses kernel overlayfs instead of unionfs. this is
+ * selected when the session is set up (see C_ENV_UNION_MOUNT), and the
+ * overlay work dir in the temp root then marks the session as such, so
+ * later re-mounts (e.g., on commit) use the same type.
+ */
 bool
-UnionfsCstore::find_line_in_file(const FsPath& file, const string& line)
+UnionfsCstore::use_overlay()
 {
-  bool ret = false;
-  try {
-    std::ifstream fin(file.path_cstr());
-    while (!fin.eof() && !fin.bad() && !fin.fail()) {
-      string in;
-      getline(fin, in);
-      if (in == line) {
-        ret = true;
-        break;
-      }
+  FsPath wdir = tmp_root;
+  wdir.push(C_OVERLAY_WORK_DIR);
+  if (path_is_directory(wdir)) {
+    return true;
+  }
+  const char *m = getenv(C_ENV_UNION_MOUNT.c_str());
+  return (m && C_UNION_MOUNT_OVERLAY == m);
+}
+
+// whether this process is in a user namespace other than the initial one
+static bool
+_in_user_ns()
+{
+  std::ifstream fin("/proc/self/uid_map");
+  unsigned long inside = 0, outside = 0, count = 0;
+  if (!(fin >> inside >> outside >> count)) {
+    return false;
+  }
+  return !(inside == 0 && outside == 0 && count == 4294967295UL);
+}
+
+/* whether a config session other than the one at "mdir" is mounted (in
+ * the same session dir). if "overlay_only", only overlay mounts count.
+ */
+bool
+UnionfsCstore::other_session_mounted(const FsPath& mdir, bool overlay_only)
+{
+  string mstr = mdir.path_cstr();
+  size_t pos = mstr.find_last_of("/");
+  if (pos == string::npos) {
+    return false;
+  }
+  string base = mstr.substr(0, pos);
+  string name = mstr.substr(pos + 1);
+  string prefix = C_DEF_WORK_PREFIX.substr(C_DEF_WORK_PREFIX.rfind('/') + 1);
+  struct stat bst;
+  int dfd = open(base.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd < 0) {
+    return false;
+  }
+  if (fstat(dfd, &bst) != 0) {
+    close(dfd);
+    return false;
+  }
+  bool found = false;
+  DirEntryReader dr(dfd);
+  const struct dirent64 *d;
+  while (!found && (d = dr.next())) {
+    if (name == d->d_name || strncmp(d->d_name, prefix.c_str(),
+                                     prefix.length()) != 0) {
+      continue;
+    }
+    string p = base + "/" + d->d_name;
+    struct statfs sfs;
+    struct stat st;
+    if (statfs(p.c_str(), &sfs) == 0
+        && sfs.f_type == OVERLAYFS_SUPER_MAGIC) {
+      found = true;
+    } else if (!overlay_only && stat(p.c_str(), &st) == 0
+               && S_ISDIR(st.st_mode) && st.st_dev != bst.st_dev) {
+      // a mount point
+      found = true;
     }
-    fin.close();
-  } catch (...) {
-    ret = false;
   }
-  return ret;
+  close(dfd);
+  return found;
 }
 
+/* take the lock that serializes the session mounts in the session dir of
+ * "mdir" (see do_mount()). it is kept until unlock_session_mounts(), so a
+ * session can hold it from unmounting to re-mounting.
+ */
+bool
+UnionfsCstore::lock_session_mounts(const FsPath& mdir)
+{
+  if (mount_lock_fd >= 0) {
+    // already held
+    return true;
+  }
+  string lfile = mdir.path_cstr();
+  size_t pos = lfile.find_last_of("/");
+  if (pos == string::npos) {
+    return false;
+  }
+  lfile.erase(pos + 1);
+  lfile += C_MOUNT_LOCK_FILE;
+  // read-only is enough for flock(), so any session user can open it
+  int fd = open(lfile.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    output_internal("failed to open mount lock [%s][%s]\n",
+                    strerror(errno), lfile.c_str());
+    return false;
+  }
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      output_internal("failed to lock [%s][%s]\n", strerror(errno),
+                      lfile.c_str());
+      close(fd);
+      return false;
+    }
+  }
+  mount_lock_fd = fd;
+  return true;
+}
+
+void
+UnionfsCstore::unlock_session_mounts()
+{
+  if (mount_lock_fd >= 0) {
+    close(mount_lock_fd);
+    mount_lock_fd = -1;
+  }
+}
+
+/* union mount "rwdir" over "rdir" at "mdir".
+ *
+ * with overlayfs, "rdir" is the lower dir, "rwdir" the upper dir, and the
+ * work dir (which must be on the same filesystem as the upper dir) is in
+ * the temp root. the kernel creates whiteouts and opaque dirs in the upper
+ * dir as needed when nodes are removed/re-created through the mount, so
+ * reads and writes in a session don't go through FUSE. this also works in
+ * an unprivileged user+mount namespace (kernel 5.11 or later), where the
+ * overlay xattrs are kept in the "user" namespace.
+ *
+ * limitation: commit changes the active config (lower dir) in place (and
+ * the full reconstruction replaces all of it). unlike unionfs, overlayfs
+ * doesn't support changes to the lower dir while mounted (e.g., it keeps
+ * seeing the replaced dirs), so a session mounted with overlayfs must be
+ * the only config session: an overlay mount is refused while another
+ * session is mounted, and any mount is refused while another session is
+ * mounted with overlayfs.
+ *
+ * the check and the mount are done under the session mount lock, so two
+ * sessions being set up at the same time cannot both pass the check. a
+ * session that unmounts to re-mount (e.g., on commit) holds the lock from
+ * do_umount() on, so no other session can be set up in between.
+ */
 bool
 UnionfsCstore::do_mount(const FsPath& rwdir, const FsPath& rdir,
                         const FsPath& mdir)
 {
+  if (!lock_session_mounts(mdir)) {
+    return false;
+  }
+  bool ret = false;
+  bool overlay = use_overlay();
+  if (!other_session_mounted(mdir, !overlay)) {
+    ret = union_mount(rwdir, rdir, mdir, overlay);
+  } else if (overlay) {
+    output_user("Cannot set up the config session: another config session "
+                "is active, and a session using overlayfs "
+                "(VYATTA_UNION_MOUNT=overlay) must be the only one\n");
+  } else {
+    output_user("Cannot set up the config session: another config session "
+                "is using overlayfs, which requires it to be the only "
+                "one\n");
+  }
+  unlock_session_mounts();
+  return ret;
+}
+
+bool
+UnionfsCstore::union_mount(const FsPath& rwdir, const FsPath& rdir,
+                           const FsPath& mdir, bool overlay)
+{
+  if (overlay) {
+    FsPath wdir = tmp_root;
+    wdir.push(C_OVERLAY_WORK_DIR);
+    /* the work dir marks the session as overlay, so only keep a new one
+     * if the mount succeeds.
+     */
+    bool created = !path_is_directory(wdir);
+    try {
+      b_fs::create_directories(wdir.path_cstr());
+    } catch (...) {
+      output_internal("failed to create overlay work dir [%s]\n",
+                      wdir.path_cstr());
+      return false;
+    }
+    string mopts = "lowerdir=";
+    mopts += rdir.path_cstr();
+    mopts += ",upperdir=";
+    mopts += rwdir.path_cstr();
+    mopts += ",workdir=";
+    mopts += wdir.path_cstr();
+    if (_in_user_ns()) {
+      // "trusted" xattrs (whiteouts, opaque dirs) are not allowed
+      mopts += ",userxattr";
+    }
+    if (mount("overlay", mdir.path_cstr(), "overlay", 0,
+              mopts.c_str()) != 0) {
+      output_internal("overlay mount failed [%s][%s][%s]\n",
+                      strerror(errno), mdir.path_cstr(), mopts.c_str());
+      if (created) {
+        b_s::error_code ec;
+        b_fs::remove_all(wdir.path_cstr(), ec);
+      }
+      return false;
+    }
+    return true;
+  }
 #ifdef USE_UNIONFSFUSE
   const char *fusepath, *fuseprog;
   const char *fuseoptinit;
@@ -1705,6 +2979,21 @@ UnionfsCstore::do_mount(const FsPath& rwdir, const FsPath& rdir,
 bool
 UnionfsCstore::do_umount(const FsPath& mdir)
 {
+  // held until re-mounted (see do_mount())
+  if (!lock_session_mounts(mdir)) {
+    return false;
+  }
+  struct statfs sfs;
+  if (statfs(mdir.path_cstr(), &sfs) == 0
+      && sfs.f_type == OVERLAYFS_SUPER_MAGIC) {
+    // overlay (see do_mount())
+    if (umount(mdir.path_cstr()) != 0) {
+      output_internal("overlay umount failed [%s][%s]\n",
+                      strerror(errno), mdir.path_cstr());
+      return false;
+    }
+    return true;
+  }
 #ifdef USE_UNIONFSFUSE
   const char *fusermount_path, *fusermount_prog;
   const char *fusermount_umount;
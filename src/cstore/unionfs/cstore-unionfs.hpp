@@ -18,6 +18,7 @@
 #define _CSTORE_UNIONFS_H_
 #include <vector>
 #include <string>
+#include <tr1/memory>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -29,6 +30,7 @@
 #include <cli_cstore.h>
 #include <cstore/cstore.hpp>
 #include <cstore/unionfs/fspath.hpp>
+#include <cstore/unionfs/commit-markers.hpp>
 
 // forward decl
 namespace commit {
@@ -48,6 +50,9 @@ public:
   UnionfsCstore(const string& session_id, string& env);
   virtual ~UnionfsCstore();
 
+  // clear the caches of escaped/unescaped names (see Cstore::clearCaches())
+  static void clearNameCaches();
+
   ////// public virtual functions declared in base class
   bool markSessionUnsaved();
   bool unmarkSessionUnsaved();
@@ -59,8 +64,16 @@ public:
   bool clearCommittedMarkers();
   bool commitConfig(commit::PrioNode& pnode);
   bool getCommitLock();
+  Cstore *createTmplReader() {
+    // only the template tree and paths are needed
+    return (new UnionfsCstore(*this));
+  };
 
-private:
+protected:
+  /* note: the following are accessible to subclasses so that other
+   *       backends (e.g., snapshot) can reuse the path and template
+   *       handling and only implement the config storage.
+   */
   // constants
   static const string C_ENV_TMPL_ROOT;
   static const string C_ENV_WORK_ROOT;
@@ -75,6 +88,12 @@ private:
   static const string C_DEF_WORK_PREFIX;
   static const string C_DEF_TMP_PREFIX;
 
+  // union mount type (see do_mount())
+  static const string C_ENV_UNION_MOUNT;
+  static const string C_UNION_MOUNT_OVERLAY;
+  static const string C_OVERLAY_WORK_DIR;
+  static const string C_MOUNT_LOCK_FILE;
+
   static const string C_MARKER_DEF_VALUE;
   static const string C_MARKER_DEACTIVATE;
   static const string C_MARKER_CHANGED;
@@ -86,6 +105,11 @@ private:
   static const string C_VAL_NAME;
   static const string C_DEF_NAME;
   static const string C_COMMIT_LOCK_FILE;
+  /* suffix of the snapshot store's files (see cstore-snapshot.cpp). the
+   * snapshot store's copy of the active config is removed when a commit
+   * modifies the active config dir.
+   */
+  static const string C_SNAPSHOT_SUFFIX;
 
   /* max size for a file.
    * currently this includes value file and comment file.
@@ -99,6 +123,9 @@ private:
   FsPath tmp_root;    // temp root
   FsPath tmpl_root;   // template root
 
+  // session mount lock (see do_mount()). -1 if not held.
+  int mount_lock_fd;
+
   // path buffers
   FsPath mutable_cfg_path;  // mutable part of config path
   FsPath tmpl_path;         // whole template path
@@ -109,6 +136,7 @@ private:
   FsPath tmp_active_root;
   FsPath tmp_work_root;
   FsPath commit_marker_file;
+  tr1::shared_ptr<CommitMarkers> commit_markers;
   void init_commit_data() {
     tmp_active_root = tmp_root;
     tmp_work_root = tmp_root;
@@ -116,11 +144,39 @@ private:
     tmp_active_root.push("active");
     tmp_work_root.push("work");
     commit_marker_file.push(C_COMMITTED_MARKER_FILE);
+    commit_markers.reset(new CommitMarkers(commit_marker_file.path_cstr()));
   }
   bool construct_commit_active(commit::PrioNode& node);
   bool mark_dir_changed(const FsPath& d, const FsPath& root);
   bool sync_dir(const FsPath& src, const FsPath& dst, const FsPath& root);
 
+  // for incremental commit processing
+  struct IncCommitOp {
+    enum OpType {
+      ADD_DIR,
+      DEL_DIR,
+      PUT_FILE,
+      DEL_FILE
+    };
+    IncCommitOp(OpType t, const FsPath& p, const FsPath& s)
+      : type(t), path(p), staged(s), trash(), saved(false),
+        touched(false) {};
+    OpType type;
+    FsPath path;   // relative to the config root
+    FsPath staged; // staged content (for ADD_DIR and PUT_FILE)
+    FsPath trash;  // where the replaced/deleted active content is saved
+    bool saved;    // active content has been saved in trash
+    bool touched;  // active path may have been modified
+  };
+  bool commit_config_incremental(bool& modified);
+  bool stage_changed_node(const FsPath& rel, const FsPath& stage,
+                          vector<IncCommitOp>& ops);
+  bool move_commit_entry(const FsPath& from, const FsPath& to, bool is_dir);
+  bool apply_commit_op(IncCommitOp& op);
+  bool undo_commit_op(const IncCommitOp& op);
+  bool read_dir_raw(const FsPath& d, vector<string>& files,
+                    vector<string>& dirs);
+
   ////// virtual functions defined in base class
   // begin path modifiers
   void push_tmpl_path(const char *new_comp) {
@@ -212,9 +268,7 @@ private:
   bool add_node();
   bool remove_node();
   void get_all_child_node_names_impl(vector<string>& cnodes, bool active_cfg);
-  void get_all_tmpl_child_node_names(vector<string>& cnodes) {
-    get_all_child_dir_names(tmpl_path, cnodes);
-  };
+  void get_all_tmpl_child_node_names(vector<string>& cnodes);
   bool write_value_vec(const vector<string>& vvec, bool active_cfg);
   bool rename_child_node(const char *oname, const char *nname);
   bool copy_child_node(const char *oname, const char *nname);
@@ -238,6 +292,7 @@ private:
   bool marked_deactivated(bool active_cfg);
   bool get_comment(string& comment, bool active_cfg);
   bool marked_display_default(bool active_cfg);
+  bool read_cfg_subtree(CfgRawNode& root, bool active_cfg, bool recursive);
 
   // observers for "edit/tmpl levels" (for "edit"-related operations).
   // note that these should be moved to base class in the future.
@@ -267,8 +322,11 @@ private:
   void push_path(FsPath& old_path, const char *new_comp);
   void pop_path(FsPath& path);
   void pop_path(FsPath& path, string& last);
+  static string unescape_name(const string& name);
+  static void split_values(const string& ostr, vector<string>& vvec);
   bool check_dir_entries(const FsPath& root, vector<string> *cnodes,
-                         bool filter_nodes = true, bool empty_check = false);
+                         bool filter_nodes = true, bool empty_check = false,
+                         vector<unsigned char> *types = NULL);
   bool is_directory_empty(const FsPath& d) {
     return (!check_dir_entries(d, NULL, false, true));
   }
@@ -288,11 +346,26 @@ private:
     return write_file(file, "");
   };
   bool read_whole_file(const FsPath& file, string& data);
+  bool read_dir_entries_at(int dfd, vector<string>& names,
+                           vector<unsigned char>& types);
+  bool read_file_at(int dfd, const char *name, string& data);
+  void read_subtree_at(int dfd, CfgRawNode& node, bool recursive = true);
+  class ReadChildDirsTask;
+  void read_child_dirs_at(int dfd, const vector<string>& names,
+                          const vector<size_t>& dirs, CfgRawNode& node,
+                          size_t begin, size_t end);
   void recursive_copy_dir(const FsPath& src, const FsPath& dst,
                           bool filter_dot_entries = false);
+  void copy_dir_at(int sfd, int dfd, const FsPath& src, const FsPath& dst,
+                   bool filter_dot_entries);
   void get_committed_marker(bool is_delete, string& marker);
-  bool find_line_in_file(const FsPath& file, const string& line);
+  bool use_overlay();
+  bool other_session_mounted(const FsPath& mdir, bool overlay_only);
+  bool lock_session_mounts(const FsPath& mdir);
+  void unlock_session_mounts();
   bool do_mount(const FsPath& rwdir, const FsPath& rdir, const FsPath& mdir);
+  bool union_mount(const FsPath& rwdir, const FsPath& rdir,
+                   const FsPath& mdir, bool overlay);
   bool do_umount(const FsPath& mdir);
 
   // boost fs operations wrappers
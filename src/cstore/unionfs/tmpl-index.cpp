@@ -0,0 +1,670 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+
+#include <cli_cstore.h>
+#include <cstore/util.hpp>
+#include <cstore/unionfs/fspath.hpp>
+#include <cstore/unionfs/tmpl-index.hpp>
+#include <cstore/work-pool.hpp>
+
+namespace cstore { // begin namespace cstore
+namespace unionfs { // begin namespace unionfs
+
+////// constants
+const char TmplIndex::C_MAGIC[8] = { 'V', 'Y', 'T', 'M', 'P', 'L', 'I', 'X' };
+
+static const char *C_IDX_SUFFIX = ".idx";
+static const char *C_DEF_NAME = "node.def";
+
+
+////// index writer
+/* builds the index file in memory. all objects are 8-byte aligned and
+ * referenced by offset. pointers in the parsed templates are converted to
+ * offsets, and action nodes reachable through multiple pointers (e.g., the
+ * "tail" of an action list) are only written once.
+ */
+class TmplIndex::Writer {
+public:
+  Writer() : _buf(), _ptr_map() {
+    alloc(sizeof(Header));
+  };
+
+  uint64_t addStr(const char *str);
+  uint64_t addDef(const vtw_def *def);
+  uint64_t addEntry(const string& path, uint64_t def_off,
+                    const struct stat *st, const vector<string>& cnodes);
+  bool write(const string& root, const string& file);
+
+private:
+  vector<char> _buf;
+  MapT<const void *, uint64_t> _ptr_map;
+  vector<uint64_t> _entries;
+
+  uint64_t alloc(size_t len);
+  template<class T> T *at(uint64_t off) {
+    return reinterpret_cast<T *>(&(_buf[off]));
+  };
+  template<class T> static void set_off(T *& ptr, uint64_t off) {
+    ptr = reinterpret_cast<T *>(static_cast<uintptr_t>(off));
+  };
+  uint64_t add_node(const vtw_node *node, vector<uint64_t>& nodes);
+};
+
+uint64_t
+TmplIndex::Writer::alloc(size_t len)
+{
+  uint64_t off = _buf.size();
+  _buf.resize(off + ((len + 7) & ~((size_t) 7)), 0);
+  return off;
+}
+
+uint64_t
+TmplIndex::Writer::addStr(const char *str)
+{
+  if (!str) {
+    return 0;
+  }
+  size_t len = strlen(str) + 1;
+  uint64_t off = alloc(len);
+  memcpy(at<char>(off), str, len);
+  return off;
+}
+
+uint64_t
+TmplIndex::Writer::add_node(const vtw_node *node, vector<uint64_t>& nodes)
+{
+  if (!node) {
+    return 0;
+  }
+  MapT<const void *, uint64_t>::iterator it = _ptr_map.find(node);
+  if (it != _ptr_map.end()) {
+    return it->second;
+  }
+  uint64_t off = alloc(sizeof(vtw_node));
+  _ptr_map[node] = off;
+  nodes.push_back(off);
+
+  // note: buffer may be reallocated below, so copy first and fix later
+  vtw_node n = *node;
+  uint64_t left = add_node(node->vtw_node_left, nodes);
+  uint64_t right = add_node(node->vtw_node_right, nodes);
+  set_off(n.vtw_node_left, left);
+  set_off(n.vtw_node_right, right);
+  set_off(n.vtw_node_string, addStr(node->vtw_node_string));
+
+  const valstruct& val = node->vtw_node_val;
+  set_off(n.vtw_node_val.val, addStr(val.val));
+  set_off(n.vtw_node_val.vals, 0);
+  set_off(n.vtw_node_val.val_types, 0);
+  if (val.cnt > 0 && val.vals) {
+    vector<uint64_t> voffs;
+    for (int i = 0; i < val.cnt; i++) {
+      voffs.push_back(addStr(val.vals[i]));
+    }
+    uint64_t aoff = alloc(sizeof(char *) * val.cnt);
+    for (int i = 0; i < val.cnt; i++) {
+      set_off(at<char *>(aoff)[i], voffs[i]);
+    }
+    set_off(n.vtw_node_val.vals, aoff);
+  }
+  if (val.cnt > 0 && val.val_types) {
+    uint64_t aoff = alloc(sizeof(vtw_type_e) * val.cnt);
+    memcpy(at<vtw_type_e>(aoff), val.val_types,
+           sizeof(vtw_type_e) * val.cnt);
+    set_off(n.vtw_node_val.val_types, aoff);
+  }
+  *at<vtw_node>(off) = n;
+  return off;
+}
+
+uint64_t
+TmplIndex::Writer::addDef(const vtw_def *def)
+{
+  DefRec rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.def = *def;
+  vtw_def& d = rec.def;
+  set_off(d.def_type_help, addStr(def->def_type_help));
+  set_off(d.def_node_help, addStr(def->def_node_help));
+  set_off(d.def_default, addStr(def->def_default));
+  set_off(d.def_priority_ext, addStr(def->def_priority_ext));
+  set_off(d.def_enumeration, addStr(def->def_enumeration));
+  set_off(d.def_comp_help, addStr(def->def_comp_help));
+  set_off(d.def_allowed, addStr(def->def_allowed));
+  set_off(d.def_val_help, addStr(def->def_val_help));
+  set_off(d.def_depends, addStr(def->def_depends));
+
+  vector<uint64_t> nodes;
+  for (size_t i = 0; i < top_act; i++) {
+    set_off(d.actions[i].vtw_list_head,
+            add_node(def->actions[i].vtw_list_head, nodes));
+    set_off(d.actions[i].vtw_list_tail,
+            add_node(def->actions[i].vtw_list_tail, nodes));
+  }
+  rec.num_nodes = nodes.size();
+  if (nodes.size() > 0) {
+    rec.nodes_off = alloc(sizeof(uint64_t) * nodes.size());
+    memcpy(at<uint64_t>(rec.nodes_off), &(nodes[0]),
+           sizeof(uint64_t) * nodes.size());
+  }
+  uint64_t off = alloc(sizeof(DefRec));
+  *at<DefRec>(off) = rec;
+  return off;
+}
+
+uint64_t
+TmplIndex::Writer::addEntry(const string& path, uint64_t def_off,
+                            const struct stat *st,
+                            const vector<string>& cnodes)
+{
+  Entry e;
+  memset(&e, 0, sizeof(e));
+  e.path_off = addStr(path.c_str());
+  e.def_off = def_off;
+  if (st) {
+    e.mtime = st->st_mtim.tv_sec;
+    e.mtime_nsec = st->st_mtim.tv_nsec;
+    e.size = st->st_size;
+  }
+  e.num_children = cnodes.size();
+  if (cnodes.size() > 0) {
+    vector<uint64_t> coffs;
+    for (size_t i = 0; i < cnodes.size(); i++) {
+      coffs.push_back(addStr(cnodes[i].c_str()));
+    }
+    e.children_off = alloc(sizeof(uint64_t) * coffs.size());
+    memcpy(at<uint64_t>(e.children_off), &(coffs[0]),
+           sizeof(uint64_t) * coffs.size());
+  }
+  uint64_t off = alloc(sizeof(Entry));
+  *at<Entry>(off) = e;
+  _entries.push_back(off);
+  return off;
+}
+
+bool
+TmplIndex::Writer::write(const string& root, const string& file)
+{
+  // open-addressing hash table with load factor <= 0.5
+  uint64_t nbuckets = 16;
+  while (nbuckets < _entries.size() * 2) {
+    nbuckets *= 2;
+  }
+  uint64_t root_off = addStr(root.c_str());
+  uint64_t boff = alloc(sizeof(uint64_t) * nbuckets);
+  for (size_t i = 0; i < _entries.size(); i++) {
+    const char *path = at<char>(at<Entry>(_entries[i])->path_off);
+    uint64_t b = (hash_str(path) & (nbuckets - 1));
+    while (at<uint64_t>(boff)[b] != 0) {
+      b = ((b + 1) & (nbuckets - 1));
+    }
+    at<uint64_t>(boff)[b] = _entries[i];
+  }
+
+  Header *hdr = at<Header>(0);
+  memcpy(hdr->magic, C_MAGIC, sizeof(hdr->magic));
+  hdr->version = C_VERSION;
+  hdr->sz_ptr = sizeof(void *);
+  hdr->sz_def = sizeof(vtw_def);
+  hdr->sz_node = sizeof(vtw_node);
+  hdr->file_size = _buf.size();
+  hdr->root_off = root_off;
+  hdr->num_entries = _entries.size();
+  hdr->num_buckets = nbuckets;
+  hdr->buckets_off = boff;
+
+  /* write to a temp file and rename so that readers never see partial
+   * file. the temp file is unique so that concurrent builds (e.g., the
+   * package trigger and postinst) don't write to the same file.
+   */
+  string tmp = file + ".XXXXXX";
+  vector<char> tbuf(tmp.begin(), tmp.end());
+  tbuf.push_back(0);
+  int fd = mkstemp(&(tbuf[0]));
+  if (fd < 0) {
+    return false;
+  }
+  tmp = &(tbuf[0]);
+  FILE *fp = NULL;
+  // readable by all like a normally created file
+  if (fchmod(fd, 0644) != 0 || !(fp = fdopen(fd, "w"))) {
+    close(fd);
+    unlink(tmp.c_str());
+    return false;
+  }
+  bool ret = (fwrite(&(_buf[0]), _buf.size(), 1, fp) == 1);
+  ret = ((fclose(fp) == 0) && ret);
+  if (!ret || rename(tmp.c_str(), file.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+
+////// build
+uint64_t
+TmplIndex::hash_str(const char *str)
+{
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+    h ^= *p;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+string
+TmplIndex::getIndexFile(const string& tmpl_root)
+{
+  FsPath root(tmpl_root);
+  return (string(root.path_cstr()) + C_IDX_SUFFIX);
+}
+
+bool
+TmplIndex::build(const string& tmpl_root, const string& idx_file)
+{
+  Writer w;
+  FsPath root(tmpl_root);
+  if (!build_dir(w, root)) {
+    return false;
+  }
+  return w.write(root.path_cstr(), idx_file);
+}
+
+// recursively add the template dir "dir" to the index
+bool
+TmplIndex::build_dir(Writer& w, FsPath& dir)
+{
+  DIR *dp = opendir(dir.path_cstr());
+  if (!dp) {
+    fprintf(stderr, "Failed to open template dir [%s]\n", dir.path_cstr());
+    return false;
+  }
+  vector<string> cnodes;
+  bool has_def = false;
+  struct dirent *de;
+  while ((de = readdir(dp))) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+      continue;
+    }
+    if (strcmp(de->d_name, C_DEF_NAME) == 0) {
+      has_def = true;
+      continue;
+    }
+    FsPath c(dir);
+    c.push(de->d_name);
+    struct stat st;
+    if (stat(c.path_cstr(), &st) == 0 && S_ISDIR(st.st_mode)) {
+      cnodes.push_back(de->d_name);
+    }
+  }
+  closedir(dp);
+  sort(cnodes.begin(), cnodes.end());
+
+  struct stat dst;
+  if (stat(dir.path_cstr(), &dst) != 0) {
+    fprintf(stderr, "Failed to stat template dir [%s]\n", dir.path_cstr());
+    return false;
+  }
+  w.addEntry(dir.path_cstr(), 0, &dst, cnodes);
+  if (has_def) {
+    FsPath dpath(dir);
+    dpath.push(C_DEF_NAME);
+    struct stat st;
+    vtw_def def;
+    memset(&def, 0, sizeof(def));
+    if (stat(dpath.path_cstr(), &st) == 0 && S_ISREG(st.st_mode)
+        && parse_def(&def, dpath.path_cstr(), 0) == 0) {
+      vector<string> empty;
+      w.addEntry(dpath.path_cstr(), w.addDef(&def), &st, empty);
+    } else {
+      // not fatal. the template will just be parsed at runtime.
+      fprintf(stderr, "Failed to parse template [%s]\n", dpath.path_cstr());
+    }
+  }
+
+  for (size_t i = 0; i < cnodes.size(); i++) {
+    dir.push(cnodes[i]);
+    bool ret = build_dir(w, dir);
+    dir.pop();
+    if (!ret) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+////// lookup
+typedef MapT<string, TmplIndex *> TmplIndexMapT;
+static TmplIndexMapT _tmpl_indexes;
+static RwLock _tmpl_indexes_lock;
+
+// deleter for templates in the index (nothing to free)
+struct NullDefDeleter {
+  void operator()(vtw_def *def) const {};
+};
+
+TmplIndex::~TmplIndex()
+{
+  munmap(_base, _len);
+}
+
+TmplIndex *
+TmplIndex::getIndex(const string& tmpl_root)
+{
+  RwLock::Write l(_tmpl_indexes_lock);
+  TmplIndexMapT::iterator it = _tmpl_indexes.find(tmpl_root);
+  if (it != _tmpl_indexes.end()) {
+    return it->second;
+  }
+  // cache negative result as well
+  _tmpl_indexes[tmpl_root] = NULL;
+
+  string file = getIndexFile(tmpl_root);
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(Header)) {
+    /* private writable mapping since templates are relocated in place.
+     * only the pages actually used are copied.
+     */
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+
+  TmplIndex *idx = new TmplIndex(static_cast<char *>(base), st.st_size);
+  const Header *hdr = reinterpret_cast<const Header *>(base);
+  FsPath root(tmpl_root);
+  if (memcmp(hdr->magic, C_MAGIC, sizeof(hdr->magic)) != 0
+      || hdr->version != C_VERSION || hdr->sz_ptr != sizeof(void *)
+      || hdr->sz_def != sizeof(vtw_def) || hdr->sz_node != sizeof(vtw_node)
+      || hdr->file_size != (uint64_t) st.st_size
+      || !idx->valid_str(hdr->root_off)
+      || !idx->valid_range(hdr->buckets_off, hdr->num_buckets,
+                           sizeof(uint64_t))
+      || hdr->num_buckets == 0
+      || (hdr->num_buckets & (hdr->num_buckets - 1)) != 0
+      || strcmp(idx->get_str(hdr->root_off), root.path_cstr()) != 0) {
+    // invalid or for a different root
+    delete idx;
+    return NULL;
+  }
+  _tmpl_indexes[tmpl_root] = idx;
+  return idx;
+}
+
+/* whether "num" objects of "size" bytes at "off" are within the mapping
+ * (and aligned as written, see Writer::alloc()).
+ */
+bool
+TmplIndex::valid_range(uint64_t off, uint64_t num, size_t size) const
+{
+  return (off != 0 && (off & 7) == 0 && off <= _len
+          && num <= (_len - off) / size);
+}
+
+// whether a NUL-terminated string starts at "off" within the mapping
+bool
+TmplIndex::valid_str(uint64_t off) const
+{
+  return (off != 0 && off < _len
+          && memchr(_base + off, 0, _len - off) != NULL);
+}
+
+const TmplIndex::Entry *
+TmplIndex::find_entry(const char *path) const
+{
+  // bucket array checked in getIndex()
+  const Header *hdr = reinterpret_cast<const Header *>(_base);
+  const uint64_t *buckets
+    = reinterpret_cast<const uint64_t *>(_base + hdr->buckets_off);
+  uint64_t mask = hdr->num_buckets - 1;
+  uint64_t b = (hash_str(path) & mask);
+  for (uint64_t i = 0; i < hdr->num_buckets && buckets[b] != 0; i++) {
+    if (!valid_range(buckets[b], 1, sizeof(Entry))) {
+      return NULL;
+    }
+    const Entry *e = reinterpret_cast<const Entry *>(_base + buckets[b]);
+    if (!valid_str(e->path_off)) {
+      return NULL;
+    }
+    if (strcmp(get_str(e->path_off), path) == 0) {
+      return e;
+    }
+    b = ((b + 1) & mask);
+  }
+  return NULL;
+}
+
+// whether the file/dir has not changed since the index was built
+bool
+TmplIndex::fresh(const Entry *e, const struct stat& st) const
+{
+  return (e->mtime == st.st_mtim.tv_sec && e->mtime_nsec == st.st_mtim.tv_nsec
+          && e->size == (uint64_t) st.st_size);
+}
+
+template<class T> void
+TmplIndex::relocate(T *& ptr)
+{
+  uintptr_t off = reinterpret_cast<uintptr_t>(ptr);
+  ptr = (off ? reinterpret_cast<T *>(_base + off) : NULL);
+}
+
+/* whether everything referenced by the (not yet relocated) template at
+ * "def_off" is valid. the template, its nodes, and their value arrays must
+ * not overlap since each of them is relocated exactly once.
+ */
+bool
+TmplIndex::valid_def(uint64_t def_off) const
+{
+  if (!valid_range(def_off, 1, sizeof(DefRec))) {
+    return false;
+  }
+  const DefRec *rec = reinterpret_cast<const DefRec *>(_base + def_off);
+  const vtw_def& d = rec->def;
+  // start => end of each region that is relocated
+  map<uint64_t, uint64_t> regions;
+  regions[def_off] = def_off + sizeof(DefRec);
+  const char *strs[] = {
+    d.def_type_help, d.def_node_help, d.def_default, d.def_priority_ext,
+    d.def_enumeration, d.def_comp_help, d.def_allowed, d.def_val_help,
+    d.def_depends
+  };
+  for (size_t i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+    if (strs[i] && !valid_str(get_off(strs[i]))) {
+      return false;
+    }
+  }
+  if (rec->num_nodes > 0
+      && !valid_range(rec->nodes_off, rec->num_nodes, sizeof(uint64_t))) {
+    return false;
+  }
+  // all node pointers must refer to the nodes of the template
+  MapT<uint64_t, bool> nodes;
+  const uint64_t *noffs
+    = reinterpret_cast<const uint64_t *>(_base + rec->nodes_off);
+  for (uint64_t i = 0; i < rec->num_nodes; i++) {
+    if (!valid_range(noffs[i], 1, sizeof(vtw_node))
+        || regions.find(noffs[i]) != regions.end()) {
+      return false;
+    }
+    nodes[noffs[i]] = true;
+    regions[noffs[i]] = noffs[i] + sizeof(vtw_node);
+  }
+  for (size_t i = 0; i < top_act; i++) {
+    uint64_t h = get_off(d.actions[i].vtw_list_head);
+    uint64_t t = get_off(d.actions[i].vtw_list_tail);
+    if ((h && nodes.find(h) == nodes.end())
+        || (t && nodes.find(t) == nodes.end())) {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < rec->num_nodes; i++) {
+    const vtw_node *n = reinterpret_cast<const vtw_node *>(_base + noffs[i]);
+    uint64_t l = get_off(n->vtw_node_left);
+    uint64_t r = get_off(n->vtw_node_right);
+    if ((l && nodes.find(l) == nodes.end())
+        || (r && nodes.find(r) == nodes.end())
+        || (n->vtw_node_string
+            && !valid_str(get_off(n->vtw_node_string)))
+        || (n->vtw_node_val.val
+            && !valid_str(get_off(n->vtw_node_val.val)))) {
+      return false;
+    }
+    const valstruct& val = n->vtw_node_val;
+    if ((val.vals || val.val_types) && val.cnt <= 0) {
+      return false;
+    }
+    if (val.val_types
+        && !valid_range(get_off(val.val_types), val.cnt,
+                        sizeof(vtw_type_e))) {
+      return false;
+    }
+    if (val.vals) {
+      uint64_t voff = get_off(val.vals);
+      if (!valid_range(voff, val.cnt, sizeof(char *))
+          || regions.find(voff) != regions.end()) {
+        return false;
+      }
+      regions[voff] = voff + sizeof(char *) * val.cnt;
+      char *const *vals
+        = reinterpret_cast<char *const *>(_base + get_off(val.vals));
+      for (int j = 0; j < val.cnt; j++) {
+        if (vals[j] && !valid_str(get_off(vals[j]))) {
+          return false;
+        }
+      }
+    }
+  }
+  uint64_t end = 0;
+  for (map<uint64_t, uint64_t>::iterator it = regions.begin();
+       it != regions.end(); ++it) {
+    if (it->first < end) {
+      return false;
+    }
+    end = it->second;
+  }
+  return true;
+}
+
+void
+TmplIndex::relocate_def(DefRec *rec)
+{
+  vtw_def& d = rec->def;
+  relocate(d.def_type_help);
+  relocate(d.def_node_help);
+  relocate(d.def_default);
+  relocate(d.def_priority_ext);
+  relocate(d.def_enumeration);
+  relocate(d.def_comp_help);
+  relocate(d.def_allowed);
+  relocate(d.def_val_help);
+  relocate(d.def_depends);
+  for (size_t i = 0; i < top_act; i++) {
+    relocate(d.actions[i].vtw_list_head);
+    relocate(d.actions[i].vtw_list_tail);
+  }
+  // each node in the template is listed exactly once
+  const uint64_t *nodes
+    = reinterpret_cast<const uint64_t *>(_base + rec->nodes_off);
+  for (uint64_t i = 0; i < rec->num_nodes; i++) {
+    vtw_node *n = reinterpret_cast<vtw_node *>(_base + nodes[i]);
+    relocate(n->vtw_node_left);
+    relocate(n->vtw_node_right);
+    relocate(n->vtw_node_string);
+    relocate(n->vtw_node_val.val);
+    relocate(n->vtw_node_val.vals);
+    relocate(n->vtw_node_val.val_types);
+    if (n->vtw_node_val.vals) {
+      for (int j = 0; j < n->vtw_node_val.cnt; j++) {
+        relocate(n->vtw_node_val.vals[j]);
+      }
+    }
+  }
+}
+
+tr1::shared_ptr<vtw_def>
+TmplIndex::getDef(const char *def_path, const struct stat& st)
+{
+  const Entry *e = find_entry(def_path);
+  if (!e || e->def_off == 0) {
+    return tr1::shared_ptr<vtw_def>();
+  }
+  if (!fresh(e, st)) {
+    return tr1::shared_ptr<vtw_def>();
+  }
+  if (_relocated.find(e->def_off) == _relocated.end()) {
+    if (!valid_def(e->def_off)) {
+      return tr1::shared_ptr<vtw_def>();
+    }
+    relocate_def(reinterpret_cast<DefRec *>(_base + e->def_off));
+    _relocated[e->def_off] = true;
+  }
+  DefRec *rec = reinterpret_cast<DefRec *>(_base + e->def_off);
+  return tr1::shared_ptr<vtw_def>(&(rec->def), NullDefDeleter());
+}
+
+bool
+TmplIndex::getChildNames(const char *tmpl_dir, const struct stat& st,
+                         vector<string>& cnodes)
+{
+  const Entry *e = find_entry(tmpl_dir);
+  if (!e || e->def_off != 0 || !fresh(e, st)) {
+    return false;
+  }
+  if (e->num_children == 0) {
+    return true;
+  }
+  if (!valid_range(e->children_off, e->num_children, sizeof(uint64_t))) {
+    return false;
+  }
+  const uint64_t *coffs
+    = reinterpret_cast<const uint64_t *>(_base + e->children_off);
+  vector<string> names;
+  for (uint64_t i = 0; i < e->num_children; i++) {
+    if (!valid_str(coffs[i])) {
+      return false;
+    }
+    names.push_back(get_str(coffs[i]));
+  }
+  cnodes.insert(cnodes.end(), names.begin(), names.end());
+  return true;
+}
+
+} // end namespace unionfs
+} // end namespace cstore
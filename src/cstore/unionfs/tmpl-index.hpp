@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TMPL_INDEX_HPP_
+#define _TMPL_INDEX_HPP_
+#include <vector>
+#include <string>
+#include <tr1/memory>
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <cli_cstore.h>
+#include <cstore/util.hpp>
+#include <cstore/unionfs/fspath.hpp>
+
+namespace cstore { // begin namespace cstore
+namespace unionfs { // begin namespace unionfs
+
+using namespace std;
+
+/* precompiled template index.
+ *
+ * the index is a single memory-mappable file containing the parsed
+ * templates (vtw_def including all the action trees) of a whole template
+ * tree together with the template hierarchy (child nodes of each template
+ * dir). it is generated by "build_tmpl_index" at install time so that a
+ * process can resolve templates without opening/parsing any "node.def".
+ *
+ * all pointers in the file are stored as offsets from the beginning of the
+ * file, and a template is "relocated" in place (in the private mapping)
+ * the first time it is looked up. a template whose "node.def" has a
+ * different mtime/size than when the index was built is considered stale
+ * and not returned, in which case the caller should parse it normally.
+ * similarly, the children of a template dir are only returned if the mtime
+ * of the dir has not changed.
+ *
+ * all offsets read from the file are checked against the size of the
+ * mapping before use. anything invalid (e.g., a truncated or corrupt file)
+ * is treated as not found, so the templates are parsed normally. which
+ * templates have been relocated is tracked in memory, not in the file.
+ */
+class TmplIndex {
+public:
+  ~TmplIndex();
+
+  /* return the index for the specified template root, or NULL if there
+   * is no (valid) index. the index is opened once per process.
+   */
+  static TmplIndex *getIndex(const string& tmpl_root);
+
+  // build the index for the specified template root
+  static bool build(const string& tmpl_root, const string& idx_file);
+
+  // index file for the specified template root
+  static string getIndexFile(const string& tmpl_root);
+
+  /* return the parsed template for the specified "node.def" (st is the
+   * stat of the file). return empty pointer if not found or stale.
+   * note: this relocates the template in place, so callers in different
+   *       threads must serialize the calls.
+   */
+  tr1::shared_ptr<vtw_def> getDef(const char *def_path,
+                                  const struct stat& st);
+
+  /* template hierarchy: return all child dirs of the specified template
+   * dir (st is the stat of the dir). return false if the dir is not in the
+   * index or stale, in which case caller should list the dir itself.
+   */
+  bool getChildNames(const char *tmpl_dir, const struct stat& st,
+                     vector<string>& cnodes);
+
+private:
+  // file format
+  static const char C_MAGIC[8];
+  static const uint32_t C_VERSION = 4;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t sz_ptr;
+    uint32_t sz_def;
+    uint32_t sz_node;
+    uint64_t file_size;
+    uint64_t root_off;
+    uint64_t num_entries;
+    uint64_t num_buckets;
+    uint64_t buckets_off;
+  };
+
+  struct Entry {
+    uint64_t path_off;
+    uint64_t def_off;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t size;
+    uint64_t num_children;
+    uint64_t children_off;
+  };
+
+  struct DefRec {
+    vtw_def def;
+    uint64_t num_nodes;
+    uint64_t nodes_off;
+  };
+
+  class Writer;
+
+  TmplIndex(char *base, size_t len) : _base(base), _len(len) {};
+
+  static uint64_t hash_str(const char *str);
+  static bool build_dir(Writer& w, FsPath& dir);
+
+  const Entry *find_entry(const char *path) const;
+  bool fresh(const Entry *e, const struct stat& st) const;
+  const char *get_str(uint64_t off) const { return (_base + off); };
+  bool valid_range(uint64_t off, uint64_t num, size_t size) const;
+  bool valid_str(uint64_t off) const;
+  template<class T> static uint64_t get_off(T *ptr) {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(ptr));
+  };
+  bool valid_def(uint64_t def_off) const;
+  template<class T> void relocate(T *& ptr);
+  void relocate_def(DefRec *rec);
+
+  char *_base;
+  size_t _len;
+  MapT<uint64_t, bool> _relocated;
+};
+
+} // end namespace unionfs
+} // end namespace cstore
+
+#endif /* _TMPL_INDEX_HPP_ */
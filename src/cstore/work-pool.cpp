@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include <cstore/work-pool.hpp>
+
+using namespace cstore;
+using namespace std;
+
+////// constants
+const char *WorkPool::C_ENV_THREADS = "VYOS_CFG_THREADS";
+
+__thread size_t WorkPool::_thread_idx = 0;
+
+////// static
+static WorkPool *_pool = NULL;
+static pthread_once_t _pool_once = PTHREAD_ONCE_INIT;
+
+struct WorkerArg {
+  WorkerArg(WorkPool *p, size_t i) : pool(p), idx(i) {};
+  WorkPool *pool;
+  size_t idx;
+};
+
+
+////// class WorkPool
+WorkPool *
+WorkPool::get()
+{
+  struct Init {
+    static void init() {
+      long n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+      const char *t = getenv(C_ENV_THREADS);
+      if (t && t[0]) {
+        n = strtol(t, NULL, 10) - 1;
+      }
+      if (n > (long) C_MAX_WORKERS) {
+        n = C_MAX_WORKERS;
+      }
+      if (n > 0) {
+        _pool = new WorkPool(n);
+        if (_pool->numThreads() < 2) {
+          // failed to start any worker
+          _pool = NULL;
+        }
+      }
+    };
+  };
+  pthread_once(&_pool_once, &Init::init);
+  if (!_pool || _pool->_pid != getpid()) {
+    return NULL;
+  }
+  return _pool;
+}
+
+WorkPool *
+WorkPool::getForSplit(size_t n, size_t& chunk)
+{
+  if (n < C_MIN_SPLIT) {
+    return NULL;
+  }
+  WorkPool *pool = get();
+  if (!pool) {
+    return NULL;
+  }
+  // a few tasks per thread so that the load can be balanced
+  chunk = n / (pool->numThreads() * 4);
+  if (chunk < C_MIN_CHUNK) {
+    chunk = C_MIN_CHUNK;
+  }
+  return pool;
+}
+
+WorkPool::WorkPool(size_t num_workers)
+  : _pid(getpid()), _num_queued(0)
+{
+  pthread_mutex_init(&_idle_lock, NULL);
+  pthread_cond_init(&_idle_cond, NULL);
+  _queues.push_back(new Queue());
+  for (size_t i = 0; i < num_workers; i++) {
+    _queues.push_back(new Queue());
+  }
+  for (size_t i = 0; i < num_workers; i++) {
+    pthread_t t;
+    WorkerArg *arg = new WorkerArg(this, i + 1);
+    if (pthread_create(&t, NULL, worker_main, arg) != 0) {
+      delete arg;
+      // no stealing from queues without workers
+      _queues.resize(i + 1);
+      break;
+    }
+    pthread_detach(t);
+  }
+}
+
+void *
+WorkPool::worker_main(void *arg)
+{
+  WorkerArg *warg = static_cast<WorkerArg *>(arg);
+  WorkPool *pool = warg->pool;
+  _thread_idx = warg->idx;
+  delete warg;
+
+  while (1) {
+    if (pool->run_one()) {
+      continue;
+    }
+    pthread_mutex_lock(&pool->_idle_lock);
+    while (pool->_num_queued == 0) {
+      pthread_cond_wait(&pool->_idle_cond, &pool->_idle_lock);
+    }
+    pthread_mutex_unlock(&pool->_idle_lock);
+  }
+  return NULL;
+}
+
+void
+WorkPool::push(const Item& item)
+{
+  Queue *q = _queues[(_thread_idx < _queues.size() ? _thread_idx : 0)];
+  pthread_mutex_lock(&q->lock);
+  q->items.push_back(item);
+  pthread_mutex_unlock(&q->lock);
+  pthread_mutex_lock(&_idle_lock);
+  __sync_fetch_and_add(&_num_queued, 1);
+  pthread_cond_broadcast(&_idle_cond);
+  pthread_mutex_unlock(&_idle_lock);
+}
+
+// run one task from own queue or stolen from others. return false if none.
+bool
+WorkPool::run_one()
+{
+  size_t n = _queues.size();
+  size_t self = (_thread_idx < n ? _thread_idx : 0);
+  bool found = false;
+  Item item(NULL, NULL);
+  for (size_t i = 0; i < n && !found; i++) {
+    Queue *q = _queues[(self + i) % n];
+    pthread_mutex_lock(&q->lock);
+    if (!q->items.empty()) {
+      if (i == 0) {
+        // own queue: newest first
+        item = q->items.back();
+        q->items.pop_back();
+      } else {
+        // steal oldest (i.e., probably the biggest)
+        item = q->items.front();
+        q->items.pop_front();
+      }
+      found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  if (!found) {
+    return false;
+  }
+  __sync_fetch_and_sub(&_num_queued, 1);
+  item.task->run();
+  if (__sync_sub_and_fetch(&item.group->_pending, 1) == 0) {
+    notify();
+  }
+  return true;
+}
+
+void
+WorkPool::notify()
+{
+  pthread_mutex_lock(&_idle_lock);
+  pthread_cond_broadcast(&_idle_cond);
+  pthread_mutex_unlock(&_idle_lock);
+}
+
+
+////// class WorkPool::Group
+void
+WorkPool::Group::add(Task *task)
+{
+  if (!_pool) {
+    task->run();
+    return;
+  }
+  __sync_fetch_and_add(&_pending, 1);
+  _pool->push(Item(task, this));
+}
+
+void
+WorkPool::Group::wait()
+{
+  while (_pending > 0) {
+    if (_pool->run_one()) {
+      continue;
+    }
+    // nothing to run => wait for a task or a completion
+    pthread_mutex_lock(&_pool->_idle_lock);
+    if (_pending > 0 && _pool->_num_queued == 0) {
+      pthread_cond_wait(&_pool->_idle_cond, &_pool->_idle_lock);
+    }
+    pthread_mutex_unlock(&_pool->_idle_lock);
+  }
+  __sync_synchronize();
+}
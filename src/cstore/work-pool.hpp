@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2010 Vyatta, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WORK_POOL_HPP_
+#define _WORK_POOL_HPP_
+#include <vector>
+#include <deque>
+
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace cstore { // begin namespace cstore
+
+/* process-wide pool of worker threads for read-only work that can be split
+ * up, e.g., reading and constructing large config trees.
+ *
+ * each worker has its own task deque. a task added by a worker goes to the
+ * back of its own deque, and a worker runs tasks from the back of its own
+ * deque first and then steals from the front of the others (including the
+ * shared deque used by non-worker threads). a thread waiting for a group
+ * runs pending tasks instead of blocking, so a task can add subtasks and
+ * wait for them.
+ *
+ * the number of workers is the number of online CPUs minus one (the waiting
+ * thread also runs tasks), limited to C_MAX_WORKERS, or VYOS_CFG_THREADS
+ * minus one if set. get() returns NULL if there are no workers, in which
+ * case callers should just do the work themselves.
+ *
+ * note: the pool is not usable in a forked child (get() returns NULL).
+ */
+class WorkPool {
+public:
+  class Task {
+  public:
+    virtual ~Task() {};
+    virtual void run() = 0;
+  };
+
+  class Group {
+  public:
+    Group(WorkPool *pool) : _pool(pool), _pending(0) {};
+    ~Group() { wait(); };
+
+    /* run "task" in the pool (or right away if there is no pool). the
+     * task is owned by the caller and must stay valid until wait().
+     */
+    void add(Task *task);
+    void wait();
+
+  private:
+    friend class WorkPool;
+    WorkPool *_pool;
+    volatile long _pending;
+  };
+
+  static WorkPool *get();
+  /* return the pool if "n" items are worth splitting up into tasks, in
+   * which case "chunk" is set to the number of items per task. otherwise
+   * return NULL.
+   */
+  static WorkPool *getForSplit(size_t n, size_t& chunk);
+
+  // number of threads that may run tasks, i.e., the workers + caller
+  size_t numThreads() const { return (_queues.size()); };
+  /* index of the current thread, i.e., 1 to n for the workers and 0 for
+   * all other threads. this can be used to index per-thread state.
+   */
+  static size_t threadIndex() { return _thread_idx; };
+
+private:
+  static const char *C_ENV_THREADS;
+  static const size_t C_MAX_WORKERS = 15;
+  static const size_t C_MIN_SPLIT = 64;
+  static const size_t C_MIN_CHUNK = 16;
+
+  struct Item {
+    Item(Task *t, Group *g) : task(t), group(g) {};
+    Task *task;
+    Group *group;
+  };
+  struct Queue {
+    Queue() { pthread_mutex_init(&lock, NULL); };
+    pthread_mutex_t lock;
+    std::deque<Item> items;
+  };
+
+  static __thread size_t _thread_idx;
+
+  pid_t _pid;
+  std::vector<Queue *> _queues; // 0 is the shared queue
+  volatile long _num_queued;
+  pthread_mutex_t _idle_lock;
+  pthread_cond_t _idle_cond;
+
+  WorkPool(size_t num_workers);
+  ~WorkPool() {};
+
+  static void *worker_main(void *arg);
+  void push(const Item& item);
+  bool run_one();
+  void notify();
+};
+
+/* read/write lock for the process-wide caches that may be used by multiple
+ * threads (see WorkPool).
+ */
+class RwLock {
+public:
+  RwLock() { pthread_rwlock_init(&_lock, NULL); };
+  ~RwLock() { pthread_rwlock_destroy(&_lock); };
+
+  class Read {
+  public:
+    Read(RwLock& l) : _l(l) { pthread_rwlock_rdlock(&_l._lock); };
+    ~Read() { pthread_rwlock_unlock(&_l._lock); };
+  private:
+    RwLock& _l;
+  };
+  class Write {
+  public:
+    Write(RwLock& l) : _l(l) { pthread_rwlock_wrlock(&_l._lock); };
+    ~Write() { pthread_rwlock_unlock(&_l._lock); };
+  private:
+    RwLock& _l;
+  };
+
+private:
+  pthread_rwlock_t _lock;
+};
+
+} // end namespace cstore
+
+#endif /* _WORK_POOL_HPP_ */